@@ -0,0 +1,314 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks of the building blocks of the HAL, to compare builds on the
+// same device rather than to quote absolute numbers:
+//
+//   audio_bench mix [-d seconds] [-s streams] [-r rateHz]
+//   audio_bench convert
+//   audio_bench resample
+//   audio_bench wakeup [-d seconds] [-p periodMs]
+//
+// mix: `streams` writer threads feed stereo 16 bit sources at rateHz into a
+// StreamMixer playing to the PCM device as fast as their rings take it,
+// then the mixer telemetry is dumped: "wakeup to write" is the time spent
+// mixing a period, the audio written per stream should keep up with real
+// time. vendor.audio.pcm_backend=clocked runs it without a sound card.
+//
+// convert: the nanoseconds per sample of the format conversion kernels for
+// every client format, on a buffer that stays in the cache.
+//
+// resample: the cost of a stereo Resampler for the common rate conversions
+// at every quality, in nanoseconds per output frame and as how many times
+// faster than real time a single stream is converted.
+//
+// wakeup: a thread sleeps to deadlines one period apart, the way the IO
+// threads follow the device, first as a normal thread and then with the
+// IO thread priority (SCHED_FIFO and the vendor.audio.cpu_affinity CPUs
+// if allowed). How late it wakes up is the jitter the buffers absorb.
+
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <utils/Timers.h>
+#include "format_convert.h"
+#include "resampler.h"
+#include "stream_mixer.h"
+#include "stream_stats.h"
+#include "util.h"
+
+namespace {
+using ::android::hardware::audio::common::V6_0::AudioFormat;
+using ::android::hardware::audio::V6_0::implementation::Histogram;
+using ::android::hardware::audio::V6_0::implementation::Resampler;
+using ::android::hardware::audio::V6_0::implementation::StreamMixer;
+namespace convert = ::android::hardware::audio::V6_0::implementation::convert;
+namespace util = ::android::hardware::audio::V6_0::implementation::util;
+
+// every kernel runs this long, long enough to average the timer and the
+// scheduler out
+constexpr nsecs_t kMeasureNs = 200000000;
+
+void usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s mix [-d seconds] [-s streams] [-r rateHz]\n"
+            "       %s convert\n"
+            "       %s resample\n"
+            "       %s wakeup [-d seconds] [-p periodMs]\n",
+            program, program, program, program);
+}
+
+nsecs_t now() {
+    return systemTime(SYSTEM_TIME_MONOTONIC);
+}
+
+// Calls f() for kMeasureNs, returns the nanoseconds per call.
+template <class F> double measureNsPerCall(F f) {
+    const nsecs_t start = now();
+    uint64_t calls = 0;
+    nsecs_t elapsed;
+    do {
+        f();
+        ++calls;
+        elapsed = now() - start;
+    } while (elapsed < kMeasureNs);
+    return double(elapsed) / calls;
+}
+
+// Interleaved stereo 16 bit frames of a 1 kHz tone.
+std::vector<int16_t> makeTone(const size_t frames, const uint32_t sampleRateHz) {
+    std::vector<int16_t> pcm(frames * 2);
+    for (size_t i = 0; i < frames; ++i) {
+        pcm[2 * i] = pcm[2 * i + 1] = 3276 * sin(2 * M_PI * 1000 * i / sampleRateHz);
+    }
+    return pcm;
+}
+
+int runMix(const int durationS, const int nStreams, const uint32_t sampleRateHz) {
+    const size_t periodFrames = StreamMixer::kPeriodSizeFrames * sampleRateHz
+                                / StreamMixer::kSampleRateHz;
+    const std::vector<int16_t> tone = makeTone(periodFrames, sampleRateHz);
+
+    StreamMixer mixer;
+    std::vector<std::shared_ptr<StreamMixer::Source>> sources;
+    std::vector<std::atomic<uint64_t>> written(nStreams);
+    std::vector<std::thread> writers;
+    std::atomic<bool> done = false;
+    for (int i = 0; i < nStreams; ++i) {
+        sources.push_back(mixer.addSource(2, AudioFormat::PCM_16_BIT, sampleRateHz,
+                                          4 * StreamMixer::kPeriodSizeFrames));
+        writers.emplace_back([&, source = sources.back().get(), counter = &written[i]](){
+            while (!done) {
+                *counter += source->write(tone.data(), periodFrames);
+            }
+        });
+    }
+
+    const nsecs_t start = now();
+    sleep(durationS);
+    done = true;
+    for (const auto &source : sources) {
+        source->interrupt();
+    }
+    for (auto &writer : writers) {
+        writer.join();
+    }
+    const double elapsedS = (now() - start) / 1e9;
+
+    uint64_t total = 0;
+    for (const auto &n : written) {
+        total += n;
+    }
+    printf("mix: %d streams at %u Hz, %.1f s of audio per stream in %.1f s (%.2fx real time)\n",
+           nStreams, sampleRateHz, double(total) / nStreams / sampleRateHz, elapsedS,
+           double(total) / nStreams / sampleRateHz / elapsedS);
+    fflush(stdout);
+    mixer.dump(STDOUT_FILENO);
+
+    for (const auto &source : sources) {
+        mixer.removeSource(source);
+    }
+    return 0;
+}
+
+int runConvert() {
+    static const struct {
+        AudioFormat format;
+        const char *name;
+    } kFormats[] = {
+        {AudioFormat::PCM_16_BIT, "PCM_16_BIT"},
+        {AudioFormat::PCM_24_BIT_PACKED, "PCM_24_BIT_PACKED"},
+        {AudioFormat::PCM_32_BIT, "PCM_32_BIT"},
+        {AudioFormat::PCM_FLOAT, "PCM_FLOAT"},
+    };
+    // a mixer period of stereo frames
+    const size_t samples = StreamMixer::kPeriodSizeFrames * 2;
+    const std::vector<int16_t> pcm = makeTone(StreamMixer::kPeriodSizeFrames,
+                                              StreamMixer::kSampleRateHz);
+    std::vector<float> floats(samples);
+    convert::toFloat(AudioFormat::PCM_16_BIT, pcm.data(), floats.data(), samples);
+    std::vector<uint8_t> client(samples * sizeof(int32_t));
+
+    printf("convert: ns per sample\n");
+    printf("  %-18s %9s %9s %9s\n", "format", "toFloat", "fromFloat", "fromInt16");
+    for (const auto &f : kFormats) {
+        convert::fromFloat(f.format, floats.data(), client.data(), samples);
+        std::vector<float> out(samples);
+        const double toFloatNs = measureNsPerCall([&](){
+            convert::toFloat(f.format, client.data(), out.data(), samples);
+        });
+        const double fromFloatNs = measureNsPerCall([&](){
+            convert::fromFloat(f.format, floats.data(), client.data(), samples);
+        });
+        const double fromInt16Ns = measureNsPerCall([&](){
+            convert::fromInt16(f.format, pcm.data(), client.data(), samples);
+        });
+        printf("  %-18s %9.3f %9.3f %9.3f\n", f.name,
+               toFloatNs / samples, fromFloatNs / samples, fromInt16Ns / samples);
+    }
+    return 0;
+}
+
+int runResample() {
+    static const struct {
+        uint32_t inRateHz;
+        uint32_t outRateHz;
+    } kConversions[] = {
+        {44100, 48000},
+        {48000, 44100},
+        {16000, 48000},
+        {48000, 16000},
+    };
+    static const Resampler::Quality kQualities[] = {
+        Resampler::Quality::LOW, Resampler::Quality::MEDIUM, Resampler::Quality::HIGH,
+    };
+    constexpr unsigned kChannels = 2;
+
+    printf("resample: stereo, one mixer period per call\n");
+    printf("  %-14s %-7s %14s %10s\n", "rates", "quality", "ns per frame", "real time");
+    for (const auto &c : kConversions) {
+        const size_t outFrames = StreamMixer::kPeriodSizeFrames * c.outRateHz
+                                 / StreamMixer::kSampleRateHz;
+        for (const Resampler::Quality quality : kQualities) {
+            Resampler resampler(kChannels, c.inRateHz, c.outRateHz, quality);
+            const size_t maxInFrames = resampler.getMaxInputFrames(outFrames);
+            const std::vector<int16_t> pcm = makeTone(maxInFrames, c.inRateHz);
+            std::vector<float> in(maxInFrames * kChannels);
+            convert::toFloat(AudioFormat::PCM_16_BIT, pcm.data(), in.data(), in.size());
+            std::vector<float> out(outFrames * kChannels);
+
+            const double ns = measureNsPerCall([&](){
+                const size_t inFrames = resampler.getInputFramesNeeded(outFrames);
+                resampler.process(in.data(), inFrames, out.data(), outFrames);
+            });
+            const double nsPerFrame = ns / outFrames;
+            printf("  %5u -> %5u %-7s %14.2f %9.0fx\n", c.inRateHz, c.outRateHz,
+                   Resampler::toString(quality), nsPerFrame,
+                   1e9 / (nsPerFrame * c.outRateHz));
+        }
+    }
+    return 0;
+}
+
+void measureWakeups(const int durationS, const int periodMs, const bool ioPriority) {
+    std::thread thread([durationS, periodMs, ioPriority](){
+        const bool realtime = ioPriority && util::setIoThreadPriority("audio_bench");
+        Histogram lateUs;
+        nsecs_t maxLateNs = 0;
+        nsecs_t deadline = now();
+        const nsecs_t end = deadline + s2ns(durationS);
+        while (deadline < end) {
+            deadline += ms2ns(periodMs);
+            const struct timespec req = {
+                .tv_sec = static_cast<time_t>(ns2s(deadline)),
+                .tv_nsec = static_cast<long>(deadline - s2ns(ns2s(deadline))),
+            };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &req, nullptr) == EINTR) {}
+
+            const nsecs_t lateNs = std::max<nsecs_t>(0, now() - deadline);
+            lateUs.add(ns2us(lateNs));
+            maxLateNs = std::max(maxLateNs, lateNs);
+        }
+
+        printf("  %s, max %" PRId64 " us late\n",
+               realtime ? "SCHED_FIFO" : "SCHED_OTHER", ns2us(maxLateNs));
+        fflush(stdout);
+        lateUs.dump(STDOUT_FILENO, "wakeup late (us)");
+    });
+    thread.join();
+}
+
+int runWakeup(const int durationS, const int periodMs) {
+    printf("wakeup: every %d ms for %d s\n", periodMs, durationS);
+    measureWakeups(durationS, periodMs, false);
+    measureWakeups(durationS, periodMs, true);
+    return 0;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    const std::string mode = argv[1];
+
+    int durationS = 10;
+    int nStreams = 4;
+    int sampleRateHz = StreamMixer::kSampleRateHz;
+    int periodMs = StreamMixer::kPeriodDurationMs;
+    optind = 2;
+    for (int opt; (opt = getopt(argc, argv, "d:s:r:p:")) != -1; ) {
+        switch (opt) {
+        case 'd': durationS = atoi(optarg); break;
+        case 's': nStreams = atoi(optarg); break;
+        case 'r': sampleRateHz = atoi(optarg); break;
+        case 'p': periodMs = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if ((optind != argc) || (durationS <= 0) || (nStreams <= 0) || (sampleRateHz <= 0)
+            || (periodMs <= 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (mode == "mix") {
+        return runMix(durationS, nStreams, sampleRateHz);
+    } else if (mode == "convert") {
+        return runConvert();
+    } else if (mode == "resample") {
+        return runResample();
+    } else if (mode == "wakeup") {
+        return runWakeup(durationS, periodMs);
+    } else {
+        usage(argv[0]);
+        return 1;
+    }
+}
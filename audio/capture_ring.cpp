@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <cutils/properties.h>
+#include <log/log.h>
+#include <utils/Timers.h>
+#include "capture_ring.h"
+#include "util.h"
+
+namespace android {
+namespace hardware {
+namespace audio {
+namespace V6_0 {
+namespace implementation {
+
+namespace {
+constexpr auto kCaptureTimeout = std::chrono::milliseconds(500);
+constexpr char kCaptureRingMsProperty[] = "vendor.audio.capture_ring_ms";
+}  // namespace
+
+struct CaptureRing::Reader : public talsa::Pcm {
+    Reader(CaptureRing *ring, const unsigned nChannels, const uint64_t pos)
+            : mRing(ring), mNChannels(nChannels), mPos(pos) {}
+
+    int read(void *data, const size_t bytes) override {
+        return mRing->read(mPos, mXruns, static_cast<int16_t *>(data),
+                           bytes / (mNChannels * sizeof(int16_t)), mNChannels);
+    }
+
+    int write(const void *, size_t) override {
+        return -EINVAL;
+    }
+
+    int getHtimestamp(unsigned int *avail, struct timespec *ts) override {
+        const uint64_t wp = mRing->mWritePos.load(std::memory_order_acquire);
+        if ((wp + kPeriodSizeFrames - mPos) > mRing->mCapacityFrames) {
+            return -1;
+        }
+
+        const nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+        *avail = wp - mPos;
+        ts->tv_sec = ns2s(now);
+        ts->tv_nsec = now - s2ns(ts->tv_sec);
+        return 0;
+    }
+
+    size_t getBufferSizeFrames() const override {
+        return mRing->mCapacityFrames;
+    }
+
+    uint32_t getXrunCount() const override {
+        return mXruns;
+    }
+
+    CaptureRing *const mRing;
+    const unsigned mNChannels;
+    uint64_t mPos;
+    uint32_t mXruns = 0;
+};
+
+CaptureRing::CaptureRing(const size_t capacityFrames)
+        : mCapacityFrames(std::max(capacityFrames, 4 * kPeriodSizeFrames))
+        , mRing(new int16_t[mCapacityFrames * kChannels])
+        , mPcm(talsa::pcmOpen(talsa::kPcmCard, talsa::kPcmDevice,
+                              kChannels, talsa::kPcmSampleRateHz, kPeriodSizeFrames,
+                              talsa::kPcmPeriodCount, false /* isOut */)) {
+    if (!mPcm) {
+        ALOGE("CaptureRing::%s:%d: could not open the capture device",
+              __func__, __LINE__);
+        return;
+    }
+
+    mRunning = true;
+    mThread = std::thread(&CaptureRing::threadLoop, this);
+}
+
+CaptureRing::~CaptureRing() {
+    if (mThread.joinable()) {
+        mRunning = false;
+        mThread.join();
+    }
+}
+
+std::shared_ptr<CaptureRing> CaptureRing::getInstance() {
+    static std::mutex instanceMutex;
+    static std::weak_ptr<CaptureRing> instance;
+
+    const int32_t captureRingMs = property_get_int32(kCaptureRingMsProperty, 0);
+    if (captureRingMs <= 0) {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> guard(instanceMutex);
+    std::shared_ptr<CaptureRing> ring = instance.lock();
+    if (!ring) {
+        ring = std::make_shared<CaptureRing>(
+            size_t(captureRingMs) * talsa::kPcmSampleRateHz / 1000);
+        if (!ring->isRunning()) {
+            return nullptr;
+        }
+        instance = ring;
+    }
+    return ring;
+}
+
+talsa::PcmPtr CaptureRing::openPcm(const unsigned nChannels, const size_t prerollFrames) {
+    LOG_ALWAYS_FATAL_IF((nChannels != 1) && (nChannels != kChannels));
+
+    // keep a period of margin from the frames being overwritten
+    const uint64_t wp = mWritePos.load(std::memory_order_acquire);
+    const uint64_t preroll = std::min<uint64_t>(
+        {prerollFrames, wp, mCapacityFrames - kPeriodSizeFrames});
+    return std::make_unique<Reader>(this, nChannels, wp - preroll);
+}
+
+void CaptureRing::threadLoop() {
+    util::setIoThreadPriority("CaptureRing");
+
+    const size_t periodSamples = kPeriodSizeFrames * kChannels;
+    std::unique_ptr<int16_t[]> period(new int16_t[periodSamples]);
+
+    bool failing = false;
+    while (mRunning) {
+        // blocks until the device has a period, this paces the thread
+        const int res = mPcm->read(&period[0], periodSamples * sizeof(int16_t));
+        if (res < 0) {
+            // a read that fails at once would spin at SCHED_FIFO, and
+            // publishing made up periods would push the readers into
+            // overruns: wait a period, the readers wait for real frames
+            if (!failing) {
+                ALOGE("CaptureRing::%s:%d: pcm_read failed with %s",
+                      __func__, __LINE__, strerror(-res));
+                failing = true;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(kPeriodDurationMs));
+            continue;
+        }
+        failing = false;
+
+        const uint64_t wp = mWritePos.load(std::memory_order_relaxed);
+        const size_t offset = wp % mCapacityFrames;
+        const size_t n1 = std::min(kPeriodSizeFrames, mCapacityFrames - offset);
+        std::copy(&period[0], &period[n1 * kChannels], &mRing[offset * kChannels]);
+        std::copy(&period[n1 * kChannels], &period[periodSamples], &mRing[0]);
+
+        {
+            std::lock_guard<std::mutex> guard(mMutex);
+            mWritePos.store(wp + kPeriodSizeFrames, std::memory_order_release);
+        }
+        mCond.notify_all();
+    }
+}
+
+bool CaptureRing::waitForFrames(const uint64_t pos) {
+    if (mWritePos.load(std::memory_order_acquire) >= pos) {
+        return true;
+    }
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    return mCond.wait_for(lock, kCaptureTimeout, [this, pos](){
+        return mWritePos.load(std::memory_order_relaxed) >= pos;
+    });
+}
+
+// Like pcm_read, a reader that has fallen behind the ring counts an overrun
+// in `xruns` and goes on from the write position, the frames are lost.
+int CaptureRing::read(uint64_t &pos, uint32_t &xruns, int16_t *dst, const size_t frames,
+                      const unsigned nChannels) {
+    for (size_t done = 0; done < frames; ) {
+        // at most what the ring can hold without overwriting it
+        const size_t n = std::min(frames - done, mCapacityFrames - kPeriodSizeFrames);
+        if (!waitForFrames(pos + n)) {
+            return -EIO;
+        }
+
+        const size_t offset = pos % mCapacityFrames;
+        const size_t n1 = std::min(n, mCapacityFrames - offset);
+        const int16_t *src[2] = { &mRing[offset * kChannels], &mRing[0] };
+        const size_t len[2] = { n1, n - n1 };
+        int16_t *out = dst + done * nChannels;
+        for (int part = 0; part < 2; ++part) {
+            if (nChannels == kChannels) {
+                out = std::copy(src[part], src[part] + len[part] * kChannels, out);
+            } else {
+                for (size_t i = 0; i < len[part]; ++i) {
+                    *out++ = (int32_t(src[part][2 * i]) + src[part][2 * i + 1]) / 2;
+                }
+            }
+        }
+
+        // the writer may have overwritten the frames while they were copied,
+        // it writes the period after wp before it publishes it
+        const uint64_t wp = mWritePos.load(std::memory_order_acquire);
+        if ((wp + kPeriodSizeFrames - pos) > mCapacityFrames) {
+            // copy this part again from the new position
+            pos = wp;
+            ++xruns;
+            continue;
+        }
+
+        pos += n;
+        done += n;
+    }
+
+    return 0;
+}
+
+talsa::PcmPtr openCapturePcm(CaptureRing *ring,
+                             const unsigned nChannels,
+                             const size_t periodSizeFrames,
+                             const unsigned periodCount,
+                             const size_t prerollFrames) {
+    if (ring) {
+        return ring->openPcm(nChannels, prerollFrames);
+    } else {
+        return talsa::pcmOpen(talsa::kPcmCard, talsa::kPcmDevice,
+                              nChannels, talsa::kPcmSampleRateHz, periodSizeFrames,
+                              periodCount, false /* isOut */);
+    }
+}
+
+}  // namespace implementation
+}  // namespace V6_0
+}  // namespace audio
+}  // namespace hardware
+}  // namespace android
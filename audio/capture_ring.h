@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "talsa.h"
+
+namespace android {
+namespace hardware {
+namespace audio {
+namespace V6_0 {
+namespace implementation {
+
+// Keeps the microphone open and the last capacityFrames frames of it in a
+// circular buffer, so capture starts without opening the device and can
+// begin with audio from before the start. The capture thread is the only
+// writer, it publishes every period with the write position; readers copy
+// without locking and detect (as an overrun) the frames overwritten while
+// they were copying them. The mutex is only there to wait for a period.
+struct CaptureRing {
+    static constexpr unsigned kChannels = 2;
+    static constexpr size_t kPeriodDurationMs = 10;
+    static constexpr size_t kPeriodSizeFrames = talsa::kPcmSampleRateHz * kPeriodDurationMs / 1000;
+
+    explicit CaptureRing(size_t capacityFrames);
+    ~CaptureRing();
+
+    // The ring of the process if vendor.audio.capture_ring_ms > 0, nullptr
+    // otherwise: every device opened by DevicesFactory and the sound trigger
+    // HAL (see RingCapture) share the capture device through it.
+    static std::shared_ptr<CaptureRing> getInstance();
+
+    bool isRunning() const { return mThread.joinable(); }
+    size_t getCapacityFrames() const { return mCapacityFrames; }
+
+    // A capture PCM (at talsa::kPcmSampleRateHz) reading from the ring,
+    // starting up to prerollFrames frames in the past.
+    talsa::PcmPtr openPcm(unsigned nChannels, size_t prerollFrames);
+
+    CaptureRing(const CaptureRing &) = delete;
+    CaptureRing &operator=(const CaptureRing &) = delete;
+
+private:
+    struct Reader;
+
+    void threadLoop();
+    bool waitForFrames(uint64_t pos);
+    int read(uint64_t &pos, uint32_t &xruns, int16_t *dst, size_t frames,
+             unsigned nChannels);
+
+    const size_t mCapacityFrames;
+    std::unique_ptr<int16_t[]> mRing;
+    talsa::PcmPtr mPcm;
+    std::atomic<uint64_t> mWritePos = 0;
+    std::atomic<bool> mRunning = false;
+    std::mutex mMutex;
+    std::condition_variable mCond;  // a period was captured
+    std::thread mThread;
+};
+
+// Opens the capture device, through the ring if there is one.
+talsa::PcmPtr openCapturePcm(CaptureRing *ring, unsigned nChannels,
+                             size_t periodSizeFrames, unsigned periodCount,
+                             size_t prerollFrames = 0);
+
+}  // namespace implementation
+}  // namespace V6_0
+}  // namespace audio
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <algorithm>
+#include <log/log.h>
+#include "clocked_pcm.h"
+
+namespace android {
+namespace hardware {
+namespace audio {
+namespace V6_0 {
+namespace implementation {
+namespace talsa {
+
+namespace {
+constexpr double kToneHz = 1000;
+constexpr double kToneAmplitude = 0.1 * 32767;  // -20 dBFS
+}  // namespace
+
+ClockedPcm::ClockedPcm(const unsigned nChannels,
+                       const size_t sampleRateHz,
+                       const size_t periodSizeFrames,
+                       const unsigned periodCount,
+                       const bool isOut,
+                       const unsigned speed)
+        : mNChannels(nChannels)
+        , mFrameSize(nChannels * sizeof(int16_t))
+        , mFrameRate(uint64_t(sampleRateHz) * speed)
+        , mSampleRateHz(sampleRateHz)
+        , mBufferFrames(periodSizeFrames * periodCount)
+        , mIsOut(isOut) {
+    ALOGI("ClockedPcm::%s:%d: isOut=%d nChannels=%u sampleRateHz=%zu "
+          "bufferFrames=%zu speed=%u", __func__, __LINE__,
+          isOut, nChannels, sampleRateHz, mBufferFrames, speed);
+}
+
+int ClockedPcm::write(const void *data, const size_t bytes) {
+    (void)data;  // played to nowhere
+    LOG_ALWAYS_FATAL_IF(!mIsOut);
+
+    startOrRecover();
+
+    const size_t frames = bytes / mFrameSize;
+    for (size_t written = 0; written < frames; ) {
+        // blocks until there is room for at least a part of the frames
+        const uint64_t deviceFrames = getDeviceFrames(systemTime(SYSTEM_TIME_MONOTONIC));
+        const size_t queued = mAppFrames - std::min(deviceFrames, mAppFrames);
+        const size_t room = mBufferFrames - std::min(queued, mBufferFrames);
+        if (room == 0) {
+            waitForDeviceFrames(mAppFrames - mBufferFrames + 1);
+            continue;
+        }
+
+        const size_t n = std::min(room, frames - written);
+        mAppFrames += n;
+        written += n;
+    }
+
+    return 0;
+}
+
+int ClockedPcm::read(void *data, const size_t bytes) {
+    LOG_ALWAYS_FATAL_IF(mIsOut);
+
+    startOrRecover();
+
+    const size_t frames = bytes / mFrameSize;
+    waitForDeviceFrames(mAppFrames + frames);
+
+    int16_t *out = static_cast<int16_t *>(data);
+    for (size_t i = 0; i < frames; ++i, ++mToneFrames) {
+        const int16_t sample = kToneAmplitude *
+            sin(2 * M_PI * kToneHz * (mToneFrames % mSampleRateHz) / mSampleRateHz);
+        for (unsigned c = 0; c < mNChannels; ++c) {
+            *out++ = sample;
+        }
+    }
+
+    mAppFrames += frames;
+    return 0;
+}
+
+int ClockedPcm::getHtimestamp(unsigned int *avail, struct timespec *ts) {
+    if (!mRunning) {
+        return -1;
+    }
+
+    const nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    const uint64_t deviceFrames = getDeviceFrames(now);
+    if (isXrun(deviceFrames)) {
+        return -1;
+    }
+
+    if (mIsOut) {
+        *avail = mBufferFrames - (mAppFrames - deviceFrames);
+    } else {
+        *avail = deviceFrames - mAppFrames;
+    }
+    ts->tv_sec = ns2s(now);
+    ts->tv_nsec = now - s2ns(ts->tv_sec);
+    return 0;
+}
+
+// Like pcm_read and pcm_write, an xrun restarts the device and the
+// transfer goes on, it is only counted.
+void ClockedPcm::startOrRecover() {
+    if (!mRunning) {
+        start();
+    } else if (isXrun(getDeviceFrames(systemTime(SYSTEM_TIME_MONOTONIC)))) {
+        ++mXruns;
+        start();
+    }
+}
+
+void ClockedPcm::start() {
+    mStartNs = systemTime(SYSTEM_TIME_MONOTONIC);
+    mAppFrames = 0;
+    mRunning = true;
+}
+
+uint64_t ClockedPcm::getDeviceFrames(const nsecs_t now) const {
+    // in microseconds to not overflow on long runs
+    return uint64_t(ns2us(now - mStartNs)) * mFrameRate / 1000000;
+}
+
+void ClockedPcm::waitForDeviceFrames(const uint64_t frames) const {
+    const nsecs_t deadline = mStartNs + us2ns((frames * 1000000 + mFrameRate - 1) / mFrameRate);
+    const struct timespec req = {
+        .tv_sec = static_cast<time_t>(ns2s(deadline)),
+        .tv_nsec = static_cast<long>(deadline - s2ns(ns2s(deadline))),
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &req, nullptr) == EINTR) {}
+}
+
+// Playback runs out of frames, capture overwrites frames not read yet.
+bool ClockedPcm::isXrun(const uint64_t deviceFrames) const {
+    return mIsOut ? (deviceFrames >= mAppFrames)
+                  : (deviceFrames > mAppFrames + mBufferFrames);
+}
+
+}  // namespace talsa
+}  // namespace implementation
+}  // namespace V6_0
+}  // namespace audio
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#include <utils/Timers.h>
+#include "talsa.h"
+
+namespace android {
+namespace hardware {
+namespace audio {
+namespace V6_0 {
+namespace implementation {
+namespace talsa {
+
+// An in-memory PCM device for hosts without a sound card. The device side
+// follows CLOCK_MONOTONIC, `speed` times faster than real time: playback
+// frames are consumed and capture frames (a 1 kHz tone) are produced at
+// sampleRateHz * speed. Like an ALSA device it starts on the first transfer,
+// write blocks while the buffer is full, read blocks until enough frames
+// are captured and an xrun restarts the device on the next transfer (and is
+// counted by getXrunCount).
+struct ClockedPcm : public Pcm {
+    ClockedPcm(unsigned nChannels, size_t sampleRateHz, size_t periodSizeFrames,
+               unsigned periodCount, bool isOut, unsigned speed);
+
+    int read(void *data, size_t bytes) override;
+    int write(const void *data, size_t bytes) override;
+    int getHtimestamp(unsigned int *avail, struct timespec *ts) override;
+    size_t getBufferSizeFrames() const override { return mBufferFrames; }
+    uint32_t getXrunCount() const override { return mXruns; }
+
+private:
+    void startOrRecover();
+    void start();
+    uint64_t getDeviceFrames(nsecs_t now) const;
+    void waitForDeviceFrames(uint64_t frames) const;
+    bool isXrun(uint64_t deviceFrames) const;
+
+    const unsigned mNChannels;
+    const size_t mFrameSize;
+    const uint64_t mFrameRate;  // sampleRateHz * speed
+    const size_t mSampleRateHz;
+    const size_t mBufferFrames;
+    const bool mIsOut;
+    bool mRunning = false;
+    nsecs_t mStartNs = 0;
+    uint64_t mAppFrames = 0;   // written or read since the start
+    uint64_t mToneFrames = 0;  // captured since the device was opened
+    uint32_t mXruns = 0;
+};
+
+}  // namespace talsa
+}  // namespace implementation
+}  // namespace V6_0
+}  // namespace audio
+}  // namespace hardware
+}  // namespace android
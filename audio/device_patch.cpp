@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <chrono>
+#include <log/log.h>
+#include "device_patch.h"
+#include "util.h"
+
+namespace android {
+namespace hardware {
+namespace audio {
+namespace V6_0 {
+namespace implementation {
+
+namespace {
+constexpr unsigned kChannels = StreamMixer::kChannels;
+}  // namespace
+
+DevicePatch::DevicePatch(StreamMixer *mixer, CaptureRing *captureRing)
+        : mMixer(mixer)
+        , mSource(mixer->addSource(kChannels, AudioFormat::PCM_16_BIT,
+                                   talsa::kPcmSampleRateHz, kJitterBufferFrames))
+        , mPcm(openCapturePcm(captureRing, kChannels, kPeriodSizeFrames,
+                              talsa::kPcmPeriodCount))
+        , mBuffer(new int16_t[kPeriodSizeFrames * kChannels]) {
+    if (!mPcm) {
+        ALOGE("DevicePatch::%s:%d: could not open the capture device",
+              __func__, __LINE__);
+        return;
+    }
+
+    mRunning = true;
+    mThread = std::thread(&DevicePatch::threadLoop, this);
+}
+
+DevicePatch::~DevicePatch() {
+    if (mThread.joinable()) {
+        mRunning = false;
+        mThread.join();
+    }
+
+    mSource->standby();
+    mMixer->removeSource(mSource);
+
+    ALOGI("DevicePatch::%s:%d: %u capture overruns, %u read errors, "
+          "%u dropped periods, %u underruns", __func__, __LINE__,
+          mOverruns.load(), mReadErrors.load(), mDropped.load(),
+          mSource->getUnderrunCount());
+}
+
+uint32_t DevicePatch::getLatencyMs() const {
+    const size_t queued = kJitterBufferFrames - mSource->availableToWrite();
+    return (kPeriodSizeFrames + queued + StreamMixer::kPeriodSizeFrames) * 1000
+           / talsa::kPcmSampleRateHz;
+}
+
+uint32_t DevicePatch::getGlitchCount() const {
+    return mOverruns + mReadErrors + mDropped + mSource->getUnderrunCount();
+}
+
+void DevicePatch::threadLoop() {
+    util::setIoThreadPriority("DevicePatch");
+
+    const size_t bytes = kPeriodSizeFrames * kChannels * sizeof(int16_t);
+
+    // one period of silence so the mixer does not underrun on the first
+    // capture period
+    memset(&mBuffer[0], 0, bytes);
+    mSource->write(&mBuffer[0], kPeriodSizeFrames);
+
+    while (mRunning) {
+        // blocks until the device has a period, this paces the thread
+        const int res = mPcm->read(&mBuffer[0], bytes);
+        mOverruns = mPcm->getXrunCount();
+        if (res < 0) {
+            // a read failing at once must not spin at SCHED_FIFO (the
+            // source does not block, it drops), the mixer plays silence
+            if (!mReadErrors++) {
+                ALOGE("DevicePatch::%s:%d: pcm_read failed with %s",
+                      __func__, __LINE__, strerror(-res));
+            }
+            std::this_thread::sleep_for(
+                std::chrono::milliseconds(StreamMixer::kPeriodDurationMs));
+            continue;
+        }
+
+        if (mSource->availableToWrite() < kPeriodSizeFrames) {
+            ++mDropped;  // the playback side is behind, keep the latency bounded
+        } else {
+            mSource->write(&mBuffer[0], kPeriodSizeFrames);
+        }
+    }
+}
+
+}  // namespace implementation
+}  // namespace V6_0
+}  // namespace audio
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#include <atomic>
+#include <memory>
+#include <thread>
+#include "capture_ring.h"
+#include "stream_mixer.h"
+#include "talsa.h"
+
+namespace android {
+namespace hardware {
+namespace audio {
+namespace V6_0 {
+namespace implementation {
+
+// A device to device audio patch (e.g. mic to speaker loopback) run inside
+// the HAL: a thread reads the capture PCM one period at a time and queues
+// it into a mixer source. The source ring is the jitter buffer, it is
+// primed with silence and a period that does not fit is dropped rather
+// than stalling the capture.
+struct DevicePatch {
+    static constexpr size_t kPeriodSizeFrames = StreamMixer::kPeriodSizeFrames;
+    static constexpr size_t kJitterBufferFrames = 2 * kPeriodSizeFrames;
+
+    DevicePatch(StreamMixer *mixer, CaptureRing *captureRing);
+    ~DevicePatch();
+
+    bool isRunning() const { return mThread.joinable(); }
+
+    // capture period + jitter buffer fill + mixer period
+    uint32_t getLatencyMs() const;
+
+    // capture overruns and errors + dropped periods + mixer underruns
+    uint32_t getGlitchCount() const;
+
+    DevicePatch(const DevicePatch &) = delete;
+    DevicePatch &operator=(const DevicePatch &) = delete;
+
+private:
+    void threadLoop();
+
+    StreamMixer *const mMixer;
+    const std::shared_ptr<StreamMixer::Source> mSource;
+    talsa::PcmPtr mPcm;
+    std::unique_ptr<int16_t[]> mBuffer;
+    std::atomic<bool> mRunning = false;
+    std::atomic<uint32_t> mOverruns = 0;
+    std::atomic<uint32_t> mReadErrors = 0;
+    std::atomic<uint32_t> mDropped = 0;
+    std::thread mThread;
+};
+
+}  // namespace implementation
+}  // namespace V6_0
+}  // namespace audio
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,303 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+#include <algorithm>
+#include <log/log.h>
+#include <utils/Timers.h>
+#include "effect_chain.h"
+#include "format_convert.h"
+
+namespace android {
+namespace hardware {
+namespace audio {
+namespace V6_0 {
+namespace implementation {
+
+using ::android::hardware::audio::common::V6_0::AudioFormat;
+
+namespace {
+
+constexpr float kMaxGainDb = 24;
+constexpr float kMinGainDb = -60;
+
+nsecs_t threadCpuTimeNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return s2ns(ts.tv_sec) + ts.tv_nsec;
+}
+
+float dbToGain(const float db) {
+    return powf(10.0f, db / 20.0f);
+}
+
+// Multiplies every sample by a gain going linearly from `gain` to
+// `gain + step * frames`.
+void applyRamp(float *data, const size_t frames, const unsigned nChannels,
+               const float gain, const float step) {
+    for (int i = 0; i < int(frames); ++i) {
+        const float g = gain + step * i;
+        for (unsigned c = 0; c < nChannels; ++c) {
+            data[i * nChannels + c] *= g;
+        }
+    }
+}
+
+// A fixed gain (effect_gain_db), changes ramp over one call.
+struct GainEffect : public Effect {
+    GainEffect(const unsigned nChannels, const std::atomic<float> &gainDb)
+            : mNChannels(nChannels), mGainDb(gainDb) {}
+
+    void reset() override {
+        mGain = dbToGain(mGainDb);
+    }
+
+    void process(float *data, const size_t frames) override {
+        const float target = dbToGain(mGainDb);
+        if ((target == mGain) || (frames == 0)) {
+            const unsigned n = frames * mNChannels;
+            for (unsigned i = 0; i < n; ++i) {
+                data[i] *= target;
+            }
+        } else {
+            applyRamp(data, frames, mNChannels, mGain, (target - mGain) / frames);
+            mGain = target;
+        }
+    }
+
+    const unsigned mNChannels;
+    const std::atomic<float> &mGainDb;
+    float mGain = 1.0f;
+};
+
+// A broadband noise suppressor: the noise floor is the minimum of the block
+// energy (starting from the first block, following it down at once and
+// rising by kNoiseRiseDbPerSec), every
+// block is attenuated by a Wiener like gain from its energy to noise ratio.
+// The gain opens within a block and closes by kReleaseDbPerSec, ramping
+// linearly inside each block.
+struct NoiseSuppressor : public Effect {
+    static constexpr size_t kBlockMs = 5;
+    static constexpr float kNoiseRiseDbPerSec = 6;
+    static constexpr float kReleaseDbPerSec = 60;
+    static constexpr float kOverSubtraction = 2;
+    static constexpr float kMinGain = 0.1f;  // -20 dB
+    static constexpr float kMinNoise = 1e-9f;  // -90 dBFS
+
+    NoiseSuppressor(const unsigned nChannels, const uint32_t sampleRateHz)
+            : mNChannels(nChannels)
+            , mBlockFrames(sampleRateHz * kBlockMs / 1000)
+            , mNoiseRise(dbToGain(2 * kNoiseRiseDbPerSec * kBlockMs / 1000))
+            , mRelease(dbToGain(-kReleaseDbPerSec * kBlockMs / 1000)) {}
+
+    void reset() override {
+        mNoise = 0;
+        mGain = 1.0f;
+        mEnergy = 0;
+        mBlockPos = 0;
+        mBlockGain = 1.0f;
+        mGainStep = 0;
+    }
+
+    void process(float *data, const size_t frames) override {
+        // the gain of a block is decided from the previous block, so
+        // processing in place needs no lookahead
+        size_t done = 0;
+        while (done < frames) {
+            const size_t n = std::min(frames - done, mBlockFrames - mBlockPos);
+            float *block = data + done * mNChannels;
+
+            float energy = 0;
+            const unsigned samples = n * mNChannels;
+            for (unsigned i = 0; i < samples; ++i) {
+                energy += block[i] * block[i];
+            }
+            mEnergy += energy;
+
+            applyRamp(block, n, mNChannels, mBlockGain + mGainStep * mBlockPos, mGainStep);
+
+            done += n;
+            mBlockPos += n;
+            if (mBlockPos == mBlockFrames) {
+                nextBlock();
+            }
+        }
+    }
+
+    void nextBlock() {
+        const float energy = mEnergy / (mBlockFrames * mNChannels);
+        mNoise = std::max(kMinNoise, mNoise ? std::min(energy, mNoise * mNoiseRise) : energy);
+
+        float target = (energy > 0) ? (1 - kOverSubtraction * mNoise / energy) : kMinGain;
+        target = std::max(kMinGain, std::min(1.0f, target));
+        target = std::max(target, mGain * mRelease);
+
+        mBlockGain = mGain;
+        mGainStep = (target - mGain) / mBlockFrames;
+        mGain = target;
+        mEnergy = 0;
+        mBlockPos = 0;
+    }
+
+    const unsigned mNChannels;
+    const size_t mBlockFrames;
+    const float mNoiseRise;  // per block, in energy
+    const float mRelease;    // per block, in gain
+    float mNoise = 0;        // mean square, 0 before the first block
+    float mGain = 1.0f;      // at the end of the current block
+    float mEnergy = 0;       // of the current block so far
+    size_t mBlockPos = 0;
+    float mBlockGain = 1.0f; // at the start of the current block
+    float mGainStep = 0;
+};
+
+}  // namespace
+
+EffectChain::EffectChain(const unsigned nChannels, const uint32_t sampleRateHz)
+        : mNChannels(nChannels)
+        , mSampleRateHz(sampleRateHz)
+        , mFloatBuffer(new float[kChunkFrames * nChannels]) {
+    mSlots[0].name = "ns";
+    mSlots[0].effect = std::make_unique<NoiseSuppressor>(nChannels, sampleRateHz);
+    mSlots[1].name = "gain";
+    mSlots[1].effect = std::make_unique<GainEffect>(nChannels, mGainDb);
+}
+
+EffectChain::~EffectChain() {}
+
+bool EffectChain::setEffects(const std::string &names) {
+    uint32_t mask = 0;
+    size_t begin = 0;
+    while (begin < names.size()) {
+        size_t end = names.find(',', begin);
+        if (end == std::string::npos) {
+            end = names.size();
+        }
+
+        const std::string name = names.substr(begin, end - begin);
+        size_t i = 0;
+        while ((i < kEffectCount) && (name != mSlots[i].name)) {
+            ++i;
+        }
+        if (i == kEffectCount) {
+            ALOGE("EffectChain::%s:%d: unknown effect '%s'", __func__, __LINE__,
+                  name.c_str());
+            return false;
+        }
+        mask |= 1u << i;
+
+        begin = end + 1;
+    }
+
+    mEnabledMask = mask;
+    return true;
+}
+
+std::string EffectChain::getEffects() const {
+    const uint32_t mask = mEnabledMask;
+    std::string names;
+    for (size_t i = 0; i < kEffectCount; ++i) {
+        if (mask & (1u << i)) {
+            if (!names.empty()) {
+                names += ',';
+            }
+            names += mSlots[i].name;
+        }
+    }
+    return names;
+}
+
+bool EffectChain::setGainDb(const float gainDb) {
+    if (!(gainDb >= kMinGainDb && gainDb <= kMaxGainDb)) {
+        return false;
+    }
+
+    mGainDb = gainDb;
+    return true;
+}
+
+void EffectChain::process(float *data, const size_t frames) {
+    if (frames == 0) {
+        return;
+    }
+
+    const uint32_t mask = mEnabledMask;
+    for (size_t i = 0; i < kEffectCount; ++i) {
+        const uint32_t bit = 1u << i;
+        if (!(mask & bit)) {
+            continue;
+        }
+
+        Slot &slot = mSlots[i];
+        if (!(mRunningMask & bit)) {
+            slot.effect->reset();
+        }
+
+        const nsecs_t t0 = threadCpuTimeNs();
+        slot.effect->process(data, frames);
+        const nsecs_t cpuNs = threadCpuTimeNs() - t0;
+
+        slot.frames += frames;
+        slot.cpuNs += cpuNs;
+        if (cpuNs > slot.maxCpuNs) {
+            slot.maxCpuNs = cpuNs;
+        }
+    }
+    mRunningMask = mask;
+}
+
+void EffectChain::process(int16_t *data, const size_t frames) {
+    if (!isEnabled()) {
+        return;
+    }
+
+    for (size_t done = 0; done < frames; ) {
+        const size_t n = std::min(frames - done, kChunkFrames);
+        int16_t *chunk = data + done * mNChannels;
+
+        convert::toFloat(AudioFormat::PCM_16_BIT, chunk, &mFloatBuffer[0], n * mNChannels);
+        process(&mFloatBuffer[0], n);
+        convert::fromFloat(AudioFormat::PCM_16_BIT, &mFloatBuffer[0], chunk, n * mNChannels);
+
+        done += n;
+    }
+}
+
+void EffectChain::dump(const int fd) const {
+    dprintf(fd, "    effects: '%s', gain %.1f dB\n", getEffects().c_str(), getGainDb());
+    for (const Slot &slot : mSlots) {
+        const uint64_t frames = slot.frames;
+        if (frames == 0) {
+            continue;
+        }
+
+        // cpu time per second of audio
+        const int64_t audioNs = frames * 1000000000 / mSampleRateHz;
+        dprintf(fd, "    %s: %" PRIu64 " frames, cpu load %.3f%%, max %" PRId64 " us per call\n",
+                slot.name, frames,
+                audioNs ? (100.0 * slot.cpuNs / audioNs) : 0.0,
+                ns2us(slot.maxCpuNs));
+    }
+}
+
+}  // namespace implementation
+}  // namespace V6_0
+}  // namespace audio
+}  // namespace hardware
+}  // namespace android
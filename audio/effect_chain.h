@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <string>
+
+namespace android {
+namespace hardware {
+namespace audio {
+namespace V6_0 {
+namespace implementation {
+
+// The stream parameters: the comma separated effects to run (e.g. "ns,gain",
+// "" for none) and the level of the gain effect.
+constexpr char kEffectsParameter[] = "effects";
+constexpr char kEffectGainParameter[] = "effect_gain_db";
+
+// Processes interleaved float frames in place.
+struct Effect {
+    virtual ~Effect() {}
+    virtual void reset() = 0;
+    virtual void process(float *data, size_t frames) = 0;
+};
+
+// The effects of a stream, run by its IO thread on every period at the
+// device rate: before the conversion to the client format on capture, after
+// the conversion to the mixer format on playback. Every effect of the chain
+// is created with it and always runs in the same order (ns, gain), enabling
+// one only resets its state, so nothing is allocated on the IO thread.
+struct EffectChain {
+    EffectChain(unsigned nChannels, uint32_t sampleRateHz);
+    ~EffectChain();
+
+    // Any thread
+    bool setEffects(const std::string &names);
+    std::string getEffects() const;
+    bool setGainDb(float gainDb);
+    float getGainDb() const { return mGainDb; }
+
+    // IO thread only
+    bool isEnabled() const { return mEnabledMask != 0; }
+    void process(float *data, size_t frames);
+    void process(int16_t *data, size_t frames);
+
+    // CPU load of each effect relative to the audio it processed.
+    void dump(int fd) const;
+
+    EffectChain(const EffectChain &) = delete;
+    EffectChain &operator=(const EffectChain &) = delete;
+
+private:
+    struct Slot {
+        const char *name;
+        std::unique_ptr<Effect> effect;
+        std::atomic<uint64_t> frames = 0;
+        std::atomic<int64_t> cpuNs = 0;
+        std::atomic<int64_t> maxCpuNs = 0;  // per call
+    };
+
+    static constexpr size_t kEffectCount = 2;
+    static constexpr size_t kChunkFrames = 480;  // for process(int16_t *)
+
+    const unsigned mNChannels;
+    const uint32_t mSampleRateHz;
+    std::array<Slot, kEffectCount> mSlots;
+    std::atomic<uint32_t> mEnabledMask = 0;
+    std::atomic<float> mGainDb = 0;
+    uint32_t mRunningMask = 0;  // IO thread only
+    std::unique_ptr<float[]> mFloatBuffer;  // kChunkFrames
+};
+
+}  // namespace implementation
+}  // namespace V6_0
+}  // namespace audio
+}  // namespace hardware
+}  // namespace android
@@ -15,11 +15,27 @@
  */
 
 #include "device_factory.h"
+#include "ring_capture.h"
 
 using android::hardware::audio::V6_0::IDevicesFactory;
 using android::hardware::audio::V6_0::implementation::DevicesFactory;
+using android::hardware::audio::V6_0::implementation::RingCapture;
 
 extern "C" IDevicesFactory* HIDL_FETCH_IDevicesFactory(const char* name) {
     (void)name;
     return new DevicesFactory();
 }
+
+// The sound trigger HAL is loaded in this process, it reads the microphone
+// from the capture ring through these (see soundtrigger/audio_capture.cpp).
+extern "C" void* goldfish_ring_capture_open(uint32_t sampleRateHz) {
+    return RingCapture::open(sampleRateHz).release();
+}
+
+extern "C" int goldfish_ring_capture_read(void* capture, int16_t* data, size_t frames) {
+    return static_cast<RingCapture*>(capture)->read(data, frames);
+}
+
+extern "C" void goldfish_ring_capture_close(void* capture) {
+    delete static_cast<RingCapture*>(capture);
+}
@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <algorithm>
+#include <log/log.h>
+#include "format_convert.h"
+
+namespace android {
+namespace hardware {
+namespace audio {
+namespace V6_0 {
+namespace implementation {
+namespace convert {
+
+namespace {
+
+constexpr float kScale16 = 1.0f / (1 << 15);
+constexpr float kScale32 = 1.0f / (1u << 31);
+
+void int16ToFloat(const int16_t *src, float *dst, const size_t samples) {
+    for (size_t i = 0; i < samples; ++i) {
+        dst[i] = src[i] * kScale16;
+    }
+}
+
+void int32ToFloat(const int32_t *src, float *dst, const size_t samples) {
+    for (size_t i = 0; i < samples; ++i) {
+        dst[i] = src[i] * kScale32;
+    }
+}
+
+// 24 bit little endian, 3 bytes per sample
+void packed24ToFloat(const uint8_t *src, float *dst, const size_t samples) {
+    for (size_t i = 0; i < samples; ++i) {
+        const int32_t v = (uint32_t(src[3 * i]) << 8)
+                          | (uint32_t(src[3 * i + 1]) << 16)
+                          | (uint32_t(src[3 * i + 2]) << 24);
+        dst[i] = v * kScale32;
+    }
+}
+
+float clamp(const float v) {
+    return std::min(std::max(v, -1.0f), 1.0f);
+}
+
+void floatToInt16(const float *src, int16_t *dst, const size_t samples) {
+    for (size_t i = 0; i < samples; ++i) {
+        dst[i] = static_cast<int16_t>(std::min(clamp(src[i]) * 32768.0f, 32767.0f));
+    }
+}
+
+void floatToInt32(const float *src, int32_t *dst, const size_t samples) {
+    for (size_t i = 0; i < samples; ++i) {
+        dst[i] = static_cast<int32_t>(std::min(clamp(src[i]) * 2147483648.0f, 2147483520.0f));
+    }
+}
+
+void floatToPacked24(const float *src, uint8_t *dst, const size_t samples) {
+    for (size_t i = 0; i < samples; ++i) {
+        const uint32_t v = static_cast<int32_t>(std::min(clamp(src[i]) * 8388608.0f, 8388607.0f));
+        dst[3 * i] = v & 0xFF;
+        dst[3 * i + 1] = (v >> 8) & 0xFF;
+        dst[3 * i + 2] = (v >> 16) & 0xFF;
+    }
+}
+
+void int16ToInt32(const int16_t *src, int32_t *dst, const size_t samples) {
+    for (size_t i = 0; i < samples; ++i) {
+        dst[i] = int32_t(src[i]) * (1 << 16);
+    }
+}
+
+void int16ToPacked24(const int16_t *src, uint8_t *dst, const size_t samples) {
+    for (size_t i = 0; i < samples; ++i) {
+        const uint16_t v = src[i];
+        dst[3 * i] = 0;
+        dst[3 * i + 1] = v & 0xFF;
+        dst[3 * i + 2] = v >> 8;
+    }
+}
+
+}  // namespace
+
+void toFloat(const AudioFormat format, const void *src, float *dst, const size_t samples) {
+    switch (format) {
+    case AudioFormat::PCM_16_BIT:
+        int16ToFloat(static_cast<const int16_t *>(src), dst, samples);
+        break;
+
+    case AudioFormat::PCM_FLOAT:
+        memcpy(dst, src, samples * sizeof(float));
+        break;
+
+    case AudioFormat::PCM_32_BIT:
+        int32ToFloat(static_cast<const int32_t *>(src), dst, samples);
+        break;
+
+    case AudioFormat::PCM_24_BIT_PACKED:
+        packed24ToFloat(static_cast<const uint8_t *>(src), dst, samples);
+        break;
+
+    default:
+        LOG_ALWAYS_FATAL("convert::%s:%d: unexpected format %s",
+                         __func__, __LINE__, toString(format).c_str());
+    }
+}
+
+void fromInt16(const AudioFormat format, const int16_t *src, void *dst, const size_t samples) {
+    switch (format) {
+    case AudioFormat::PCM_16_BIT:
+        memcpy(dst, src, samples * sizeof(int16_t));
+        break;
+
+    case AudioFormat::PCM_FLOAT:
+        int16ToFloat(src, static_cast<float *>(dst), samples);
+        break;
+
+    case AudioFormat::PCM_32_BIT:
+        int16ToInt32(src, static_cast<int32_t *>(dst), samples);
+        break;
+
+    case AudioFormat::PCM_24_BIT_PACKED:
+        int16ToPacked24(src, static_cast<uint8_t *>(dst), samples);
+        break;
+
+    default:
+        LOG_ALWAYS_FATAL("convert::%s:%d: unexpected format %s",
+                         __func__, __LINE__, toString(format).c_str());
+    }
+}
+
+void fromFloat(const AudioFormat format, const float *src, void *dst, const size_t samples) {
+    switch (format) {
+    case AudioFormat::PCM_16_BIT:
+        floatToInt16(src, static_cast<int16_t *>(dst), samples);
+        break;
+
+    case AudioFormat::PCM_FLOAT:
+        memcpy(dst, src, samples * sizeof(float));
+        break;
+
+    case AudioFormat::PCM_32_BIT:
+        floatToInt32(src, static_cast<int32_t *>(dst), samples);
+        break;
+
+    case AudioFormat::PCM_24_BIT_PACKED:
+        floatToPacked24(src, static_cast<uint8_t *>(dst), samples);
+        break;
+
+    default:
+        LOG_ALWAYS_FATAL("convert::%s:%d: unexpected format %s",
+                         __func__, __LINE__, toString(format).c_str());
+    }
+}
+
+}  // namespace convert
+}  // namespace implementation
+}  // namespace V6_0
+}  // namespace audio
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <android/hardware/audio/common/6.0/types.h>
+
+namespace android {
+namespace hardware {
+namespace audio {
+namespace V6_0 {
+namespace implementation {
+namespace convert {
+
+using ::android::hardware::audio::common::V6_0::AudioFormat;
+
+// Conversion kernels between the client formats and the device formats
+// (float for the mixer and the resampler, 16 bit for the PCM). All of them are plain
+// branch free loops over the samples, written for the compiler to vectorize.
+
+// Client samples of `format` to float in [-1, 1).
+void toFloat(AudioFormat format, const void *src, float *dst, size_t samples);
+
+// Device (16 bit) samples to client samples of `format`.
+void fromInt16(AudioFormat format, const int16_t *src, void *dst, size_t samples);
+
+// Float samples to samples of `format`, clipping to [-1, 1].
+void fromFloat(AudioFormat format, const float *src, void *dst, size_t samples);
+
+}  // namespace convert
+}  // namespace implementation
+}  // namespace V6_0
+}  // namespace audio
+}  // namespace hardware
+}  // namespace android
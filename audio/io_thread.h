@@ -26,6 +26,11 @@ namespace implementation {
 struct IOThread {
     static constexpr uint32_t STAND_BY_REQUEST = 1 << 20;
     static constexpr uint32_t EXIT_REQUEST = 1 << 21;
+    // output streams only
+    static constexpr uint32_t PAUSE_REQUEST = 1 << 22;
+    static constexpr uint32_t RESUME_REQUEST = 1 << 23;
+    static constexpr uint32_t FLUSH_REQUEST = 1 << 24;
+    static constexpr uint32_t DRAIN_REQUEST = 1 << 25;
 
     virtual ~IOThread() {}
     virtual EventFlag *getEventFlag() = 0;
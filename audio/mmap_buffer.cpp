@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cutils/ashmem.h>
+#include <cutils/native_handle.h>
+#include <log/log.h>
+#include "mmap_buffer.h"
+
+namespace android {
+namespace hardware {
+namespace audio {
+namespace V6_0 {
+namespace implementation {
+
+using ::android::hardware::hidl_memory;
+
+MmapBuffer::MmapBuffer(const size_t frameSize, const size_t bufferSizeFrames)
+        : mFrameSize(frameSize)
+        , mBufferSizeFrames(bufferSizeFrames) {
+    const size_t size = frameSize * bufferSizeFrames;
+
+    mFd = ashmem_create_region("ranchu_audio_mmap", size);
+    if (mFd < 0) {
+        ALOGE("MmapBuffer::%s:%d: ashmem_create_region failed for %zu bytes",
+              __func__, __LINE__, size);
+        return;
+    }
+
+    void *data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, mFd, 0);
+    if (data == MAP_FAILED) {
+        ALOGE("MmapBuffer::%s:%d: mmap failed with %s",
+              __func__, __LINE__, strerror(errno));
+        ::close(mFd);
+        mFd = -1;
+        return;
+    }
+
+    mData = static_cast<uint8_t *>(data);
+    memset(mData, 0, size);
+}
+
+MmapBuffer::~MmapBuffer() {
+    if (mData) {
+        ::munmap(mData, mFrameSize * mBufferSizeFrames);
+    }
+    if (mFd >= 0) {
+        ::close(mFd);
+    }
+}
+
+void MmapBuffer::getInfo(const size_t burstSizeFrames,
+                         const std::function<void(const MmapBufferInfo &)> &cb) const {
+    native_handle_t *handle = native_handle_create(1, 0);
+    LOG_ALWAYS_FATAL_IF(!handle);
+    handle->data[0] = mFd;
+
+    MmapBufferInfo info;
+    info.sharedMemory = hidl_memory("audio_buffer", handle,
+                                    mFrameSize * mBufferSizeFrames);
+    info.bufferSizeFrames = mBufferSizeFrames;
+    info.burstSizeFrames = burstSizeFrames;
+    info.flags = MmapBufferFlag::APPLICATION_SHAREABLE | 0;
+
+    cb(info);
+    native_handle_delete(handle);
+}
+
+void MmapStreamPosition::advance(const uint64_t frames) {
+    const nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+
+    std::lock_guard<std::mutex> guard(mMutex);
+    mFrames += frames;
+    mTimestamp = now;
+}
+
+void MmapStreamPosition::get(MmapPosition &pos) const {
+    std::lock_guard<std::mutex> guard(mMutex);
+    pos.positionFrames = static_cast<int32_t>(mFrames);
+    pos.timeNanoseconds = mTimestamp;
+}
+
+uint64_t MmapStreamPosition::getFrames() const {
+    std::lock_guard<std::mutex> guard(mMutex);
+    return mFrames;
+}
+
+}  // namespace implementation
+}  // namespace V6_0
+}  // namespace audio
+}  // namespace hardware
+}  // namespace android
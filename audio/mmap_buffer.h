@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#include <functional>
+#include <mutex>
+#include <android/hardware/audio/6.0/types.h>
+#include <utils/Timers.h>
+
+namespace android {
+namespace hardware {
+namespace audio {
+namespace V6_0 {
+namespace implementation {
+
+using ::android::hardware::audio::V6_0::MmapBufferInfo;
+using ::android::hardware::audio::V6_0::MmapPosition;
+
+// A circular buffer of frames in shared memory, mapped by both the HAL and
+// the (AAudio) client. The client and the HAL never exchange indices, both
+// sides follow the frame position reported through getMmapPosition.
+struct MmapBuffer {
+    MmapBuffer(size_t frameSize, size_t bufferSizeFrames);
+    ~MmapBuffer();
+
+    bool isValid() const { return mData != nullptr; }
+    size_t getBufferSizeFrames() const { return mBufferSizeFrames; }
+
+    // The frame at the absolute frame position `pos`. The buffer holds a
+    // whole number of bursts, so a burst starting at a multiple of the burst
+    // size is contiguous and the device can transfer it in place.
+    uint8_t *getFrames(uint64_t pos) const {
+        return &mData[(pos % mBufferSizeFrames) * mFrameSize];
+    }
+
+    // The shared memory is only valid for the duration of `cb`.
+    void getInfo(size_t burstSizeFrames,
+                 const std::function<void(const MmapBufferInfo &)> &cb) const;
+
+    MmapBuffer(const MmapBuffer &) = delete;
+    MmapBuffer &operator=(const MmapBuffer &) = delete;
+
+private:
+    const size_t mFrameSize;
+    const size_t mBufferSizeFrames;
+    int mFd = -1;
+    uint8_t *mData = nullptr;
+};
+
+// The frame position of an MMAP stream together with the time the frame
+// was transferred to or from the device.
+struct MmapStreamPosition {
+    void advance(uint64_t frames);
+    void get(MmapPosition &pos) const;
+    uint64_t getFrames() const;
+
+private:
+    mutable std::mutex mMutex;
+    uint64_t mFrames = 0;
+    nsecs_t mTimestamp = 0;
+};
+
+}  // namespace implementation
+}  // namespace V6_0
+}  // namespace audio
+}  // namespace hardware
+}  // namespace android
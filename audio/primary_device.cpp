@@ -14,8 +14,10 @@
  * limitations under the License.
  */
 
+#include <stdio.h>
 #include <log/log.h>
 #include <system/audio.h>
+#include <algorithm>
 #include "primary_device.h"
 #include "stream_in.h"
 #include "stream_out.h"
@@ -40,15 +42,23 @@ PrimaryDevice::PrimaryDevice()
         mMixerMasterPaybackSwitchCtl = mixer_get_ctl_by_name(mMixer.get(), "Master Playback Switch");
         mMixerCaptureSwitchCtl = mixer_get_ctl_by_name(mMixer.get(), "Capture Switch");
 
-        talsa::mixerSetPercentAll(mMixerMasterVolumeCtl, 100);
-        talsa::mixerSetPercentAll(mMixerCaptureVolumeCtl, 100);
-        talsa::mixerSetValueAll(mMixerMasterPaybackSwitchCtl, 1);
-        talsa::mixerSetValueAll(mMixerCaptureSwitchCtl, 1);
+        // once per process, the devices opened after the first one must not
+        // reset the volume set through the first device
+        static std::once_flag initControls;
+        std::call_once(initControls, [this](){
+            talsa::mixerSetPercentAll(mMixerMasterVolumeCtl, 100);
+            talsa::mixerSetPercentAll(mMixerCaptureVolumeCtl, 100);
+            talsa::mixerSetValueAll(mMixerMasterPaybackSwitchCtl, 1);
+            talsa::mixerSetValueAll(mMixerCaptureSwitchCtl, 1);
+        });
     }
+
+    mCaptureRing = CaptureRing::getInstance();
 }
 
 Return<Result> PrimaryDevice::initCheck() {
-    return mMixer ? Result::OK : Result::NOT_INITIALIZED;
+    // the clocked PCM backend has no sound card and no mixer controls
+    return (mMixer || !talsa::pcmIsHardware()) ? Result::OK : Result::NOT_INITIALIZED;
 }
 
 Return<Result> PrimaryDevice::setMasterVolume(float volume) {
@@ -142,7 +152,7 @@ Return<void> PrimaryDevice::openOutputStream(int32_t ioHandle,
     if (util::checkAudioConfig(true, kOutBufferDurationMs, config, suggestedConfig)) {
         ++mNStreams;
         _hidl_cb(Result::OK,
-                 new StreamOut(this, &unrefDevice,
+                 new StreamOut(this, &unrefDevice, &mStreamMixer,
                                ioHandle, device, suggestedConfig, flags, sourceMetadata),
                  config);
     } else {
@@ -159,11 +169,18 @@ Return<void> PrimaryDevice::openInputStream(int32_t ioHandle,
                                             hidl_bitfield<AudioInputFlag> flags,
                                             const SinkMetadata& sinkMetadata,
                                             openInputStream_cb _hidl_cb) {
+    // without the capture ring, a device patch holds the capture device
+    if (!mCaptureRing && hasDevicePatches()) {
+        ALOGE("PrimaryDevice::%s:%d: a device patch is capturing", __func__, __LINE__);
+        _hidl_cb(Result::INVALID_STATE, nullptr, config);
+        return Void();
+    }
+
     AudioConfig suggestedConfig;
     if (util::checkAudioConfig(false, kInBufferDurationMs, config, suggestedConfig)) {
         ++mNStreams;
         _hidl_cb(Result::OK,
-                 new StreamIn(this, &unrefDevice,
+                 new StreamIn(this, &unrefDevice, mCaptureRing.get(),
                               ioHandle, device, suggestedConfig, flags, sinkMetadata),
                  config);
     } else {
@@ -175,15 +192,23 @@ Return<void> PrimaryDevice::openInputStream(int32_t ioHandle,
 }
 
 Return<bool> PrimaryDevice::supportsAudioPatches() {
-    return false;
+    return true;
 }
 
 Return<void> PrimaryDevice::createAudioPatch(const hidl_vec<AudioPortConfig>& sources,
                                              const hidl_vec<AudioPortConfig>& sinks,
                                              createAudioPatch_cb _hidl_cb) {
-    (void)sources;
-    (void)sinks;
-    _hidl_cb(Result::NOT_SUPPORTED, 0);
+    std::unique_ptr<DevicePatch> patch;
+    const Result result = createPatchImpl(sources, sinks, patch);
+    if (result != Result::OK) {
+        _hidl_cb(result, 0);
+        return Void();
+    }
+
+    std::lock_guard<std::mutex> guard(mPatchesMutex);
+    const int32_t handle = mNextPatchHandle++;
+    mPatches[handle] = std::move(patch);
+    _hidl_cb(Result::OK, handle);
     return Void();
 }
 
@@ -191,16 +216,96 @@ Return<void> PrimaryDevice::updateAudioPatch(int32_t previousPatch,
                                              const hidl_vec<AudioPortConfig>& sources,
                                              const hidl_vec<AudioPortConfig>& sinks,
                                              updateAudioPatch_cb _hidl_cb) {
-    (void)previousPatch;
-    (void)sources;
-    (void)sinks;
-    _hidl_cb(Result::NOT_SUPPORTED, 0);
+    std::lock_guard<std::mutex> guard(mPatchesMutex);
+    const auto i = mPatches.find(previousPatch);
+    if (i == mPatches.end()) {
+        _hidl_cb(Result::INVALID_ARGUMENTS, 0);
+        return Void();
+    }
+
+    // the previous patch holds the capture device, stop it first
+    i->second.reset();
+
+    std::unique_ptr<DevicePatch> patch;
+    const Result result = createPatchImpl(sources, sinks, patch);
+    if (result != Result::OK) {
+        mPatches.erase(i);
+        _hidl_cb(result, 0);
+        return Void();
+    }
+
+    i->second = std::move(patch);
+    _hidl_cb(Result::OK, previousPatch);
     return Void();
 }
 
 Return<Result> PrimaryDevice::releaseAudioPatch(int32_t patch) {
-    (void)patch;
-    return Result::NOT_SUPPORTED;
+    std::lock_guard<std::mutex> guard(mPatchesMutex);
+    return mPatches.erase(patch) ? Result::OK : Result::INVALID_ARGUMENTS;
+}
+
+namespace {
+// A DevicePatch runs the built-in mic to the speaker in stereo 16 bit at the
+// device rate, whatever the configs set must match that.
+bool isDevicePatchConfig(const AudioPortConfig &config, const bool isSource) {
+    if ((config.type != AudioPortType::DEVICE)
+            || (config.ext.device.type != (isSource ? AudioDevice::IN_BUILTIN_MIC
+                                                    : AudioDevice::OUT_SPEAKER))) {
+        return false;
+    }
+
+    const hidl_bitfield<AudioPortConfigMask> mask = config.configMask;
+    if ((mask & AudioPortConfigMask::SAMPLE_RATE)
+            && (config.sampleRateHz != talsa::kPcmSampleRateHz)) {
+        return false;
+    }
+    if ((mask & AudioPortConfigMask::CHANNEL_MASK)
+            && (config.channelMask != (isSource ? (AudioChannelMask::IN_STEREO | 0)
+                                                : (AudioChannelMask::OUT_STEREO | 0)))) {
+        return false;
+    }
+    if ((mask & AudioPortConfigMask::FORMAT)
+            && (config.format != AudioFormat::PCM_16_BIT)) {
+        return false;
+    }
+    return true;
+}
+}  // namespace
+
+// Device to device patches are run by a DevicePatch. The device has one
+// port in each direction, so a patch between a mix port and a device port
+// only needs a handle: the stream already plays to (or captures from) it.
+// Without the capture ring a DevicePatch and a capture stream can't share
+// the capture device, the second one fails with INVALID_STATE.
+Result PrimaryDevice::createPatchImpl(const hidl_vec<AudioPortConfig>& sources,
+                                      const hidl_vec<AudioPortConfig>& sinks,
+                                      std::unique_ptr<DevicePatch> &patch) {
+    if (sources.size() != 1 || sinks.size() < 1) {
+        return Result::INVALID_ARGUMENTS;
+    }
+
+    const bool deviceToDevice =
+        (sources[0].type == AudioPortType::DEVICE)
+        && std::all_of(sinks.begin(), sinks.end(), [](const AudioPortConfig &sink){
+            return sink.type == AudioPortType::DEVICE;
+        });
+    if (!deviceToDevice) {
+        return Result::OK;
+    }
+    if (!isDevicePatchConfig(sources[0], true)
+            || !std::all_of(sinks.begin(), sinks.end(), [](const AudioPortConfig &sink){
+                   return isDevicePatchConfig(sink, false);
+               })) {
+        return Result::INVALID_ARGUMENTS;
+    }
+
+    auto p = std::make_unique<DevicePatch>(&mStreamMixer, mCaptureRing.get());
+    if (!p->isRunning()) {
+        return Result::INVALID_STATE;
+    }
+
+    patch = std::move(p);
+    return Result::OK;
 }
 
 Return<void> PrimaryDevice::getAudioPort(const AudioPort& port, getAudioPort_cb _hidl_cb) {
@@ -254,7 +359,7 @@ Return<Result> PrimaryDevice::setConnectedState(const DeviceAddress& dev_addr, b
 }
 
 Return<Result> PrimaryDevice::close() {
-    if (mNStreams > 0) {
+    if (mNStreams > 0 || hasPatches()) {
         return Result::INVALID_STATE;
     } else if (mMixer) {
         mMixerMasterVolumeCtl = nullptr;
@@ -367,6 +472,43 @@ Return<Result> PrimaryDevice::updateRotation(IPrimaryDevice::Rotation rotation)
     return Result::NOT_SUPPORTED;
 }
 
+Return<void> PrimaryDevice::debug(const hidl_handle& fd, const hidl_vec<hidl_string>& options) {
+    (void)options;
+    if (fd.getNativeHandle() == nullptr || fd->numFds < 1) {
+        return Void();
+    }
+
+    const int fd0 = fd->data[0];
+    dprintf(fd0, "Ranchu primary device: %d streams\n", mNStreams.load());
+    mStreamMixer.dump(fd0);
+    if (mCaptureRing) {
+        dprintf(fd0, "  Capture ring: %zu frames\n", mCaptureRing->getCapacityFrames());
+    }
+
+    std::lock_guard<std::mutex> guard(mPatchesMutex);
+    for (const auto &kv : mPatches) {
+        if (kv.second) {
+            dprintf(fd0, "  Patch %d: latency %u ms, glitches: %u\n",
+                    kv.first, kv.second->getLatencyMs(), kv.second->getGlitchCount());
+        } else {
+            dprintf(fd0, "  Patch %d: mix port patch\n", kv.first);
+        }
+    }
+    return Void();
+}
+
+bool PrimaryDevice::hasPatches() {
+    std::lock_guard<std::mutex> guard(mPatchesMutex);
+    return !mPatches.empty();
+}
+
+bool PrimaryDevice::hasDevicePatches() {
+    std::lock_guard<std::mutex> guard(mPatchesMutex);
+    return std::any_of(mPatches.begin(), mPatches.end(), [](const auto &kv){
+        return kv.second != nullptr;
+    });
+}
+
 void PrimaryDevice::unrefDevice(IDevice *dev) {
     static_cast<PrimaryDevice *>(dev)->unrefDeviceImpl();
 }
@@ -17,6 +17,12 @@
 #pragma once
 #include <android/hardware/audio/6.0/IPrimaryDevice.h>
 #include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include "capture_ring.h"
+#include "device_patch.h"
+#include "stream_mixer.h"
 #include "talsa.h"
 
 namespace android {
@@ -27,6 +33,7 @@ namespace implementation {
 
 using ::android::sp;
 using ::android::hardware::hidl_bitfield;
+using ::android::hardware::hidl_handle;
 using ::android::hardware::hidl_string;
 using ::android::hardware::hidl_vec;
 using ::android::hardware::Return;
@@ -97,17 +104,31 @@ struct PrimaryDevice : public IPrimaryDevice {
     Return<Result> setBtHfpSampleRate(uint32_t sampleRateHz) override;
     Return<Result> setBtHfpVolume(float volume) override;
     Return<Result> updateRotation(IPrimaryDevice::Rotation rotation) override;
+    Return<void> debug(const hidl_handle& fd, const hidl_vec<hidl_string>& options) override;
 
 private:
     static void unrefDevice(IDevice*);
     void unrefDeviceImpl();
+    Result createPatchImpl(const hidl_vec<AudioPortConfig>& sources,
+                           const hidl_vec<AudioPortConfig>& sinks,
+                           std::unique_ptr<DevicePatch> &patch);
+    bool hasPatches();
+    bool hasDevicePatches();
 
+    StreamMixer         mStreamMixer;
+    // vendor.audio.capture_ring_ms > 0: all capture goes through the ring
+    std::shared_ptr<CaptureRing> mCaptureRing;
     talsa::MixerPtr     mMixer;
     talsa::mixer_ctl_t  *mMixerMasterVolumeCtl = nullptr;
     talsa::mixer_ctl_t  *mMixerCaptureVolumeCtl = nullptr;
     talsa::mixer_ctl_t  *mMixerMasterPaybackSwitchCtl = nullptr;
     talsa::mixer_ctl_t  *mMixerCaptureSwitchCtl = nullptr;
     std::atomic<int>    mNStreams = 0;
+
+    std::mutex          mPatchesMutex;
+    // nullptr for the patches the device does not need to run
+    std::map<int32_t, std::unique_ptr<DevicePatch>> mPatches;
+    int32_t             mNextPatchHandle = 1;
 };
 
 }  // namespace implementation
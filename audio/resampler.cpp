@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <math.h>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <tuple>
+#include <log/log.h>
+#include "resampler.h"
+
+namespace android {
+namespace hardware {
+namespace audio {
+namespace V6_0 {
+namespace implementation {
+
+namespace {
+
+// The inner loop works on blocks of kLanes interleaved samples with one
+// accumulator per lane, so it vectorizes without reordering the float sums.
+// The number of taps times the number of channels is a multiple of kLanes.
+constexpr size_t kLanes = 8;
+
+struct QualityPreset {
+    unsigned taps;    // per phase
+    double cutoff;    // relative to the lower of the two Nyquist rates
+    double beta;      // Kaiser window
+};
+
+QualityPreset getPreset(const Resampler::Quality quality) {
+    switch (quality) {
+    case Resampler::Quality::LOW:
+        return {8, 0.80, 5.0};
+    case Resampler::Quality::MEDIUM:
+    default:
+        return {24, 0.90, 7.0};
+    case Resampler::Quality::HIGH:
+        return {48, 0.94, 9.0};
+    }
+}
+
+double besselI0(const double x) {
+    double sum = 1;
+    double term = 1;
+    for (int k = 1; k < 32; ++k) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+double sinc(const double x) {
+    return (fabs(x) < 1e-9) ? 1.0 : sin(M_PI * x) / (M_PI * x);
+}
+
+void dotProduct(const float *x, const float *h, const size_t samples,
+                const unsigned nChannels, float *out) {
+    float acc[kLanes] = {};
+    for (size_t i = 0; i < samples; i += kLanes) {
+        for (size_t k = 0; k < kLanes; ++k) {
+            acc[k] += x[i + k] * h[i + k];
+        }
+    }
+
+    for (unsigned c = 0; c < nChannels; ++c) {
+        float sum = 0;
+        for (size_t k = c; k < kLanes; k += nChannels) {
+            sum += acc[k];
+        }
+        out[c] = sum;
+    }
+}
+
+}  // namespace
+
+struct Resampler::FilterBank {
+    unsigned l;
+    unsigned m;
+    unsigned taps;
+    // l phases of taps coefficients, each repeated nChannels times to
+    // line up with the interleaved input
+    std::vector<float> coefs;
+};
+
+bool Resampler::parseQuality(const std::string &str, Quality &quality) {
+    if (str == "low") {
+        quality = Quality::LOW;
+    } else if (str == "medium") {
+        quality = Quality::MEDIUM;
+    } else if (str == "high") {
+        quality = Quality::HIGH;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+const char *Resampler::toString(const Quality quality) {
+    switch (quality) {
+    case Quality::LOW: return "low";
+    case Quality::MEDIUM: return "medium";
+    case Quality::HIGH: return "high";
+    }
+    return "unknown";
+}
+
+std::shared_ptr<const Resampler::FilterBank>
+Resampler::getFilterBank(const unsigned l, const unsigned m,
+                         const Quality quality, const unsigned nChannels) {
+    static std::mutex cacheMutex;
+    static std::map<std::tuple<unsigned, unsigned, Quality, unsigned>,
+                    std::weak_ptr<const FilterBank>> cache;
+
+    const auto key = std::make_tuple(l, m, quality, nChannels);
+    std::lock_guard<std::mutex> guard(cacheMutex);
+    if (auto bank = cache[key].lock()) {
+        return bank;
+    }
+
+    const QualityPreset preset = getPreset(quality);
+    const unsigned taps = preset.taps;
+    const double halfTaps = taps / 2.0;
+    const double fc = preset.cutoff * std::min(1.0, double(l) / m);
+    const double i0Beta = besselI0(preset.beta);
+
+    auto bank = std::make_shared<FilterBank>();
+    bank->l = l;
+    bank->m = m;
+    bank->taps = taps;
+    bank->coefs.resize(size_t(l) * taps * nChannels);
+
+    std::vector<double> h(taps);
+    for (unsigned phase = 0; phase < l; ++phase) {
+        // the output sits phase/l after queued frame (taps/2 - 1)
+        double sum = 0;
+        for (unsigned j = 0; j < taps; ++j) {
+            const double d = j - (halfTaps - 1) - double(phase) / l;
+            const double r = std::min(1.0, fabs(d) / halfTaps);
+            h[j] = fc * sinc(fc * d) * besselI0(preset.beta * sqrt(1 - r * r)) / i0Beta;
+            sum += h[j];
+        }
+
+        // unity gain at DC for every phase
+        float *dst = &bank->coefs[size_t(phase) * taps * nChannels];
+        for (unsigned j = 0; j < taps; ++j) {
+            for (unsigned c = 0; c < nChannels; ++c) {
+                *dst++ = h[j] / sum;
+            }
+        }
+    }
+
+    cache[key] = bank;
+    return bank;
+}
+
+Resampler::Resampler(const unsigned nChannels,
+                     const uint32_t inRateHz,
+                     const uint32_t outRateHz,
+                     const Quality quality)
+        : mNChannels(nChannels)
+        , mQuality(quality)
+        , mBank(getFilterBank(outRateHz / std::gcd(inRateHz, outRateHz),
+                              inRateHz / std::gcd(inRateHz, outRateHz),
+                              quality, nChannels)) {
+    LOG_ALWAYS_FATAL_IF((nChannels == 0) || (kLanes % nChannels));
+
+    // start with the filter centered on the first input frame
+    mQueue.assign((mBank->taps / 2 - 1) * nChannels, 0.0f);
+}
+
+size_t Resampler::getInputFramesNeeded(const size_t outFrames) const {
+    if (outFrames == 0) {
+        return 0;
+    }
+
+    const uint64_t last = mPos + mBank->taps +
+        (mPhase + uint64_t(outFrames - 1) * mBank->m) / mBank->l;
+    const size_t queued = mQueue.size() / mNChannels;
+    return (last > queued) ? (last - queued) : 0;
+}
+
+size_t Resampler::getMaxInputFrames(const size_t outFrames) const {
+    return (uint64_t(outFrames) * mBank->m + mBank->l - 1) / mBank->l + mBank->taps;
+}
+
+size_t Resampler::process(const float *in, const size_t inFrames,
+                          float *out, const size_t maxOutFrames) {
+    const unsigned nChannels = mNChannels;
+    const unsigned taps = mBank->taps;
+    const unsigned l = mBank->l;
+    const unsigned m = mBank->m;
+
+    mQueue.insert(mQueue.end(), in, in + inFrames * nChannels);
+    const size_t queued = mQueue.size() / nChannels;
+
+    size_t n = 0;
+    while ((n < maxOutFrames) && (mPos + taps <= queued)) {
+        dotProduct(&mQueue[mPos * nChannels],
+                   &mBank->coefs[size_t(mPhase) * taps * nChannels],
+                   taps * nChannels, nChannels, &out[n * nChannels]);
+        ++n;
+
+        mPhase += m;
+        mPos += mPhase / l;
+        mPhase %= l;
+    }
+
+    const size_t consumed = std::min(mPos, queued);
+    mQueue.erase(mQueue.begin(), mQueue.begin() + consumed * nChannels);
+    mPos -= consumed;
+
+    return n;
+}
+
+}  // namespace implementation
+}  // namespace V6_0
+}  // namespace audio
+}  // namespace hardware
+}  // namespace android
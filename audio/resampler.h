@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace android {
+namespace hardware {
+namespace audio {
+namespace V6_0 {
+namespace implementation {
+
+// The stream parameter selecting the resampler quality: "low", "medium"
+// or "high". It applies from the next write (output) or the next time the
+// device is opened (input).
+constexpr char kResamplerQualityParameter[] = "resampler_quality";
+
+// Converts interleaved float frames from one sample rate to another with a
+// polyphase windowed sinc filter. The ratio is reduced to L/M and the filter
+// is precomputed as L phases, one per output position between two input
+// frames; the banks are shared by all streams with the same conversion.
+struct Resampler {
+    enum class Quality { LOW, MEDIUM, HIGH };
+
+    static bool parseQuality(const std::string &str, Quality &quality);
+    static const char *toString(Quality quality);
+
+    // nChannels must divide 8 (mono or stereo in practice).
+    Resampler(unsigned nChannels, uint32_t inRateHz, uint32_t outRateHz,
+              Quality quality);
+
+    Quality getQuality() const { return mQuality; }
+
+    // The number of input frames process() still needs to produce
+    // `outFrames` frames, given what it has queued already.
+    size_t getInputFramesNeeded(size_t outFrames) const;
+
+    // An upper bound of getInputFramesNeeded, to size buffers.
+    size_t getMaxInputFrames(size_t outFrames) const;
+
+    // Queues `inFrames` frames and produces up to `maxOutFrames` frames
+    // into `out`, returns the number of frames produced. The input that is
+    // not consumed yet stays queued for the next call.
+    size_t process(const float *in, size_t inFrames, float *out, size_t maxOutFrames);
+
+    Resampler(const Resampler &) = delete;
+    Resampler &operator=(const Resampler &) = delete;
+
+private:
+    struct FilterBank;
+    static std::shared_ptr<const FilterBank> getFilterBank(unsigned l, unsigned m,
+                                                           Quality quality,
+                                                           unsigned nChannels);
+
+    const unsigned mNChannels;
+    const Quality mQuality;
+    const std::shared_ptr<const FilterBank> mBank;
+    std::vector<float> mQueue;  // queued input frames
+    size_t mPos = 0;            // first queued frame of the next output
+    unsigned mPhase = 0;        // phase of the next output, in [0, L)
+};
+
+}  // namespace implementation
+}  // namespace V6_0
+}  // namespace audio
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include "format_convert.h"
+#include "ring_capture.h"
+
+namespace android {
+namespace hardware {
+namespace audio {
+namespace V6_0 {
+namespace implementation {
+
+using ::android::hardware::audio::common::V6_0::AudioFormat;
+
+std::unique_ptr<RingCapture> RingCapture::open(const uint32_t sampleRateHz) {
+    std::shared_ptr<CaptureRing> ring = CaptureRing::getInstance();
+    if (!ring) {
+        return nullptr;
+    }
+    return std::unique_ptr<RingCapture>(new RingCapture(std::move(ring), sampleRateHz));
+}
+
+RingCapture::RingCapture(std::shared_ptr<CaptureRing> ring, const uint32_t sampleRateHz)
+        : mRing(std::move(ring))
+        , mPcm(mRing->openPcm(1, 0)) {
+    if (sampleRateHz != talsa::kPcmSampleRateHz) {
+        mResampler = std::make_unique<Resampler>(1, talsa::kPcmSampleRateHz, sampleRateHz,
+                                                 Resampler::Quality::MEDIUM);
+    }
+}
+
+int RingCapture::read(int16_t *const data, const size_t frames) {
+    if (!mResampler) {
+        return mPcm->read(data, frames * sizeof(int16_t));
+    }
+
+    const size_t pcmFrames = mResampler->getInputFramesNeeded(frames);
+    mPcmBuffer.resize(pcmFrames);
+    mResamplerIn.resize(pcmFrames);
+    mResamplerOut.resize(frames);
+
+    const int res = mPcm->read(mPcmBuffer.data(), pcmFrames * sizeof(int16_t));
+    if (res < 0) {
+        return res;
+    }
+
+    convert::toFloat(AudioFormat::PCM_16_BIT, mPcmBuffer.data(),
+                     mResamplerIn.data(), pcmFrames);
+    const size_t n = mResampler->process(mResamplerIn.data(), pcmFrames,
+                                         mResamplerOut.data(), frames);
+    convert::fromFloat(AudioFormat::PCM_16_BIT, mResamplerOut.data(), data, n);
+    std::fill(data + n, data + frames, 0);
+    return 0;
+}
+
+}  // namespace implementation
+}  // namespace V6_0
+}  // namespace audio
+}  // namespace hardware
+}  // namespace android
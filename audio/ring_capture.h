@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include "capture_ring.h"
+#include "resampler.h"
+#include "talsa.h"
+
+namespace android {
+namespace hardware {
+namespace audio {
+namespace V6_0 {
+namespace implementation {
+
+// Mono 16 bit capture at any rate from the capture ring of the process. The
+// sound trigger HAL runs in this process and reads the microphone through
+// it (see entry.cpp) rather than opening a device and an input stream of
+// its own next to the ones of the framework.
+struct RingCapture {
+    // nullptr without the capture ring (vendor.audio.capture_ring_ms)
+    static std::unique_ptr<RingCapture> open(uint32_t sampleRateHz);
+
+    // Blocks until all the frames are read, returns 0 or -errno.
+    int read(int16_t *data, size_t frames);
+
+    RingCapture(const RingCapture &) = delete;
+    RingCapture &operator=(const RingCapture &) = delete;
+
+private:
+    RingCapture(std::shared_ptr<CaptureRing> ring, uint32_t sampleRateHz);
+
+    const std::shared_ptr<CaptureRing> mRing;
+    talsa::PcmPtr mPcm;
+    std::unique_ptr<Resampler> mResampler;  // unless the rate matches the ring
+    std::vector<int16_t> mPcmBuffer;
+    std::vector<float> mResamplerIn;
+    std::vector<float> mResamplerOut;
+};
+
+}  // namespace implementation
+}  // namespace V6_0
+}  // namespace audio
+}  // namespace hardware
+}  // namespace android
@@ -14,6 +14,11 @@
  * limitations under the License.
  */
 
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 #include <log/log.h>
 #include <fmq/EventFlag.h>
 #include <fmq/MessageQueue.h>
@@ -21,12 +26,12 @@
 #include <hidl/Status.h>
 #include "stream_in.h"
 #include "deleters.h"
+#include "format_convert.h"
+#include "mmap_buffer.h"
 #include "talsa.h"
 #include "util.h"
-#include <sys/resource.h>
 #include <pthread.h>
-#include <cutils/sched_policy.h>
-#include <utils/ThreadDefs.h>
+#include <atomic>
 #include <future>
 #include <thread>
 
@@ -46,12 +51,22 @@ struct ReadThread : public IOThread {
     typedef MessageQueue<uint8_t, kSynchronizedReadWrite> DataMQ;
 
     ReadThread(StreamIn *stream,
+               StreamStats *stats,
+               EffectChain *effects,
+               CaptureRing *captureRing,
+               const size_t prerollFrames,
                const unsigned nChannels,
+               const AudioFormat format,
                const size_t sampleRateHz,
                const size_t frameCount,
                const size_t bufferSize)
             : mStream(stream)
+            , mStats(stats)
+            , mEffects(effects)
+            , mCaptureRing(captureRing)
+            , mPrerollFrames(prerollFrames)
             , mNChannels(nChannels)
+            , mFormat(format)
             , mSampleRateHz(sampleRateHz)
             , mFrameCount(frameCount)
             , mCommandMQ(1)
@@ -104,8 +119,7 @@ struct ReadThread : public IOThread {
     }
 
     void threadLoop() {
-        setpriority(PRIO_PROCESS, 0, PRIORITY_URGENT_AUDIO);
-        set_sched_policy(0, SP_FOREGROUND);
+        mStats->setRealtime(util::setIoThreadPriority("ReadThread"));
         mTid.set_value(pthread_self());
 
         while (true) {
@@ -119,19 +133,13 @@ struct ReadThread : public IOThread {
             if (efState & STAND_BY_REQUEST) {
                 mPcm.reset();
                 mBuffer.reset();
+                mPcmBuffer.reset();
+                mResampler.reset();
             }
 
             if (efState & (MessageQueueFlagBits::NOT_FULL | 0)) {
                 if (!mPcm) {
-                    mBuffer.reset(new uint8_t[mDataMQ.getQuantumCount()]);
-                    LOG_ALWAYS_FATAL_IF(!mBuffer);
-
-                    mPcm = talsa::pcmOpen(
-                        talsa::kPcmCard, talsa::kPcmDevice,
-                        mNChannels, mSampleRateHz, mFrameCount,
-                        false /* isOut */);
-                    LOG_ALWAYS_FATAL_IF(!mPcm);
-
+                    openDevice();
                     mPos.reset();
                 }
 
@@ -140,6 +148,77 @@ struct ReadThread : public IOThread {
         }
     }
 
+    void openDevice() {
+        const size_t maxFrames = mDataMQ.getQuantumCount() / mFrameSize;
+        size_t maxPcmFrames = maxFrames;
+
+        mBuffer.reset(new uint8_t[mDataMQ.getQuantumCount()]);
+        LOG_ALWAYS_FATAL_IF(!mBuffer);
+
+        if (mSampleRateHz != talsa::kPcmSampleRateHz) {
+            mResampler = std::make_unique<Resampler>(
+                mNChannels, talsa::kPcmSampleRateHz, mSampleRateHz,
+                mStream->getResamplerQuality());
+            maxPcmFrames = mResampler->getMaxInputFrames(maxFrames);
+            mResamplerIn.reset(new float[maxPcmFrames * mNChannels]);
+            mResamplerOut.reset(new float[maxFrames * mNChannels]);
+        }
+        if (mResampler || (mFormat != AudioFormat::PCM_16_BIT)) {
+            mPcmBuffer.reset(new int16_t[maxPcmFrames * mNChannels]);
+            LOG_ALWAYS_FATAL_IF(!mPcmBuffer);
+        }
+
+        openPcm(mPrerollFrames);
+    }
+
+    void openPcm(const size_t prerollFrames = 0) {
+        // without the capture ring, the device is busy while another
+        // stream (or a patch) captures, the reads fail until it is released
+        mPcm = openCapturePcm(mCaptureRing, mNChannels, getPcmPeriodSizeFrames(),
+                              mPeriodCount.get(), prerollFrames);
+        mPcmXruns = 0;
+        if (!mPcm) {
+            ALOGE("ReadThread::%s:%d: could not open the capture device",
+                  __func__, __LINE__);
+        }
+    }
+
+    size_t getPcmPeriodSizeFrames() const {
+        return mFrameCount * talsa::kPcmSampleRateHz / mSampleRateHz;
+    }
+
+    // The capture buffer grows as soon as a read comes close to an overrun
+    // or the device has restarted after one (pcm_read recovers on its own),
+    // the device is reopened right away as data is lost anyway. A smaller
+    // buffer is only used the next time the device is opened.
+    void updatePeriodCount(const size_t framesRead) {
+        const uint32_t xruns = mPcm->getXrunCount();
+        const uint32_t newXruns = xruns - mPcmXruns;
+        mPcmXruns = xruns;
+        if (newXruns) {
+            mStats->onXrun(newXruns);
+        }
+
+        unsigned int avail = 0;
+        struct timespec ts;
+        if (mPcm->getHtimestamp(&avail, &ts) != 0) {
+            return;
+        }
+
+        const size_t bufferFrames = mPcm->getBufferSizeFrames();
+        const size_t margin = newXruns ? 0 : (bufferFrames - std::min<size_t>(avail, bufferFrames));
+
+        // the oldest frame still in the device was captured this long ago
+        mStats->onTransfer(framesRead,
+                           (avail + getPcmPeriodSizeFrames()) * 1000 / talsa::kPcmSampleRateHz);
+        const unsigned count = mPeriodCount.get();
+        if (mPeriodCount.update(margin, getPcmPeriodSizeFrames())
+                && (mPeriodCount.get() > count)) {
+            mPcm.reset();
+            openPcm();
+        }
+    }
+
     void processCommand() {
         IStreamIn::ReadParameters rParameters;
 
@@ -174,10 +253,15 @@ struct ReadThread : public IOThread {
     }
 
     IStreamIn::ReadStatus doRead(const IStreamIn::ReadParameters &rParameters) {
+        IStreamIn::ReadStatus status;
+        if (!mPcm) {
+            status.retval = Result::INVALID_STATE;
+            return status;
+        }
+
         const size_t bytesToRead = std::min(mDataMQ.availableToWrite(),
                                             static_cast<size_t>(rParameters.params.read));
 
-        IStreamIn::ReadStatus status;
         size_t read = 0;
         status.retval = doReadImpl(&mBuffer[0], bytesToRead, read);
         if (status.retval == Result::OK) {
@@ -185,28 +269,77 @@ struct ReadThread : public IOThread {
                 ALOGE("ReadThread::%s:%d: mDataMQ.write failed", __func__, __LINE__);
             }
 
-            mPos.addFrames(pcm_bytes_to_frames(mPcm.get(), read));
+            const size_t frames = read / mFrameSize;
+            mPos.addFrames(frames);
             status.reply.read = read;
+
+            updatePeriodCount(frames);
         }
 
         return status;
     }
 
     Result doReadImpl(uint8_t *const data, const size_t toRead, size_t &read) {
-        const int res = pcm_read(mPcm.get(), data, toRead);
+        // The device captures 16 bit at talsa::kPcmSampleRateHz, other
+        // formats and rates are converted from it.
+        const size_t frames = toRead / mFrameSize;
+
+        if (mResampler) {
+            const size_t pcmFrames = mResampler->getInputFramesNeeded(frames);
+            const size_t pcmRead = readPcm(&mPcmBuffer[0], pcmFrames);
+            memset(&mPcmBuffer[pcmRead * mNChannels], 0,
+                   (pcmFrames - pcmRead) * mNChannels * sizeof(int16_t));
+
+            convert::toFloat(AudioFormat::PCM_16_BIT, &mPcmBuffer[0],
+                             &mResamplerIn[0], pcmFrames * mNChannels);
+            const size_t n = mResampler->process(&mResamplerIn[0], pcmFrames,
+                                                 &mResamplerOut[0], frames);
+            convert::fromFloat(mFormat, &mResamplerOut[0], data, n * mNChannels);
+
+            read = n * mFrameSize;
+        } else if (mPcmBuffer) {
+            const size_t n = readPcm(&mPcmBuffer[0], frames);
+            convert::fromInt16(mFormat, &mPcmBuffer[0], data, n * mNChannels);
+
+            read = n * mFrameSize;
+        } else {
+            read = readPcm(reinterpret_cast<int16_t *>(data), frames) * mFrameSize;
+        }
+
+        return Result::OK;
+    }
+
+    // The read is all or nothing (pcm_read returns 0 on success), a failed
+    // one is zero filled. Overruns are not errors, the device recovers and
+    // updatePeriodCount counts them. Returns the number of frames read, the
+    // effects run on them.
+    size_t readPcm(int16_t *pcm, const size_t frames) {
+        const size_t bytes = frames * mNChannels * sizeof(int16_t);
+
+        // a read that waits for the device tells how late the thread runs
+        // after the last of its frames was captured
+        unsigned int avail = 0;
+        struct timespec ts;
+        const bool waits = (mPcm->getHtimestamp(&avail, &ts) == 0) && (avail < frames);
+
+        const int res = mPcm->read(pcm, bytes);
         if (res < 0) {
-            memset(data, 0, toRead);
-            read = toRead;
+            memset(pcm, 0, bytes);
 
             ALOGE("ReadThread::%s:%d pcm_read failed with %s",
                   __func__, __LINE__, strerror(-res));
-        } else if (res == 0) {
-            read = toRead;
-        } else {
-            read = res;
+            mStats->onError();
+            return frames;
         }
 
-        return Result::OK;
+        if (waits && (mPcm->getHtimestamp(&avail, &ts) == 0)) {
+            const nsecs_t capturedNs = s2ns(ts.tv_sec) + ts.tv_nsec
+                - nsecs_t(avail) * 1000000000 / talsa::kPcmSampleRateHz;
+            mStats->onWakeup(systemTime(SYSTEM_TIME_MONOTONIC) - capturedNs);
+        }
+
+        mEffects->process(pcm, frames);
+        return frames;
     }
 
     IStreamIn::ReadStatus doGetCapturePosition() {
@@ -221,15 +354,27 @@ struct ReadThread : public IOThread {
     }
 
     StreamIn *const mStream;
+    StreamStats *const mStats;
+    EffectChain *const mEffects;
+    CaptureRing *const mCaptureRing;
+    const size_t mPrerollFrames;  // at the device rate
     const unsigned mNChannels;
+    const AudioFormat mFormat;
     const size_t mSampleRateHz;
     const size_t mFrameCount;
+    const size_t mFrameSize = mNChannels * util::getBytesPerSample(mFormat);
     CommandMQ mCommandMQ;
     StatusMQ mStatusMQ;
     DataMQ mDataMQ;
     std::unique_ptr<EventFlag, deleters::forEventFlag> mEfGroup;
     std::unique_ptr<uint8_t[]> mBuffer;
+    std::unique_ptr<int16_t[]> mPcmBuffer;  // unless the stream matches the device
+    std::unique_ptr<Resampler> mResampler;  // unless the rate matches the device
+    std::unique_ptr<float[]> mResamplerIn;
+    std::unique_ptr<float[]> mResamplerOut;
     talsa::PcmPtr mPcm;
+    uint32_t mPcmXruns = 0;  // mPcm->getXrunCount() already counted
+    util::AdaptivePeriodCount mPeriodCount{talsa::kPcmPeriodCount, 2, 8, 300 /* reads */};
     util::StreamPosition mPos;
     std::thread mThread;
     std::promise<pthread_t> mTid;
@@ -237,8 +382,130 @@ struct ReadThread : public IOThread {
 
 } // namespace
 
+// Captures an MMAP (AAudio NOIRQ) stream: each burst is read from the device
+// straight into the shared buffer, the client reads it from there as soon as
+// the reported position moves past it. No FMQ copy or EventFlag handshake.
+struct MmapInThread {
+    MmapInThread(CaptureRing *captureRing,
+                 EffectChain *effects,
+                 const unsigned nChannels,
+                 const AudioFormat format,
+                 const size_t burstSizeFrames,
+                 const size_t bufferSizeFrames)
+            : mCaptureRing(captureRing)
+            , mEffects(effects)
+            , mNChannels(nChannels)
+            , mFormat(format)
+            , mBurstSizeFrames(burstSizeFrames)
+            , mBuffer(nChannels * util::getBytesPerSample(format), bufferSizeFrames) {
+        if (format != AudioFormat::PCM_16_BIT) {
+            mPcmBuffer.reset(new int16_t[burstSizeFrames * nChannels]);
+        }
+    }
+
+    ~MmapInThread() {
+        stop();
+    }
+
+    bool isValid() const {
+        return mBuffer.isValid();
+    }
+
+    Result start() {
+        if (mThread.joinable()) {
+            return Result::INVALID_STATE;
+        }
+
+        // the stream rate is the device rate, see createMmapBuffer
+        mPcm = openCapturePcm(mCaptureRing, mNChannels, mBurstSizeFrames,
+                              talsa::kPcmPeriodCount);
+        if (!mPcm) {
+            return Result::INVALID_STATE;
+        }
+
+        mRunning = true;
+        mThread = std::thread(&MmapInThread::threadLoop, this);
+        return Result::OK;
+    }
+
+    Result stop() {
+        if (!mThread.joinable()) {
+            return Result::INVALID_STATE;
+        }
+
+        mRunning = false;
+        mThread.join();
+        mPcm.reset();
+        return Result::OK;
+    }
+
+    void threadLoop() {
+        util::setIoThreadPriority("MmapInThread");
+
+        const size_t burstSizeSamples = mBurstSizeFrames * mNChannels;
+        const size_t burstSizeBytes = burstSizeSamples * sizeof(int16_t);
+        const nsecs_t burstDurationNs =
+            nsecs_t(mBurstSizeFrames) * 1000000000 / talsa::kPcmSampleRateHz;
+        nsecs_t deadline = 0;
+        uint32_t failedReads = 0;
+
+        while (mRunning) {
+            uint8_t *burst = mBuffer.getFrames(mPos.getFrames());
+            int16_t *pcm = mPcmBuffer ? &mPcmBuffer[0]
+                                      : reinterpret_cast<int16_t *>(burst);
+
+            // blocks until the device has a burst, this paces the thread
+            const int res = mPcm->read(pcm, burstSizeBytes);
+            if (res < 0) {
+                memset(pcm, 0, burstSizeBytes);
+
+                // the client follows the position, it keeps moving with
+                // silence at the burst rate rather than spinning
+                if (!failedReads++) {
+                    ALOGE("MmapInThread::%s:%d pcm_read failed with %s",
+                          __func__, __LINE__, strerror(-res));
+                    deadline = systemTime(SYSTEM_TIME_MONOTONIC);
+                }
+                deadline += burstDurationNs;
+                const struct timespec req = {
+                    .tv_sec = static_cast<time_t>(ns2s(deadline)),
+                    .tv_nsec = static_cast<long>(deadline - s2ns(ns2s(deadline))),
+                };
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &req, nullptr) == EINTR) {}
+            } else {
+                if (failedReads) {
+                    ALOGW("MmapInThread::%s:%d %u reads failed", __func__, __LINE__,
+                          failedReads);
+                    failedReads = 0;
+                }
+                mEffects->process(pcm, mBurstSizeFrames);
+            }
+
+            if (mPcmBuffer) {
+                convert::fromInt16(mFormat, pcm, burst, burstSizeSamples);
+            }
+
+            // publish the burst only after it is completely in the buffer
+            mPos.advance(mBurstSizeFrames);
+        }
+    }
+
+    CaptureRing *const mCaptureRing;
+    EffectChain *const mEffects;
+    const unsigned mNChannels;
+    const AudioFormat mFormat;
+    const size_t mBurstSizeFrames;
+    MmapBuffer mBuffer;
+    MmapStreamPosition mPos;
+    std::unique_ptr<int16_t[]> mPcmBuffer;  // unless the stream matches the device
+    talsa::PcmPtr mPcm;
+    std::atomic<bool> mRunning = false;
+    std::thread mThread;
+};
+
 StreamIn::StreamIn(sp<IDevice> dev,
                    void (*unrefDevice)(IDevice*),
+                   CaptureRing *captureRing,
                    int32_t ioHandle,
                    const DeviceAddress& device,
                    const AudioConfig& config,
@@ -246,14 +513,32 @@ StreamIn::StreamIn(sp<IDevice> dev,
                    const SinkMetadata& sinkMetadata)
         : mDev(std::move(dev))
         , mUnrefDevice(unrefDevice)
+        , mCaptureRing(captureRing)
         , mCommon(ioHandle, device, config, flags)
-        , mSinkMetadata(sinkMetadata) {
+        , mSinkMetadata(sinkMetadata)
+        , mStats(false /* isOut */, ioHandle)
+        , mEffects(util::countChannels(mCommon.getChannelMask()), talsa::kPcmSampleRateHz) {
 }
 
 StreamIn::~StreamIn() {
     close();
 }
 
+// Hotword streams start with everything the capture ring holds, the
+// detector wants the audio from before it was started.
+size_t StreamIn::getPrerollFrames() const {
+    if (!mCaptureRing) {
+        return 0;
+    }
+
+    for (const RecordTrackMetadata &track : mSinkMetadata.tracks) {
+        if (track.source == AudioSource::HOTWORD) {
+            return mCaptureRing->getCapacityFrames();
+        }
+    }
+    return 0;
+}
+
 Return<uint64_t> StreamIn::getFrameSize() {
     return mCommon.getFrameSize();
 }
@@ -326,6 +611,9 @@ Return<Result> StreamIn::standby() {
     if (mReadThread) {
         LOG_ALWAYS_FATAL_IF(!mReadThread->standby());
     }
+    if (mMmapThread) {
+        mMmapThread->stop();
+    }
 
     return Result::OK;
 }
@@ -343,14 +631,46 @@ Return<void> StreamIn::getParameters(const hidl_vec<ParameterValue>& context,
                                      const hidl_vec<hidl_string>& keys,
                                      getParameters_cb _hidl_cb) {
     (void)context;
-    _hidl_cb((keys.size() > 0) ? Result::NOT_SUPPORTED : Result::OK, {});
+    std::vector<ParameterValue> values;
+    for (const hidl_string &key : keys) {
+        if (key == kResamplerQualityParameter) {
+            values.push_back({key, Resampler::toString(mResamplerQuality)});
+        } else if (key == kEffectsParameter) {
+            values.push_back({key, mEffects.getEffects()});
+        } else if (key == kEffectGainParameter) {
+            values.push_back({key, std::to_string(mEffects.getGainDb())});
+        } else {
+            _hidl_cb(Result::NOT_SUPPORTED, {});
+            return Void();
+        }
+    }
+
+    _hidl_cb(Result::OK, values);
     return Void();
 }
 
 Return<Result> StreamIn::setParameters(const hidl_vec<ParameterValue>& context,
                                        const hidl_vec<ParameterValue>& parameters) {
     (void)context;
-    (void)parameters;
+    for (const ParameterValue &p : parameters) {
+        if (p.key == kResamplerQualityParameter) {
+            Resampler::Quality quality;
+            if (!Resampler::parseQuality(p.value, quality)) {
+                return Result::INVALID_ARGUMENTS;
+            }
+            mResamplerQuality = quality;
+        } else if (p.key == kEffectsParameter) {
+            if (!mEffects.setEffects(p.value)) {
+                return Result::INVALID_ARGUMENTS;
+            }
+        } else if (p.key == kEffectGainParameter) {
+            char *end;
+            const float gainDb = strtof(p.value.c_str(), &end);
+            if ((end == p.value.c_str()) || *end || !mEffects.setGainDb(gainDb)) {
+                return Result::INVALID_ARGUMENTS;
+            }
+        }
+    }
     return Result::OK;
 }
 
@@ -359,29 +679,87 @@ Return<Result> StreamIn::setHwAvSync(uint32_t hwAvSync) {
     return Result::NOT_SUPPORTED;
 }
 
+Return<void> StreamIn::debug(const hidl_handle& fd, const hidl_vec<hidl_string>& options) {
+    (void)options;
+    if (fd.getNativeHandle() == nullptr || fd->numFds < 1) {
+        return Void();
+    }
+
+    const int fd0 = fd->data[0];
+    dprintf(fd0, "  Input stream %d: %u Hz, %s, %" PRIu64 " frames%s\n",
+            mCommon.m_ioHandle, mCommon.getSampleRate(),
+            toString(mCommon.getFormat()).c_str(), mCommon.getFrameCount(),
+            mMmapThread ? ", mmap" : "");
+    mStats.dump(fd0);
+    mEffects.dump(fd0);
+    return Void();
+}
+
 Return<Result> StreamIn::start() {
-    return Result::NOT_SUPPORTED;
+    return mMmapThread ? mMmapThread->start() : Result::INVALID_STATE;
 }
 
 Return<Result> StreamIn::stop() {
-    return Result::NOT_SUPPORTED;
+    return mMmapThread ? mMmapThread->stop() : Result::INVALID_STATE;
 }
 
 Return<void> StreamIn::createMmapBuffer(int32_t minSizeFrames,
                                         createMmapBuffer_cb _hidl_cb) {
-    (void)minSizeFrames;
-    _hidl_cb(Result::NOT_SUPPORTED, {});
+    if (minSizeFrames <= 0 || minSizeFrames > (1 << 20)) {
+        _hidl_cb(Result::INVALID_ARGUMENTS, {});
+        return Void();
+    }
+
+    if (mReadThread || mMmapThread) {
+        _hidl_cb(Result::INVALID_STATE, {});
+        return Void();
+    }
+
+    // The device transfers straight into the buffer, there is no room for
+    // a resampler.
+    if (mCommon.getSampleRate() != talsa::kPcmSampleRateHz) {
+        _hidl_cb(Result::NOT_SUPPORTED, {});
+        return Void();
+    }
+
+    // The buffer holds a whole number of bursts
+    const size_t burstSizeFrames = mCommon.getFrameCount();
+    const size_t bufferSizeFrames =
+        (minSizeFrames + burstSizeFrames - 1) / burstSizeFrames * burstSizeFrames;
+
+    auto t = std::make_unique<MmapInThread>(mCaptureRing,
+                                            &mEffects,
+                                            util::countChannels(mCommon.getChannelMask()),
+                                            mCommon.getFormat(),
+                                            burstSizeFrames,
+                                            bufferSizeFrames);
+    if (t->isValid()) {
+        t->mBuffer.getInfo(burstSizeFrames, [&_hidl_cb](const MmapBufferInfo &info) {
+            _hidl_cb(Result::OK, info);
+        });
+        mMmapThread = std::move(t);
+    } else {
+        _hidl_cb(Result::NOT_INITIALIZED, {});
+    }
+
     return Void();
 }
 
 Return<void> StreamIn::getMmapPosition(getMmapPosition_cb _hidl_cb) {
-    _hidl_cb(Result::NOT_SUPPORTED, {});
+    if (mMmapThread) {
+        MmapPosition pos;
+        mMmapThread->mPos.get(pos);
+        _hidl_cb(Result::OK, pos);
+    } else {
+        _hidl_cb(Result::INVALID_STATE, {});
+    }
     return Void();
 }
 
 Return<Result> StreamIn::close() {
     if (mDev) {
         mReadThread.reset();
+        mMmapThread.reset();
         mUnrefDevice(mDev.get());
         mDev = nullptr;
         return Result::OK;
@@ -413,13 +791,19 @@ Return<void> StreamIn::prepareForReading(uint32_t frameSize,
         return Void();
     }
 
-    if (mReadThread) {  // INVALID_STATE if the method was already called.
+    // INVALID_STATE if the method was already called or the stream is MMAP.
+    if (mReadThread || mMmapThread) {
         _hidl_cb(Result::INVALID_STATE, {}, {}, {}, {});
         return Void();
     }
 
     auto t = std::make_unique<ReadThread>(this,
+                                          &mStats,
+                                          &mEffects,
+                                          mCaptureRing,
+                                          getPrerollFrames(),
                                           util::countChannels(mCommon.getChannelMask()),
+                                          mCommon.getFormat(),
                                           mCommon.getSampleRate(),
                                           mCommon.getFrameCount(),
                                           frameSize * framesCount);
@@ -17,8 +17,13 @@
 #pragma once
 #include <android/hardware/audio/6.0/IStreamIn.h>
 #include <android/hardware/audio/6.0/IDevice.h>
+#include <atomic>
 #include "stream_common.h"
+#include "effect_chain.h"
 #include "io_thread.h"
+#include "capture_ring.h"
+#include "resampler.h"
+#include "stream_stats.h"
 
 namespace android {
 namespace hardware {
@@ -28,15 +33,19 @@ namespace implementation {
 
 using ::android::sp;
 using ::android::hardware::hidl_bitfield;
+using ::android::hardware::hidl_handle;
 using ::android::hardware::hidl_string;
 using ::android::hardware::hidl_vec;
 using ::android::hardware::Return;
 using namespace ::android::hardware::audio::common::V6_0;
 using namespace ::android::hardware::audio::V6_0;
 
+struct MmapInThread;
+
 struct StreamIn : public IStreamIn {
     StreamIn(sp<IDevice> dev,
              void (*unrefDevice)(IDevice*),
+             CaptureRing *captureRing,
              int32_t ioHandle,
              const DeviceAddress& device,
              const AudioConfig& config,
@@ -86,13 +95,23 @@ struct StreamIn : public IStreamIn {
     Return<void> getActiveMicrophones(getActiveMicrophones_cb _hidl_cb) override;
     Return<Result> setMicrophoneDirection(MicrophoneDirection direction) override;
     Return<Result> setMicrophoneFieldDimension(float zoom) override;
+    Return<void> debug(const hidl_handle& fd, const hidl_vec<hidl_string>& options) override;
+
+    Resampler::Quality getResamplerQuality() const { return mResamplerQuality; }
 
 private:
+    size_t getPrerollFrames() const;
+
     sp<IDevice> mDev;
     void (* const mUnrefDevice)(IDevice*);
+    CaptureRing *const mCaptureRing;
     const StreamCommon mCommon;
     const SinkMetadata mSinkMetadata;
     std::unique_ptr<IOThread> mReadThread;
+    std::atomic<Resampler::Quality> mResamplerQuality = Resampler::Quality::MEDIUM;
+    StreamStats mStats;
+    EffectChain mEffects;
+    std::unique_ptr<MmapInThread> mMmapThread;
 };
 
 }  // namespace implementation
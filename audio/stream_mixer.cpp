@@ -0,0 +1,487 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <algorithm>
+#include <log/log.h>
+#include "format_convert.h"
+#include "stream_mixer.h"
+#include "util.h"
+
+namespace android {
+namespace hardware {
+namespace audio {
+namespace V6_0 {
+namespace implementation {
+
+namespace {
+
+// Branch free so the compiler can vectorize it.
+void accumulate(float *acc, const float *src, const size_t frames,
+                const float gainL, const float gainR) {
+    for (size_t i = 0; i < frames; ++i) {
+        acc[2 * i] += gainL * src[2 * i];
+        acc[2 * i + 1] += gainR * src[2 * i + 1];
+    }
+}
+
+// Same with the gains moving linearly by step* per frame, the gain of
+// every frame is computed from the start so the iterations are independent.
+void accumulateRamp(float *acc, const float *src, const size_t frames,
+                    const float gainL, const float stepL,
+                    const float gainR, const float stepR) {
+    for (int i = 0; i < int(frames); ++i) {
+        acc[2 * i] += (gainL + stepL * i) * src[2 * i];
+        acc[2 * i + 1] += (gainR + stepR * i) * src[2 * i + 1];
+    }
+}
+
+}  // namespace
+
+StreamMixer::Source::Source(StreamMixer *mixer,
+                            const unsigned nChannels,
+                            const AudioFormat format,
+                            const uint32_t sampleRateHz,
+                            const size_t capacityFrames)
+        : mMixer(mixer)
+        , mNChannels(nChannels)
+        , mFormat(format)
+        , mFrameSize(nChannels * util::getBytesPerSample(format))
+        , mSampleRateHz(sampleRateHz)
+        , mCapacityFrames(capacityFrames)
+        , mRing(new float[capacityFrames * kChannels])
+        , mMixTimestamp(systemTime(SYSTEM_TIME_MONOTONIC)) {
+    setResamplerQuality(Resampler::Quality::MEDIUM);
+}
+
+void StreamMixer::Source::setResamplerQuality(const Resampler::Quality quality) {
+    if (mSampleRateHz == kSampleRateHz) {
+        return;
+    }
+    if (mResampler && mResampler->getQuality() == quality) {
+        return;
+    }
+
+    mResampler = std::make_unique<Resampler>(kChannels, mSampleRateHz,
+                                             kSampleRateHz, quality);
+    mResamplerIn.reset(new float[mResampler->getMaxInputFrames(mCapacityFrames) * kChannels]);
+}
+
+void StreamMixer::Source::convertToStereo(float *dst, const uint8_t *src,
+                                        const size_t frames) const {
+    if (mNChannels == kChannels) {
+        convert::toFloat(mFormat, src, dst, frames * kChannels);
+    } else {
+        // mono: convert into the upper half of dst, then spread the samples
+        // to both channels going up, every sample is read before its slot
+        // can be overwritten.
+        float *mono = dst + frames;
+        convert::toFloat(mFormat, src, mono, frames);
+        for (size_t i = 0; i < frames; ++i) {
+            const float v = mono[i];
+            dst[2 * i] = v;
+            dst[2 * i + 1] = v;
+        }
+    }
+}
+
+size_t StreamMixer::Source::write(const void *data, const size_t frames) {
+    if (!mActive.exchange(true)) {
+        mMixer->onSourceActive();
+    }
+
+    size_t written = 0;
+    mWakeupLateNs = -1;
+    while (written < frames && !mInterrupted) {
+        const size_t avail = availableToWrite();
+        if (avail == 0) {
+            {
+                std::unique_lock<std::mutex> lock(mMixer->mMutex);
+                mMixer->mConsumedCond.wait(lock, [this](){
+                    return mInterrupted || availableToWrite() > 0;
+                });
+            }
+            // the room was made by the last period mixed
+            std::lock_guard<std::mutex> guard(mPositionMutex);
+            mWakeupLateNs = systemTime(SYSTEM_TIME_MONOTONIC) - mMixTimestamp;
+            continue;
+        }
+
+        const uint64_t wp = mWritePos.load(std::memory_order_relaxed);
+        const size_t offset = wp % mCapacityFrames;
+        const uint8_t *src = static_cast<const uint8_t *>(data) + written * mFrameSize;
+        size_t n;
+
+        if (mResampler) {
+            // Feed just enough input to fill the free space, the rest of
+            // what the resampler could produce stays queued in it.
+            const size_t consumed = std::min(frames - written,
+                                             mResampler->getInputFramesNeeded(avail));
+            convertToStereo(&mResamplerIn[0], src, consumed);
+
+            const size_t n1 = std::min(avail, mCapacityFrames - offset);
+            n = mResampler->process(&mResamplerIn[0], consumed,
+                                    &mRing[offset * kChannels], n1);
+            if (n == n1) {
+                n += mResampler->process(nullptr, 0, &mRing[0], avail - n1);
+            }
+
+            written += consumed;
+        } else {
+            n = std::min(avail, frames - written);
+            const size_t n1 = std::min(n, mCapacityFrames - offset);
+
+            convertToStereo(&mRing[offset * kChannels], src, n1);
+            convertToStereo(&mRing[0], src + n1 * mFrameSize, n - n1);
+
+            written += n;
+        }
+
+        // in place, before the mixer can see the frames
+        if (mEffects && mEffects->isEnabled()) {
+            const size_t n1 = std::min(n, mCapacityFrames - offset);
+            mEffects->process(&mRing[offset * kChannels], n1);
+            mEffects->process(&mRing[0], n - n1);
+        }
+
+        mWritePos.store(wp + n, std::memory_order_release);
+    }
+
+    return written;
+}
+
+size_t StreamMixer::Source::availableToWrite() const {
+    const uint64_t rp = std::max(mReadPos.load(std::memory_order_acquire),
+                                 mDiscardPos.load(std::memory_order_relaxed));
+    return mCapacityFrames - (mWritePos.load(std::memory_order_relaxed) - rp);
+}
+
+void StreamMixer::Source::standby() {
+    mDiscardPos.store(mWritePos.load(std::memory_order_relaxed),
+                      std::memory_order_relaxed);
+    mActive = false;
+
+    // the frames queued in the resampler would play on the next write
+    if (mResampler) {
+        mResampler = std::make_unique<Resampler>(kChannels, mSampleRateHz, kSampleRateHz,
+                                                 mResampler->getQuality());
+    }
+}
+
+void StreamMixer::Source::interrupt() {
+    {
+        std::lock_guard<std::mutex> guard(mMixer->mMutex);
+        mInterrupted = true;
+    }
+    mMixer->mConsumedCond.notify_all();
+}
+
+void StreamMixer::Source::clearInterrupt() {
+    mInterrupted = false;
+}
+
+void StreamMixer::Source::setPaused(const bool paused) {
+    if (mPaused.exchange(paused) && !paused && mActive) {
+        mMixer->onSourceActive();
+    }
+}
+
+bool StreamMixer::Source::isDrained() const {
+    const uint64_t rp = std::max(mReadPos.load(std::memory_order_acquire),
+                                 mDiscardPos.load(std::memory_order_relaxed));
+    return rp == mWritePos.load(std::memory_order_relaxed);
+}
+
+void StreamMixer::Source::getPresentationPosition(uint64_t &frames,
+                                                  nsecs_t &timestamp) const {
+    std::lock_guard<std::mutex> guard(mPositionMutex);
+    frames = mFramesMixed * mSampleRateHz / kSampleRateHz;
+    timestamp = mMixTimestamp;
+}
+
+void StreamMixer::Source::mixInto(float *acc, const size_t frames) {
+    if (!mActive || mPaused) {
+        mStarving = false;
+        return;
+    }
+
+    const uint64_t rp = std::max(mReadPos.load(std::memory_order_relaxed),
+                                 mDiscardPos.load(std::memory_order_relaxed));
+    const uint64_t wp = mWritePos.load(std::memory_order_acquire);
+    const size_t n = std::min(frames, static_cast<size_t>(wp - rp));
+    // once per run of short periods: a client that stops writing without
+    // going to standby (between tracks) would count one every period
+    if (n < frames) {
+        if (!mStarving) {
+            ++mUnderruns;
+            mStarving = true;
+        }
+    } else {
+        mStarving = false;
+    }
+
+    const size_t offset = rp % mCapacityFrames;
+    const size_t n1 = std::min(n, mCapacityFrames - offset);
+
+    updateGainRamp();
+    applyGain(acc, &mRing[offset * kChannels], n1);
+    applyGain(acc + n1 * kChannels, &mRing[0], n - n1);
+
+    mReadPos.store(rp + n, std::memory_order_release);
+
+    std::lock_guard<std::mutex> guard(mPositionMutex);
+    mFramesMixed += n;
+    mMixTimestamp = systemTime(SYSTEM_TIME_MONOTONIC);
+}
+
+void StreamMixer::Source::setVolume(const float left, const float right,
+                                    const uint32_t rampMs) {
+    mVolumeRampFrames = size_t(rampMs) * kSampleRateHz / 1000;
+    mTargetGain[0] = left;
+    mTargetGain[1] = right;
+}
+
+// Starts a new ramp from the current gains if the volume has changed.
+void StreamMixer::Source::updateGainRamp() {
+    const float target[kChannels] = { mTargetGain[0], mTargetGain[1] };
+    if ((target[0] == mRampTarget[0]) && (target[1] == mRampTarget[1])) {
+        return;
+    }
+
+    const size_t rampFrames = mVolumeRampFrames;
+    for (unsigned c = 0; c < kChannels; ++c) {
+        mRampTarget[c] = target[c];
+        mGainStep[c] = rampFrames ? ((target[c] - mGain[c]) / rampFrames) : 0;
+        if (!rampFrames) {
+            mGain[c] = target[c];
+        }
+    }
+    mRampFramesLeft = rampFrames;
+}
+
+void StreamMixer::Source::applyGain(float *acc, const float *src, size_t frames) {
+    if (mRampFramesLeft > 0) {
+        const size_t n = std::min(frames, mRampFramesLeft);
+        accumulateRamp(acc, src, n, mGain[0], mGainStep[0], mGain[1], mGainStep[1]);
+        mRampFramesLeft -= n;
+        for (unsigned c = 0; c < kChannels; ++c) {
+            // no rounding error is left at the end of the ramp
+            mGain[c] = mRampFramesLeft ? (mGain[c] + mGainStep[c] * n) : mRampTarget[c];
+        }
+
+        acc += n * kChannels;
+        src += n * kChannels;
+        frames -= n;
+    }
+
+    accumulate(acc, src, frames, mGain[0], mGain[1]);
+}
+
+StreamMixer::StreamMixer()
+        : mPeriodCount(talsa::kPcmPeriodCount, kMinPeriodCount, kMaxPeriodCount,
+                       kQuietPeriodCount)
+        , mAcc(new float[kPeriodSizeFrames * kChannels])
+        , mOut(new int16_t[kPeriodSizeFrames * kChannels]) {
+    mThread = std::thread(&StreamMixer::threadLoop, this);
+}
+
+StreamMixer::~StreamMixer() {
+    {
+        std::lock_guard<std::mutex> guard(mMutex);
+        mExit = true;
+    }
+    mActiveCond.notify_all();
+    mThread.join();
+}
+
+std::shared_ptr<StreamMixer::Source> StreamMixer::addSource(const unsigned nChannels,
+                                                            const AudioFormat format,
+                                                            const uint32_t sampleRateHz,
+                                                            const size_t capacityFrames) {
+    auto source = std::make_shared<Source>(this, nChannels, format, sampleRateHz,
+                                           capacityFrames);
+
+    std::lock_guard<std::mutex> guard(mMutex);
+    mSources.push_back(source);
+    return source;
+}
+
+void StreamMixer::removeSource(const std::shared_ptr<Source> &source) {
+    std::lock_guard<std::mutex> guard(mMutex);
+    mSources.erase(std::remove(mSources.begin(), mSources.end(), source),
+                   mSources.end());
+}
+
+uint32_t StreamMixer::getLatencyMs() const {
+    // not measured while the device is closed or restarting, use the
+    // queue the mixer is aiming for
+    size_t queued = mDeviceQueuedFrames;
+    if (queued == 0) {
+        queued = (mPeriodCount.get() - 1) * kPeriodSizeFrames;
+    }
+    return (queued + kPeriodSizeFrames) * 1000 / kSampleRateHz;
+}
+
+void StreamMixer::dump(const int fd) const {
+    dprintf(fd, "  Mixer: %u periods of %zu frames, latency %u ms, "
+                "device underruns: %u, write errors: %u, %s\n",
+            mPeriodCount.get(), kPeriodSizeFrames, getLatencyMs(),
+            mDeviceUnderruns.load(), mWriteErrors.load(),
+            mRealtime ? "SCHED_FIFO" : "SCHED_OTHER");
+    mWakeupLateUs.dump(fd, "wakeup late (us)");
+    mWakeupToWriteUs.dump(fd, "wakeup to write (us)");
+}
+
+void StreamMixer::onSourceActive() {
+    {
+        std::lock_guard<std::mutex> guard(mMutex);
+    }
+    mActiveCond.notify_one();
+}
+
+void StreamMixer::onFramesConsumed() {
+    {
+        std::lock_guard<std::mutex> guard(mMutex);
+    }
+    mConsumedCond.notify_all();
+}
+
+bool StreamMixer::hasActiveSourcesLocked() const {
+    return std::any_of(mSources.begin(), mSources.end(),
+                       [](const std::shared_ptr<Source> &s){
+                           return s->mActive && !s->mPaused;
+                       });
+}
+
+void StreamMixer::threadLoop() {
+    mRealtime = util::setIoThreadPriority("StreamMixer");
+
+    while (true) {
+        std::vector<std::shared_ptr<Source>> sources;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            if (!mExit && !hasActiveSourcesLocked()) {
+                mPcm.reset();  // all streams are in standby
+                mPcmStarted = false;
+                mDeviceQueuedFrames = 0;
+                mActiveCond.wait(lock, [this](){
+                    return mExit || hasActiveSourcesLocked();
+                });
+            }
+            if (mExit) {
+                return;
+            }
+            sources = mSources;
+        }
+
+        if (!mPcm) {
+            mPcm = talsa::pcmOpen(
+                talsa::kPcmCard, talsa::kPcmDevice,
+                kChannels, kSampleRateHz, kPeriodSizeFrames,
+                kMaxPeriodCount, true /* isOut */);
+            LOG_ALWAYS_FATAL_IF(!mPcm);
+        }
+
+        mixPeriod(sources);
+    }
+}
+
+// Sleeps until the device queue is down to the current period count minus
+// the period about to be written, so the latency follows mPeriodCount
+// without reopening the device. What is left queued when the thread is
+// about to write is its margin before an underrun.
+void StreamMixer::waitForDevice() {
+    size_t queued;
+    if (!getDeviceQueuedFrames(queued)) {
+        // not running: not started yet or stopped by an underrun
+        if (mPcmStarted) {
+            mPeriodCount.update(0, kPeriodSizeFrames);
+            ++mDeviceUnderruns;
+        }
+        mDeviceQueuedFrames = 0;
+        return;
+    }
+
+    const size_t target = (mPeriodCount.get() - 1) * kPeriodSizeFrames;
+    if (queued > target) {
+        const nsecs_t delay = nsecs_t(queued - target) * 1000000000 / kSampleRateHz;
+        const struct timespec req = {
+            .tv_sec = static_cast<time_t>(ns2s(delay)),
+            .tv_nsec = static_cast<long>(delay - s2ns(ns2s(delay))),
+        };
+        const nsecs_t sleepStart = systemTime(SYSTEM_TIME_MONOTONIC);
+        nanosleep(&req, nullptr);
+        mWakeupLateUs.add(ns2us(std::max<nsecs_t>(
+            0, systemTime(SYSTEM_TIME_MONOTONIC) - sleepStart - delay)));
+
+        if (!getDeviceQueuedFrames(queued)) {
+            queued = 0;
+        }
+    }
+
+    mPeriodCount.update(queued, kPeriodSizeFrames);
+    mDeviceQueuedFrames = queued;
+}
+
+bool StreamMixer::getDeviceQueuedFrames(size_t &queued) const {
+    unsigned int avail = 0;
+    struct timespec ts;
+    if (mPcm->getHtimestamp(&avail, &ts) != 0) {
+        return false;
+    }
+
+    const size_t bufferFrames = mPcm->getBufferSizeFrames();
+    queued = bufferFrames - std::min<size_t>(avail, bufferFrames);
+    return true;
+}
+
+void StreamMixer::mixPeriod(const std::vector<std::shared_ptr<Source>> &sources) {
+    const size_t samples = kPeriodSizeFrames * kChannels;
+
+    waitForDevice();
+    const nsecs_t wakeup = systemTime(SYSTEM_TIME_MONOTONIC);
+
+    std::fill(&mAcc[0], &mAcc[samples], 0.0f);
+    for (const auto &source : sources) {
+        source->mixInto(&mAcc[0], kPeriodSizeFrames);
+    }
+
+    // let the stream threads refill while pcm_write blocks
+    onFramesConsumed();
+
+    convert::fromFloat(AudioFormat::PCM_16_BIT, &mAcc[0], &mOut[0], samples);
+    mWakeupToWriteUs.add(ns2us(systemTime(SYSTEM_TIME_MONOTONIC) - wakeup));
+    const int res = mPcm->write(&mOut[0], samples * sizeof(int16_t));
+    if (res) {
+        ALOGE("StreamMixer::%s:%d: pcm_write failed with %s",
+              __func__, __LINE__, strerror(-res));
+        ++mWriteErrors;
+        for (const auto &source : sources) {
+            if (source->mActive && !source->mPaused) {
+                ++source->mWriteErrors;
+            }
+        }
+    } else {
+        mPcmStarted = true;
+    }
+}
+
+}  // namespace implementation
+}  // namespace V6_0
+}  // namespace audio
+}  // namespace hardware
+}  // namespace android
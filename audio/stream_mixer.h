@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <android/hardware/audio/common/6.0/types.h>
+#include <utils/Timers.h>
+#include "effect_chain.h"
+#include "resampler.h"
+#include "stream_stats.h"
+#include "talsa.h"
+#include "util.h"
+
+namespace android {
+namespace hardware {
+namespace audio {
+namespace V6_0 {
+namespace implementation {
+
+using ::android::hardware::audio::common::V6_0::AudioFormat;
+
+// Mixes all output streams of the device into the single hardware PCM.
+// Every stream owns a Source: its IO thread queues frames into the source
+// ring and the mixer thread pulls one period from every active source,
+// applies the source volume, accumulates in float and writes the result.
+struct StreamMixer {
+    static constexpr unsigned kChannels = 2;
+    static constexpr size_t kSampleRateHz = talsa::kPcmSampleRateHz;
+    static constexpr size_t kPeriodDurationMs = 10;
+    static constexpr size_t kPeriodSizeFrames = kSampleRateHz * kPeriodDurationMs / 1000;
+    // The device buffer always has room for kMaxPeriodCount periods, the
+    // mixer keeps between kMinPeriodCount and that many queued.
+    static constexpr unsigned kMinPeriodCount = 2;
+    static constexpr unsigned kMaxPeriodCount = 8;
+    static constexpr unsigned kQuietPeriodCount = 5000 / kPeriodDurationMs;
+
+    struct Source {
+        Source(StreamMixer *mixer, unsigned nChannels, AudioFormat format,
+               uint32_t sampleRateHz, size_t capacityFrames);
+
+        // Queues interleaved frames in the source format and rate, converting
+        // them to the mixer format and rate. Blocks while the ring is full,
+        // returns early (a partial write) once interrupt() is called.
+        size_t write(const void *data, size_t frames);
+
+        // Any thread: makes the current and all next writes return early
+        // until the writer thread calls clearInterrupt().
+        void interrupt();
+        void clearInterrupt();
+
+        // A paused source keeps its frames but is not mixed, nor does it
+        // keep the device open.
+        void setPaused(bool paused);
+
+        // All the queued frames have been mixed.
+        bool isDrained() const;
+
+        // Frames mixed so far (at the source rate) and when the last of them
+        // was mixed, monotonic across pause, flush and standby.
+        void getPresentationPosition(uint64_t &frames, nsecs_t &timestamp) const;
+
+        // Writer thread only, no-op if the source is at the mixer rate.
+        void setResamplerQuality(Resampler::Quality quality);
+
+        // Writer thread only: the effects run on the written frames once
+        // they are converted to the mixer format and rate.
+        void setEffectChain(EffectChain *effects) { mEffects = effects; }
+
+        // Drops the queued frames (also those in the resampler) and stops
+        // mixing the source until the next write, the device is closed once
+        // all sources are in standby.
+        void standby();
+
+        // Room in the ring, a write of up to this many frames (at the mixer
+        // rate) does not block.
+        size_t availableToWrite() const;
+
+        // Frames (at the mixer rate) waiting to be mixed.
+        size_t getQueuedFrames() const { return mCapacityFrames - availableToWrite(); }
+
+        // Any thread: the per channel gains the source ramps to linearly
+        // over rampMs, starting with the next period mixed.
+        void setVolume(float left, float right, uint32_t rampMs);
+        uint32_t getUnderrunCount() const { return mUnderruns; }
+        // device writes that failed while the source was mixed
+        uint32_t getWriteErrorCount() const { return mWriteErrors; }
+
+        // Writer thread only: how late the last write that had to wait ran
+        // after the mixer made room, -1 if it did not wait.
+        nsecs_t getWakeupLateNs() const { return mWakeupLateNs; }
+
+    private:
+        friend struct StreamMixer;
+
+        void convertToStereo(float *dst, const uint8_t *src, size_t frames) const;
+
+        // Mixer thread: adds up to `frames` frames into `acc`.
+        void mixInto(float *acc, size_t frames);
+        void updateGainRamp();
+        void applyGain(float *acc, const float *src, size_t frames);
+
+        StreamMixer *const mMixer;
+        const unsigned mNChannels;
+        const AudioFormat mFormat;
+        const size_t mFrameSize;
+        const uint32_t mSampleRateHz;
+        const size_t mCapacityFrames;
+        std::unique_ptr<float[]> mRing;  // always kChannels per frame
+        std::unique_ptr<Resampler> mResampler;  // writer thread only
+        std::unique_ptr<float[]> mResamplerIn;
+        EffectChain *mEffects = nullptr;  // writer thread only
+        std::atomic<uint64_t> mWritePos = 0;
+        std::atomic<uint64_t> mReadPos = 0;
+        std::atomic<uint64_t> mDiscardPos = 0;  // frames before it are dropped
+        std::atomic<bool> mActive = false;
+        std::atomic<bool> mPaused = false;
+        std::atomic<bool> mInterrupted = false;
+        std::atomic<float> mTargetGain[kChannels] = {1.0f, 1.0f};
+        std::atomic<size_t> mVolumeRampFrames = 0;
+        float mRampTarget[kChannels] = {1.0f, 1.0f};  // mixer thread only
+        float mGain[kChannels] = {1.0f, 1.0f};
+        float mGainStep[kChannels] = {0, 0};
+        size_t mRampFramesLeft = 0;
+        bool mStarving = false;  // mixer thread only, the last period was short
+        std::atomic<uint32_t> mUnderruns = 0;
+        std::atomic<uint32_t> mWriteErrors = 0;
+        nsecs_t mWakeupLateNs = -1;  // writer thread only
+
+        mutable std::mutex mPositionMutex;
+        uint64_t mFramesMixed = 0;  // at the mixer rate
+        nsecs_t mMixTimestamp;
+    };
+
+    StreamMixer();
+    ~StreamMixer();
+
+    std::shared_ptr<Source> addSource(unsigned nChannels, AudioFormat format,
+                                      uint32_t sampleRateHz, size_t capacityFrames);
+    void removeSource(const std::shared_ptr<Source> &source);
+
+    // From a frame mixed now to the speaker: the device queue (measured with
+    // Pcm::getHtimestamp) and the period being mixed.
+    uint32_t getLatencyMs() const;
+
+    void dump(int fd) const;
+
+private:
+    void threadLoop();
+    bool hasActiveSourcesLocked() const;
+    void onSourceActive();
+    void onFramesConsumed();
+    void mixPeriod(const std::vector<std::shared_ptr<Source>> &sources);
+    void waitForDevice();
+    bool getDeviceQueuedFrames(size_t &queued) const;
+
+    std::mutex mMutex;
+    std::condition_variable mActiveCond;    // a source has become active
+    std::condition_variable mConsumedCond;  // ring space became available
+    std::vector<std::shared_ptr<Source>> mSources;
+    bool mExit = false;
+    std::thread mThread;
+
+    util::AdaptivePeriodCount mPeriodCount;
+    std::atomic<size_t> mDeviceQueuedFrames = 0;
+    std::atomic<uint32_t> mDeviceUnderruns = 0;
+    std::atomic<bool> mRealtime = false;  // the thread runs SCHED_FIFO
+    Histogram mWakeupLateUs;      // past the end of the sleep for the device
+    Histogram mWakeupToWriteUs;   // from that wakeup to pcm_write
+    std::atomic<uint32_t> mWriteErrors = 0;
+
+    // mixer thread only
+    talsa::PcmPtr mPcm;
+    bool mPcmStarted = false;
+    std::unique_ptr<float[]> mAcc;
+    std::unique_ptr<int16_t[]> mOut;
+};
+
+}  // namespace implementation
+}  // namespace V6_0
+}  // namespace audio
+}  // namespace hardware
+}  // namespace android
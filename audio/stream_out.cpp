@@ -14,6 +14,9 @@
  * limitations under the License.
  */
 
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <log/log.h>
 #include <fmq/EventFlag.h>
 #include <fmq/MessageQueue.h>
@@ -21,14 +24,14 @@
 #include <hidl/Status.h>
 #include <math.h>
 #include "stream_out.h"
-#include "talsa.h"
+#include "stream_mixer.h"
 #include "deleters.h"
+#include "mmap_buffer.h"
 #include "util.h"
-#include <sys/resource.h>
 #include <pthread.h>
-#include <cutils/sched_policy.h>
-#include <utils/ThreadDefs.h>
+#include <atomic>
 #include <future>
+#include <string>
 #include <thread>
 
 namespace android {
@@ -49,12 +52,19 @@ struct WriteThread : public IOThread {
     typedef MessageQueue<uint8_t, kSynchronizedReadWrite> DataMQ;
 
     WriteThread(StreamOut *stream,
+                StreamMixer *mixer,
+                StreamStats *stats,
+                EffectChain *effects,
                 const unsigned nChannels,
+                const AudioFormat format,
                 const size_t sampleRateHz,
                 const size_t frameCount,
                 const size_t mqBufferSize)
             : mStream(stream)
+            , mMixer(mixer)
+            , mStats(stats)
             , mNChannels(nChannels)
+            , mFormat(format)
             , mSampleRateHz(sampleRateHz)
             , mFrameCount(frameCount)
             , mCommandMQ(1)
@@ -84,6 +94,10 @@ struct WriteThread : public IOThread {
             mEfGroup.reset(rawEfGroup);
         }
 
+        mSource = mMixer->addSource(mNChannels, mFormat, mSampleRateHz,
+                                    std::max(mFrameCount,
+                                             StreamMixer::kPeriodSizeFrames));
+        mSource->setEffectChain(effects);
         mThread = std::thread(&WriteThread::threadLoop, this);
     }
 
@@ -92,12 +106,23 @@ struct WriteThread : public IOThread {
             requestExit();
             mThread.join();
         }
+        if (mSource) {
+            mMixer->removeSource(mSource);
+        }
     }
 
     EventFlag *getEventFlag() override {
         return mEfGroup.get();
     }
 
+    bool notify(const uint32_t mask) override {
+        // a write blocked on the mixer must not delay these
+        if (mask & (STAND_BY_REQUEST | EXIT_REQUEST | PAUSE_REQUEST | FLUSH_REQUEST)) {
+            mSource->interrupt();
+        }
+        return IOThread::notify(mask);
+    }
+
     bool isRunning() const {
         return mThread.joinable();
     }
@@ -107,39 +132,65 @@ struct WriteThread : public IOThread {
     }
 
     void threadLoop() {
-        setpriority(PRIO_PROCESS, 0, PRIORITY_URGENT_AUDIO);
-        set_sched_policy(0, SP_FOREGROUND);
+        mStats->setRealtime(util::setIoThreadPriority("WriteThread"));
         mTid.set_value(pthread_self());
 
         while (true) {
             uint32_t efState = 0;
-            mEfGroup->wait(MessageQueueFlagBits::NOT_EMPTY | STAND_BY_REQUEST | EXIT_REQUEST,
-                           &efState);
+            // while draining, wake up every mixer period until the device has
+            // played the source out
+            mEfGroup->wait(MessageQueueFlagBits::NOT_EMPTY | STAND_BY_REQUEST | EXIT_REQUEST
+                               | PAUSE_REQUEST | RESUME_REQUEST | FLUSH_REQUEST | DRAIN_REQUEST,
+                           &efState,
+                           mDraining ? ms2ns(StreamMixer::kPeriodDurationMs) : 0);
             if (efState & EXIT_REQUEST) {
                 return;
             }
 
             if (efState & STAND_BY_REQUEST) {
-                mPcm.reset();
+                mSource->standby();
+                mSource->setPaused(false);
+                mSource->clearInterrupt();
                 mBuffer.reset();
+                mPendingSize = 0;
+                mPaused = false;
+                mDraining = false;
+            }
+
+            if (efState & FLUSH_REQUEST) {
+                doFlush();
+            }
+
+            if (efState & (PAUSE_REQUEST | RESUME_REQUEST)) {
+                // the stream has the latest state if requests were coalesced
+                mPaused = mStream->isPaused();
+                mSource->setPaused(mPaused);
+                mSource->clearInterrupt();
+                if (mPaused) {
+                    mDraining = false;
+                }
+            }
+
+            if (efState & DRAIN_REQUEST) {
+                mDraining = true;
             }
 
             if (efState & (MessageQueueFlagBits::NOT_EMPTY | 0)) {
-                if (!mPcm) {
+                if (!mBuffer) {
                     mBuffer.reset(new uint8_t[mDataMQ.getQuantumCount()]);
                     LOG_ALWAYS_FATAL_IF(!mBuffer);
-
-                    mPcm = talsa::pcmOpen(
-                        talsa::kPcmCard, talsa::kPcmDevice,
-                        mNChannels, mSampleRateHz, mFrameCount,
-                        true /* isOut */);
-                    LOG_ALWAYS_FATAL_IF(!mPcm);
-
-                    mPos.reset();
                 }
 
                 processCommand();
             }
+
+            if (mDraining) {
+                const bool written = writePending();
+                if (written && mSource->isDrained() && isPlayedOut()) {
+                    mDraining = false;
+                    mStream->notifyDrainReady();
+                }
+            }
         }
     }
 
@@ -182,22 +233,89 @@ struct WriteThread : public IOThread {
 
     IStreamOut::WriteStatus doWrite() {
         IStreamOut::WriteStatus status;
+        status.retval = Result::OK;
+        status.reply.written = 0;
+
+        // While paused, or until the frames left by an interrupted write are
+        // queued, the data stays in the FMQ.
+        if (mPaused || !writePending()) {
+            return status;
+        }
 
         const size_t availToRead = mDataMQ.availableToRead();
-        size_t written = 0;
         if (mDataMQ.read(&mBuffer[0], availToRead)) {
-            status.retval = doWriteImpl(&mBuffer[0], availToRead, written);
+            const size_t frames = availToRead / mFrameSize;
+            mPendingOffset = 0;
+            mPendingSize = frames * mFrameSize;
+            if (!writePending()) {
+                mStats->onShortTransfer(frames - mPendingSize / mFrameSize, frames);
+            }
+
+            // what is queued ahead of the last written frame
+            mStats->onTransfer(frames,
+                               mSource->getQueuedFrames() * 1000 / StreamMixer::kSampleRateHz
+                                   + mMixer->getLatencyMs());
 
-            mPos.addFrames(pcm_bytes_to_frames(mPcm.get(), written));
-            status.reply.written = written;
+            const uint32_t underruns = mSource->getUnderrunCount();
+            if (underruns != mUnderruns) {
+                mStats->onXrun(underruns - mUnderruns);
+                mUnderruns = underruns;
+            }
+            const uint32_t writeErrors = mSource->getWriteErrorCount();
+            if (writeErrors != mWriteErrors) {
+                mStats->onError(writeErrors - mWriteErrors);
+                mWriteErrors = writeErrors;
+            }
+
+            // consumed from the FMQ, even if some of it is still pending
+            status.reply.written = availToRead;
         } else {
             ALOGE("WriteThread::%s:%d: mDataMQ.read failed", __func__, __LINE__);
-            status.retval = Result::OK;
         }
 
         return status;
     }
 
+    // Queues the pending frames into the mixer, blocks while it has no room
+    // for them. Returns true once nothing is pending.
+    bool writePending() {
+        if (mPendingSize > 0) {
+            mSource->setResamplerQuality(mStream->getResamplerQuality());
+            mStream->applyVolume(*mSource);
+
+            const size_t frames = mSource->write(&mBuffer[mPendingOffset],
+                                                 mPendingSize / mFrameSize);
+            const nsecs_t lateNs = mSource->getWakeupLateNs();
+            if (lateNs >= 0) {
+                mStats->onWakeup(lateNs);
+            }
+            mPendingOffset += frames * mFrameSize;
+            mPendingSize -= frames * mFrameSize;
+        }
+
+        return mPendingSize == 0;
+    }
+
+    // Drops everything the client has written so far: the FMQ, the pending
+    // frames and the frames queued in the mixer.
+    void doFlush() {
+        size_t toDrop = mDataMQ.availableToRead();
+        if (toDrop > 0) {
+            if (!mBuffer) {
+                mBuffer.reset(new uint8_t[mDataMQ.getQuantumCount()]);
+                LOG_ALWAYS_FATAL_IF(!mBuffer);
+            }
+            if (!mDataMQ.read(&mBuffer[0], toDrop)) {
+                ALOGE("WriteThread::%s:%d: mDataMQ.read failed", __func__, __LINE__);
+            }
+        }
+
+        mPendingSize = 0;
+        mSource->standby();
+        mSource->clearInterrupt();
+        mDraining = false;
+    }
+
     IStreamOut::WriteStatus doGetPresentationPosition() {
         IStreamOut::WriteStatus status;
 
@@ -217,46 +335,130 @@ struct WriteThread : public IOThread {
         return status;
     }
 
-    Result doWriteImpl(const uint8_t *const data,
-                       const size_t toWrite,
-                       size_t &written) {
-        const int res = pcm_write(mPcm.get(), data, toWrite);
-        if (res) {
-            ALOGE("WriteThread::%s:%d: pcm_write failed with %s",
-                  __func__, __LINE__, strerror(-res));
-        }
-
-        written = toWrite;
-        return Result::OK;
+    // The last frame mixed has left the device queue (measured by the mixer
+    // with Pcm::getHtimestamp), checked again every period while draining.
+    bool isPlayedOut() const {
+        uint64_t frames;
+        nsecs_t mixedNs;
+        mSource->getPresentationPosition(frames, mixedNs);
+        return systemTime(SYSTEM_TIME_MONOTONIC) >= mixedNs + ms2ns(mMixer->getLatencyMs());
     }
 
     Result doGetPresentationPositionImpl(uint64_t &frames, TimeSpec &ts) {
         nsecs_t t = 0;
-        mPos.now(mSampleRateHz, frames, t);
+        mSource->getPresentationPosition(frames, t);
         ts.tvSec = ns2s(t);
         ts.tvNSec = t - s2ns(ts.tvSec);
         return Result::OK;
     }
 
     StreamOut *const mStream;
+    StreamMixer *const mMixer;
+    StreamStats *const mStats;
     const unsigned mNChannels;
+    const AudioFormat mFormat;
     const size_t mSampleRateHz;
     const size_t mFrameCount;
+    const size_t mFrameSize = mNChannels * util::getBytesPerSample(mFormat);
     CommandMQ mCommandMQ;
     StatusMQ mStatusMQ;
     DataMQ mDataMQ;
     std::unique_ptr<EventFlag, deleters::forEventFlag> mEfGroup;
     std::unique_ptr<uint8_t[]> mBuffer;
-    talsa::PcmPtr mPcm;
-    util::StreamPosition mPos;
+    size_t mPendingOffset = 0;  // in mBuffer
+    size_t mPendingSize = 0;
+    bool mPaused = false;
+    bool mDraining = false;
+    uint32_t mUnderruns = 0;
+    uint32_t mWriteErrors = 0;
+    std::shared_ptr<StreamMixer::Source> mSource;
     std::thread mThread;
     std::promise<pthread_t> mTid;
 };
 
 } // namespace
 
+// Plays an MMAP (AAudio NOIRQ) stream: the client renders directly into the
+// shared buffer and this thread feeds it to the mixer one burst at a time,
+// following the same frame position it reports to the client.
+struct MmapOutThread {
+    MmapOutThread(const StreamOut *stream,
+                  StreamMixer *mixer,
+                  EffectChain *effects,
+                  const unsigned nChannels,
+                  const AudioFormat format,
+                  const uint32_t sampleRateHz,
+                  const size_t burstSizeFrames,
+                  const size_t bufferSizeFrames)
+            : mStream(stream)
+            , mMixer(mixer)
+            , mNChannels(nChannels)
+            , mBurstSizeFrames(burstSizeFrames)
+            , mBuffer(nChannels * util::getBytesPerSample(format), bufferSizeFrames)
+            , mSource(mixer->addSource(nChannels, format, sampleRateHz,
+                                       std::max(burstSizeFrames,
+                                                StreamMixer::kPeriodSizeFrames))) {
+        mSource->setEffectChain(effects);
+    }
+
+    ~MmapOutThread() {
+        stop();
+        mMixer->removeSource(mSource);
+    }
+
+    bool isValid() const {
+        return mBuffer.isValid();
+    }
+
+    Result start() {
+        if (mThread.joinable()) {
+            return Result::INVALID_STATE;
+        }
+
+        mRunning = true;
+        mThread = std::thread(&MmapOutThread::threadLoop, this);
+        return Result::OK;
+    }
+
+    Result stop() {
+        if (!mThread.joinable()) {
+            return Result::INVALID_STATE;
+        }
+
+        mRunning = false;
+        mThread.join();
+        mSource->standby();
+        return Result::OK;
+    }
+
+    void threadLoop() {
+        util::setIoThreadPriority("MmapOutThread");
+
+        while (mRunning) {
+            mStream->applyVolume(*mSource);
+
+            // the source holds about one burst, this blocks until the
+            // mixer has taken the previous one and paces the thread
+            mSource->write(mBuffer.getFrames(mPos.getFrames()), mBurstSizeFrames);
+
+            mPos.advance(mBurstSizeFrames);
+        }
+    }
+
+    const StreamOut *const mStream;
+    StreamMixer *const mMixer;
+    const unsigned mNChannels;
+    const size_t mBurstSizeFrames;
+    MmapBuffer mBuffer;
+    MmapStreamPosition mPos;
+    const std::shared_ptr<StreamMixer::Source> mSource;
+    std::atomic<bool> mRunning = false;
+    std::thread mThread;
+};
+
 StreamOut::StreamOut(sp<IDevice> dev,
                      void (*unrefDevice)(IDevice*),
+                     StreamMixer *mixer,
                      int32_t ioHandle,
                      const DeviceAddress& device,
                      const AudioConfig& config,
@@ -264,8 +466,10 @@ StreamOut::StreamOut(sp<IDevice> dev,
                      const SourceMetadata& sourceMetadata)
         : mDev(std::move(dev))
         , mUnrefDevice(unrefDevice)
+        , mMixer(mixer)
         , mCommon(ioHandle, device, config, flags)
-        , mSourceMetadata(sourceMetadata) {
+        , mSourceMetadata(sourceMetadata)
+        , mStats(true /* isOut */, ioHandle) {
 }
 
 StreamOut::~StreamOut() {
@@ -342,8 +546,12 @@ Return<Result> StreamOut::removeEffect(uint64_t effectId) {
 
 Return<Result> StreamOut::standby() {
     if (mWriteThread) {
+        mPaused = false;
         LOG_ALWAYS_FATAL_IF(!mWriteThread->standby());
     }
+    if (mMmapThread) {
+        mMmapThread->stop();
+    }
 
     return Result::OK;
 }
@@ -361,14 +569,55 @@ Return<void> StreamOut::getParameters(const hidl_vec<ParameterValue>& context,
                                       const hidl_vec<hidl_string>& keys,
                                       getParameters_cb _hidl_cb) {
     (void)context;
-    _hidl_cb((keys.size() > 0) ? Result::NOT_SUPPORTED : Result::OK, {});
+    std::vector<ParameterValue> values;
+    for (const hidl_string &key : keys) {
+        if (key == kResamplerQualityParameter) {
+            values.push_back({key, Resampler::toString(mResamplerQuality)});
+        } else if (key == kVolumeRampParameter) {
+            values.push_back({key, std::to_string(mVolumeRampMs)});
+        } else if (key == kEffectsParameter) {
+            values.push_back({key, mEffects.getEffects()});
+        } else if (key == kEffectGainParameter) {
+            values.push_back({key, std::to_string(mEffects.getGainDb())});
+        } else {
+            _hidl_cb(Result::NOT_SUPPORTED, {});
+            return Void();
+        }
+    }
+
+    _hidl_cb(Result::OK, values);
     return Void();
 }
 
 Return<Result> StreamOut::setParameters(const hidl_vec<ParameterValue>& context,
                                         const hidl_vec<ParameterValue>& parameters) {
     (void)context;
-    (void)parameters;
+    for (const ParameterValue &p : parameters) {
+        if (p.key == kResamplerQualityParameter) {
+            Resampler::Quality quality;
+            if (!Resampler::parseQuality(p.value, quality)) {
+                return Result::INVALID_ARGUMENTS;
+            }
+            mResamplerQuality = quality;
+        } else if (p.key == kVolumeRampParameter) {
+            char *end;
+            const unsigned long rampMs = strtoul(p.value.c_str(), &end, 10);
+            if ((end == p.value.c_str()) || *end || (rampMs > 1000)) {
+                return Result::INVALID_ARGUMENTS;
+            }
+            mVolumeRampMs = rampMs;
+        } else if (p.key == kEffectsParameter) {
+            if (!mEffects.setEffects(p.value)) {
+                return Result::INVALID_ARGUMENTS;
+            }
+        } else if (p.key == kEffectGainParameter) {
+            char *end;
+            const float gainDb = strtof(p.value.c_str(), &end);
+            if ((end == p.value.c_str()) || *end || !mEffects.setGainDb(gainDb)) {
+                return Result::INVALID_ARGUMENTS;
+            }
+        }
+    }
     return Result::OK;
 }
 
@@ -380,6 +629,7 @@ Return<Result> StreamOut::setHwAvSync(uint32_t hwAvSync) {
 Return<Result> StreamOut::close() {
     if (mDev) {
         mWriteThread.reset();
+        mMmapThread.reset();
         mUnrefDevice(mDev.get());
         mDev = nullptr;
         return Result::OK;
@@ -388,34 +638,97 @@ Return<Result> StreamOut::close() {
     }
 }
 
+Return<void> StreamOut::debug(const hidl_handle& fd, const hidl_vec<hidl_string>& options) {
+    (void)options;
+    if (fd.getNativeHandle() == nullptr || fd->numFds < 1) {
+        return Void();
+    }
+
+    const int fd0 = fd->data[0];
+    dprintf(fd0, "  Output stream %d: %u Hz, %s, %" PRIu64 " frames%s%s\n",
+            mCommon.m_ioHandle, mCommon.getSampleRate(),
+            toString(mCommon.getFormat()).c_str(), mCommon.getFrameCount(),
+            mMmapThread ? ", mmap" : "", mPaused ? ", paused" : "");
+    mStats.dump(fd0);
+    mEffects.dump(fd0);
+    return Void();
+}
+
 Return<Result> StreamOut::start() {
-    return Result::NOT_SUPPORTED;
+    return mMmapThread ? mMmapThread->start() : Result::INVALID_STATE;
 }
 
 Return<Result> StreamOut::stop() {
-    return Result::NOT_SUPPORTED;
+    return mMmapThread ? mMmapThread->stop() : Result::INVALID_STATE;
 }
 
 Return<void> StreamOut::createMmapBuffer(int32_t minSizeFrames,
                                          createMmapBuffer_cb _hidl_cb) {
-    (void)minSizeFrames;
-    _hidl_cb(Result::NOT_SUPPORTED, {});
+    if (minSizeFrames <= 0 || minSizeFrames > (1 << 20)) {
+        _hidl_cb(Result::INVALID_ARGUMENTS, {});
+        return Void();
+    }
+
+    if (mWriteThread || mMmapThread) {
+        _hidl_cb(Result::INVALID_STATE, {});
+        return Void();
+    }
+
+    // The buffer holds a whole number of bursts
+    const size_t burstSizeFrames = mCommon.getFrameCount();
+    const size_t bufferSizeFrames =
+        (minSizeFrames + burstSizeFrames - 1) / burstSizeFrames * burstSizeFrames;
+
+    auto t = std::make_unique<MmapOutThread>(this,
+                                             mMixer,
+                                             &mEffects,
+                                             util::countChannels(mCommon.getChannelMask()),
+                                             mCommon.getFormat(),
+                                             mCommon.getSampleRate(),
+                                             burstSizeFrames,
+                                             bufferSizeFrames);
+    if (t->isValid()) {
+        t->mBuffer.getInfo(burstSizeFrames, [&_hidl_cb](const MmapBufferInfo &info) {
+            _hidl_cb(Result::OK, info);
+        });
+        mMmapThread = std::move(t);
+    } else {
+        _hidl_cb(Result::NOT_INITIALIZED, {});
+    }
+
     return Void();
 }
 
 Return<void> StreamOut::getMmapPosition(getMmapPosition_cb _hidl_cb) {
-    _hidl_cb(Result::NOT_SUPPORTED, {});
+    if (mMmapThread) {
+        MmapPosition pos;
+        mMmapThread->mPos.get(pos);
+        _hidl_cb(Result::OK, pos);
+    } else {
+        _hidl_cb(Result::INVALID_STATE, {});
+    }
     return Void();
 }
 
+// The stream's source ring plus the mixer and device latency.
 Return<uint32_t> StreamOut::getLatency() {
-    return mCommon.getFrameCount() * 1000 / mCommon.getSampleRate();
+    return mCommon.getFrameCount() * 1000 / mCommon.getSampleRate()
+           + mMixer->getLatencyMs();
 }
 
 Return<Result> StreamOut::setVolume(float left, float right) {
-    (void)left;
-    (void)right;
-    return Result::NOT_SUPPORTED;
+    if (left < 0 || left > 1.0 || right < 0 || right > 1.0) {
+        return Result::INVALID_ARGUMENTS;
+    }
+
+    mVolumeLeft = left;
+    mVolumeRight = right;
+    return Result::OK;
+}
+
+// The IO threads pass the volume on to their mixer source.
+void StreamOut::applyVolume(StreamMixer::Source &source) const {
+    source.setVolume(mVolumeLeft, mVolumeRight, mVolumeRampMs);
 }
 
 Return<void> StreamOut::updateSourceMetadata(const SourceMetadata& sourceMetadata) {
@@ -431,13 +744,18 @@ Return<void> StreamOut::prepareForWriting(uint32_t frameSize,
         return Void();
     }
 
-    if (mWriteThread) {  // INVALID_STATE if the method was already called.
+    // INVALID_STATE if the method was already called or the stream is MMAP.
+    if (mWriteThread || mMmapThread) {
         _hidl_cb(Result::INVALID_STATE, {}, {}, {}, {});
         return Void();
     }
 
     auto t = std::make_unique<WriteThread>(this,
+                                           mMixer,
+                                           &mStats,
+                                           &mEffects,
                                            util::countChannels(mCommon.getChannelMask()),
+                                           mCommon.getFormat(),
                                            mCommon.getSampleRate(),
                                            mCommon.getFrameCount(),
                                            frameSize * framesCount);
@@ -468,12 +786,15 @@ Return<void> StreamOut::getNextWriteTimestamp(getNextWriteTimestamp_cb _hidl_cb)
 }
 
 Return<Result> StreamOut::setCallback(const sp<IStreamOutCallback>& callback) {
-    (void)callback;
-    return Result::NOT_SUPPORTED;
+    std::lock_guard<std::mutex> guard(mCallbackMutex);
+    mCallback = callback;
+    return Result::OK;
 }
 
 Return<Result> StreamOut::clearCallback() {
-    return Result::NOT_SUPPORTED;
+    std::lock_guard<std::mutex> guard(mCallbackMutex);
+    mCallback = nullptr;
+    return Result::OK;
 }
 
 Return<Result> StreamOut::setEventCallback(const sp<IStreamOutEventCallback>& callback) {
@@ -482,29 +803,74 @@ Return<Result> StreamOut::setEventCallback(const sp<IStreamOutEventCallback>& ca
 }
 
 Return<void> StreamOut::supportsPauseAndResume(supportsPauseAndResume_cb _hidl_cb) {
-    _hidl_cb(false, false);
+    _hidl_cb(true, true);
     return Void();
 }
 
 Return<Result> StreamOut::pause() {
-    return Result::NOT_SUPPORTED;
+    if (!mWriteThread || mPaused) {
+        return Result::INVALID_STATE;
+    }
+
+    mPaused = true;
+    LOG_ALWAYS_FATAL_IF(!mWriteThread->notify(IOThread::PAUSE_REQUEST));
+    return Result::OK;
 }
 
 Return<Result> StreamOut::resume() {
-    return Result::NOT_SUPPORTED;
+    if (!mWriteThread || !mPaused) {
+        return Result::INVALID_STATE;
+    }
+
+    mPaused = false;
+    LOG_ALWAYS_FATAL_IF(!mWriteThread->notify(IOThread::RESUME_REQUEST));
+    return Result::OK;
 }
 
 Return<bool> StreamOut::supportsDrain() {
-    return false;
+    return true;
 }
 
+// Completion is reported with IStreamOutCallback::onDrainReady once the
+// mixer has taken the last frame. EARLY_NOTIFY is handled as ALL, the
+// stream has no gapless transitions to prepare.
 Return<Result> StreamOut::drain(AudioDrain type) {
     (void)type;
-    return Result::NOT_SUPPORTED;
+
+    if (!mWriteThread || mPaused) {
+        return Result::INVALID_STATE;
+    }
+    {
+        std::lock_guard<std::mutex> guard(mCallbackMutex);
+        if (!mCallback) {
+            return Result::INVALID_STATE;
+        }
+    }
+
+    LOG_ALWAYS_FATAL_IF(!mWriteThread->notify(IOThread::DRAIN_REQUEST));
+    return Result::OK;
 }
 
+// Only while paused, as the HAL interface requires.
 Return<Result> StreamOut::flush() {
-    return Result::NOT_SUPPORTED;
+    if (!mWriteThread || !mPaused) {
+        return Result::INVALID_STATE;
+    }
+
+    LOG_ALWAYS_FATAL_IF(!mWriteThread->notify(IOThread::FLUSH_REQUEST));
+    return Result::OK;
+}
+
+void StreamOut::notifyDrainReady() {
+    sp<IStreamOutCallback> callback;
+    {
+        std::lock_guard<std::mutex> guard(mCallbackMutex);
+        callback = mCallback;
+    }
+
+    if (callback) {
+        callback->onDrainReady();
+    }
 }
 
 Return<void> StreamOut::getPresentationPosition(getPresentationPosition_cb _hidl_cb) {
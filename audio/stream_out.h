@@ -17,8 +17,14 @@
 #pragma once
 #include <android/hardware/audio/6.0/IStreamOut.h>
 #include <android/hardware/audio/6.0/IDevice.h>
+#include <atomic>
+#include <mutex>
 #include "stream_common.h"
+#include "effect_chain.h"
 #include "io_thread.h"
+#include "resampler.h"
+#include "stream_mixer.h"
+#include "stream_stats.h"
 
 namespace android {
 namespace hardware {
@@ -28,15 +34,24 @@ namespace implementation {
 
 using ::android::sp;
 using ::android::hardware::hidl_bitfield;
+using ::android::hardware::hidl_handle;
 using ::android::hardware::hidl_string;
 using ::android::hardware::hidl_vec;
 using ::android::hardware::Return;
 using namespace ::android::hardware::audio::common::V6_0;
 using namespace ::android::hardware::audio::V6_0;
 
+struct MmapOutThread;
+
+// The stream parameter setting how long (in ms) a setVolume change takes to
+// ramp to the new gains, 0 applies them at once.
+constexpr char kVolumeRampParameter[] = "volume_ramp_ms";
+constexpr uint32_t kDefaultVolumeRampMs = 20;
+
 struct StreamOut : public IStreamOut {
     StreamOut(sp<IDevice> dev,
               void (*unrefDevice)(IDevice*),
+              StreamMixer *mixer,
               int32_t ioHandle,
               const DeviceAddress& device,
               const AudioConfig& config,
@@ -100,13 +115,30 @@ struct StreamOut : public IStreamOut {
     Return<Result> setAudioDescriptionMixLevel(float leveldB) override;
     Return<void> getPlaybackRateParameters(getPlaybackRateParameters_cb _hidl_cb) override;
     Return<Result> setPlaybackRateParameters(const PlaybackRate &playbackRate) override;
+    Return<void> debug(const hidl_handle& fd, const hidl_vec<hidl_string>& options) override;
+
+    Resampler::Quality getResamplerQuality() const { return mResamplerQuality; }
+    bool isPaused() const { return mPaused; }
+    void applyVolume(StreamMixer::Source &source) const;
+    void notifyDrainReady();
 
 private:
     sp<IDevice> mDev;
     void (* const mUnrefDevice)(IDevice*);
+    StreamMixer *const mMixer;
     const StreamCommon mCommon;
     const SourceMetadata mSourceMetadata;
     std::unique_ptr<IOThread> mWriteThread;
+    std::atomic<Resampler::Quality> mResamplerQuality = Resampler::Quality::MEDIUM;
+    StreamStats mStats;
+    EffectChain mEffects{StreamMixer::kChannels, StreamMixer::kSampleRateHz};
+    std::atomic<bool> mPaused = false;
+    std::atomic<float> mVolumeLeft = 1.0f;
+    std::atomic<float> mVolumeRight = 1.0f;
+    std::atomic<uint32_t> mVolumeRampMs = kDefaultVolumeRampMs;
+    std::mutex mCallbackMutex;
+    sp<IStreamOutCallback> mCallback;
+    std::unique_ptr<MmapOutThread> mMmapThread;
 };
 
 }  // namespace implementation
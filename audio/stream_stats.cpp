@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <inttypes.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <cutils/properties.h>
+#include <log/log.h>
+#include "stream_stats.h"
+
+namespace android {
+namespace hardware {
+namespace audio {
+namespace V6_0 {
+namespace implementation {
+
+namespace {
+constexpr char kTraceDirProperty[] = "vendor.audio.trace_dir";
+constexpr auto kTraceFlushInterval = std::chrono::milliseconds(200);
+}  // namespace
+
+void Histogram::add(const uint32_t value) {
+    size_t bucket = 0;
+    for (uint32_t v = value; v && (bucket < kBuckets - 1); v >>= 1) {
+        ++bucket;
+    }
+    ++mCounts[bucket];
+}
+
+void Histogram::dump(const int fd, const char *name) const {
+    dprintf(fd, "    %s:", name);
+    for (size_t i = 0; i < kBuckets; ++i) {
+        const uint32_t n = mCounts[i];
+        if (n) {
+            dprintf(fd, " <%u:%u", 1u << i, n);
+        }
+    }
+    dprintf(fd, "\n");
+}
+
+StreamStats::StreamStats(const bool isOut, const int32_t ioHandle)
+        : mIsOut(isOut) {
+    char dir[PROPERTY_VALUE_MAX];
+    if (property_get(kTraceDirProperty, dir, nullptr) > 0) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/stream_%s_%d.csv",
+                 dir, isOut ? "out" : "in", ioHandle);
+        mTrace = fopen(path, "ae");
+        if (mTrace) {
+            mTraceThread = std::thread(&StreamStats::traceThreadLoop, this);
+        } else {
+            ALOGW("StreamStats::%s:%d: could not open %s", __func__, __LINE__, path);
+        }
+    }
+}
+
+StreamStats::~StreamStats() {
+    if (mTraceThread.joinable()) {
+        {
+            std::lock_guard<std::mutex> guard(mTraceMutex);
+            mTraceExit = true;
+        }
+        mTraceCond.notify_one();
+        mTraceThread.join();
+    }
+    if (mTrace) {
+        flushTrace();
+        fclose(mTrace);
+    }
+}
+
+void StreamStats::onXrun(const uint32_t n) {
+    mXruns += n;
+    trace(mIsOut ? "underrun" : "overrun", n);
+}
+
+void StreamStats::onError(const uint32_t n) {
+    mErrors += n;
+    trace("error", n);
+}
+
+void StreamStats::onShortTransfer(const size_t frames, const size_t expected) {
+    ++mShortTransfers;
+    trace(mIsOut ? "short_write" : "short_read", expected - frames);
+}
+
+void StreamStats::onTransfer(const size_t frames, const uint32_t latencyMs) {
+    mFrames += frames;
+    mLatencyMs.add(latencyMs);
+    trace("latency_ms", latencyMs);
+}
+
+void StreamStats::onWakeup(const nsecs_t lateNs) {
+    const int64_t lateUs = ns2us(std::max<nsecs_t>(0, lateNs));
+    mWakeupLateUs.add(lateUs);
+    trace("wakeup_late_us", lateUs);
+}
+
+void StreamStats::dump(const int fd) const {
+    dprintf(fd, "    frames: %" PRIu64 ", %s: %u, errors: %u, short %s: %u, %s\n",
+            mFrames.load(),
+            mIsOut ? "underruns" : "overruns", mXruns.load(),
+            mErrors.load(),
+            mIsOut ? "writes" : "reads", mShortTransfers.load(),
+            mRealtime ? "SCHED_FIFO" : "SCHED_OTHER");
+    mLatencyMs.dump(fd, "latency (ms)");
+    mWakeupLateUs.dump(fd, "wakeup late (us)");
+}
+
+// IO thread: no IO nor locks, the record is dropped if the ring is full.
+void StreamStats::trace(const char *event, const int64_t value) {
+    if (!mTrace) {
+        return;
+    }
+
+    const uint64_t wp = mTraceWritePos.load(std::memory_order_relaxed);
+    if ((wp - mTraceReadPos.load(std::memory_order_acquire)) >= kTraceCapacity) {
+        mTraceDropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    mTraceRecords[wp % kTraceCapacity] = {systemTime(SYSTEM_TIME_MONOTONIC), event, value};
+    mTraceWritePos.store(wp + 1, std::memory_order_release);
+}
+
+void StreamStats::traceThreadLoop() {
+    std::unique_lock<std::mutex> lock(mTraceMutex);
+    while (!mTraceCond.wait_for(lock, kTraceFlushInterval, [this](){ return mTraceExit; })) {
+        flushTrace();
+    }
+}
+
+void StreamStats::flushTrace() {
+    const uint64_t wp = mTraceWritePos.load(std::memory_order_acquire);
+    uint64_t rp = mTraceReadPos.load(std::memory_order_relaxed);
+    for (; rp < wp; ++rp) {
+        const TraceRecord &r = mTraceRecords[rp % kTraceCapacity];
+        fprintf(mTrace, "%" PRId64 ",%s,%" PRId64 "\n", r.timeNs, r.event, r.value);
+    }
+    mTraceReadPos.store(rp, std::memory_order_release);
+
+    const uint32_t dropped = mTraceDropped.exchange(0, std::memory_order_relaxed);
+    if (dropped) {
+        fprintf(mTrace, "%" PRId64 ",trace_dropped,%u\n",
+                systemTime(SYSTEM_TIME_MONOTONIC), dropped);
+    }
+    fflush(mTrace);
+}
+
+}  // namespace implementation
+}  // namespace V6_0
+}  // namespace audio
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#include <stdio.h>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <utils/Timers.h>
+
+namespace android {
+namespace hardware {
+namespace audio {
+namespace V6_0 {
+namespace implementation {
+
+// Counts values in power of two buckets: [0, 1), [1, 2), [2, 4), ... the
+// last bucket takes everything above.
+struct Histogram {
+    static constexpr size_t kBuckets = 16;
+
+    void add(uint32_t value);
+    void dump(int fd, const char *name) const;
+
+private:
+    std::array<std::atomic<uint32_t>, kBuckets> mCounts = {};
+};
+
+// Telemetry of a stream: its IO thread updates the counters, debug() reads
+// them. If the vendor.audio.trace_dir property names a directory, every
+// event is also appended to <dir>/stream_<out|in>_<ioHandle>.csv as
+// "time_ns,event,value" lines. The IO thread only queues the events, a
+// separate (not realtime) thread writes them out.
+struct StreamStats {
+    StreamStats(bool isOut, int32_t ioHandle);
+    ~StreamStats();
+
+    // IO thread only
+    void onXrun(uint32_t n = 1);
+    void onError(uint32_t n = 1);
+    void onShortTransfer(size_t frames, size_t expected);
+    void onTransfer(size_t frames, uint32_t latencyMs);
+    // how late the IO thread ran after the device (or the mixer) made the
+    // frames it was waiting for available
+    void onWakeup(nsecs_t lateNs);
+    void setRealtime(bool realtime) { mRealtime = realtime; }
+
+    void dump(int fd) const;
+
+    StreamStats(const StreamStats &) = delete;
+    StreamStats &operator=(const StreamStats &) = delete;
+
+private:
+    struct TraceRecord {
+        nsecs_t timeNs;
+        const char *event;  // a string literal
+        int64_t value;
+    };
+    // about a second of events at a 1 ms period, the rest is dropped
+    static constexpr size_t kTraceCapacity = 2048;
+
+    void trace(const char *event, int64_t value);
+    void traceThreadLoop();
+    void flushTrace();
+
+    const bool mIsOut;
+    std::atomic<uint64_t> mFrames = 0;
+    std::atomic<uint32_t> mXruns = 0;  // underruns or overruns
+    std::atomic<uint32_t> mErrors = 0;
+    std::atomic<uint32_t> mShortTransfers = 0;
+    std::atomic<bool> mRealtime = false;  // the IO thread runs SCHED_FIFO
+    Histogram mLatencyMs;
+    Histogram mWakeupLateUs;
+    FILE *mTrace = nullptr;
+
+    // the IO thread writes the records at mTraceWritePos, the trace thread
+    // reads them from mTraceReadPos
+    std::array<TraceRecord, kTraceCapacity> mTraceRecords;
+    std::atomic<uint64_t> mTraceWritePos = 0;
+    std::atomic<uint64_t> mTraceReadPos = 0;
+    std::atomic<uint32_t> mTraceDropped = 0;
+    std::mutex mTraceMutex;
+    std::condition_variable mTraceCond;
+    bool mTraceExit = false;
+    std::thread mTraceThread;
+};
+
+}  // namespace implementation
+}  // namespace V6_0
+}  // namespace audio
+}  // namespace hardware
+}  // namespace android
@@ -14,8 +14,12 @@
  * limitations under the License.
  */
 
-#include "talsa.h"
+#include <string.h>
+#include <algorithm>
+#include <cutils/properties.h>
 #include <log/log.h>
+#include "clocked_pcm.h"
+#include "talsa.h"
 
 namespace android {
 namespace hardware {
@@ -24,46 +28,119 @@ namespace V6_0 {
 namespace implementation {
 namespace talsa {
 
-void PcmDeleter::operator()(pcm_t *x) const {
-    LOG_ALWAYS_FATAL_IF(pcm_close(x) != 0);
+namespace {
+
+constexpr char kPcmBackendProperty[] = "vendor.audio.pcm_backend";
+constexpr char kPcmClockSpeedProperty[] = "vendor.audio.pcm_clock_speed";
+
+struct TinyalsaPcm : public Pcm {
+    explicit TinyalsaPcm(struct pcm *pcm) : mPcm(pcm) {}
+
+    ~TinyalsaPcm() {
+        LOG_ALWAYS_FATAL_IF(pcm_close(mPcm) != 0);
+    }
+
+    int read(void *data, size_t bytes) override {
+        checkXrun();
+        const int res = ::pcm_read(mPcm, data, bytes);
+        mStarted |= (res == 0);
+        return res;
+    }
+
+    int write(const void *data, size_t bytes) override {
+        checkXrun();
+        const int res = ::pcm_write(mPcm, data, bytes);
+        mStarted |= (res == 0);
+        return res;
+    }
+
+    int getHtimestamp(unsigned int *avail, struct timespec *ts) override {
+        return ::pcm_get_htimestamp(mPcm, avail, ts);
+    }
+
+    size_t getBufferSizeFrames() const override {
+        return ::pcm_get_buffer_size(mPcm);
+    }
+
+    uint32_t getXrunCount() const override {
+        return mXruns;
+    }
+
+    // A started device is stopped by an xrun (it is no longer running) or,
+    // for capture that never stops (stop_threshold), is past its buffer. The
+    // next transfer restarts it.
+    void checkXrun() {
+        unsigned int avail = 0;
+        struct timespec ts;
+        if (mStarted && ((::pcm_get_htimestamp(mPcm, &avail, &ts) != 0)
+                         || (avail > ::pcm_get_buffer_size(mPcm)))) {
+            ++mXruns;
+        }
+    }
+
+    struct pcm *const mPcm;
+    bool mStarted = false;
+    uint32_t mXruns = 0;
 };
 
-void MixerDeleter::operator()(struct mixer *x) const {
-    mixer_close(x);
+bool isClockedBackend() {
+    static const bool clocked = [](){
+        char value[PROPERTY_VALUE_MAX];
+        return (property_get(kPcmBackendProperty, value, "tinyalsa") > 0)
+               && !strcmp(value, "clocked");
+    }();
+    return clocked;
 }
 
-std::unique_ptr<pcm_t, PcmDeleter> pcmOpen(const unsigned int dev,
-                                           const unsigned int card,
-                                           const unsigned int nChannels,
-                                           const size_t sampleRateHz,
-                                           const size_t frameCount,
-                                           const bool isOut) {
+}  // namespace
+
+bool pcmIsHardware() {
+    return !isClockedBackend();
+}
+
+PcmPtr pcmOpen(const unsigned int dev,
+               const unsigned int card,
+               const unsigned int nChannels,
+               const size_t sampleRateHz,
+               const size_t frameCount,
+               const unsigned int periodCount,
+               const bool isOut) {
+    if (isClockedBackend()) {
+        return std::make_unique<ClockedPcm>(
+            nChannels, sampleRateHz, frameCount, periodCount, isOut,
+            std::max(1, property_get_int32(kPcmClockSpeedProperty, 1)));
+    }
+
     struct pcm_config pcm_config;
     memset(&pcm_config, 0, sizeof(pcm_config));
 
     pcm_config.channels = nChannels;
     pcm_config.rate = sampleRateHz;
     pcm_config.period_size = frameCount;     // Approx frames between interrupts
-    pcm_config.period_count = 4;             // Approx interrupts per buffer
+    pcm_config.period_count = periodCount;   // Approx interrupts per buffer
     pcm_config.format = PCM_FORMAT_S16_LE;
     pcm_config.start_threshold = 0;
     pcm_config.stop_threshold = isOut ? 0 : INT_MAX;
 
-    PcmPtr pcm =
-        PcmPtr(::pcm_open(dev, card,
-                          (isOut ? PCM_OUT : PCM_IN) | PCM_MONOTONIC,
-                           &pcm_config));
-    if (::pcm_is_ready(pcm.get())) {
-        return pcm;
+    struct pcm *pcm = ::pcm_open(dev, card,
+                                 (isOut ? PCM_OUT : PCM_IN) | PCM_MONOTONIC,
+                                 &pcm_config);
+    if (::pcm_is_ready(pcm)) {
+        return std::make_unique<TinyalsaPcm>(pcm);
     } else {
         ALOGE("%s:%d pcm_open failed for nChannels=%u sampleRateHz=%zu "
-              "frameCount=%zu isOut=%d with %s", __func__, __LINE__,
-              nChannels, sampleRateHz, frameCount, isOut,
-              pcm_get_error(pcm.get()));
+              "frameCount=%zu periodCount=%u isOut=%d with %s", __func__, __LINE__,
+              nChannels, sampleRateHz, frameCount, periodCount, isOut,
+              pcm_get_error(pcm));
+        pcm_close(pcm);
         return nullptr;
     }
 }
 
+void MixerDeleter::operator()(struct mixer *x) const {
+    mixer_close(x);
+}
+
 MixerPtr mixerOpen(unsigned int card) {
     return MixerPtr(::mixer_open(card));
 }
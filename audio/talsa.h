@@ -15,6 +15,7 @@
  */
 
 #pragma once
+#include <time.h>
 #include <memory>
 #include <tinyalsa/asoundlib.h>
 
@@ -27,11 +28,31 @@ namespace talsa {
 
 constexpr unsigned int kPcmDevice = 0;
 constexpr unsigned int kPcmCard = 0;
+// Both directions run the device at this rate, streams are resampled to it.
+constexpr size_t kPcmSampleRateHz = 48000;
+constexpr unsigned int kPcmPeriodCount = 4;
 
-typedef struct pcm pcm_t;
-struct PcmDeleter { void operator()(pcm_t *x) const; };
-typedef std::unique_ptr<pcm_t, PcmDeleter> PcmPtr;
-PcmPtr pcmOpen(unsigned int dev, unsigned int card, unsigned int nChannels, size_t sampleRateHz, size_t frameCount, bool isOut);
+// A 16 bit PCM device, the methods behave like their tinyalsa pcm_*
+// counterparts. pcmOpen opens the tinyalsa device unless the
+// vendor.audio.pcm_backend property is "clocked", then it is an in-memory
+// device run by the monotonic clock (see clocked_pcm.h).
+struct Pcm {
+    virtual ~Pcm() {}
+    virtual int read(void *data, size_t bytes) = 0;
+    virtual int write(const void *data, size_t bytes) = 0;
+    virtual int getHtimestamp(unsigned int *avail, struct timespec *ts) = 0;
+    virtual size_t getBufferSizeFrames() const = 0;
+    // pcm_read and pcm_write restart the device after an xrun and return 0,
+    // this counts the xruns since the device was opened.
+    virtual uint32_t getXrunCount() const = 0;
+};
+
+typedef std::unique_ptr<Pcm> PcmPtr;
+PcmPtr pcmOpen(unsigned int dev, unsigned int card, unsigned int nChannels, size_t sampleRateHz, size_t frameCount, unsigned int periodCount, bool isOut);
+
+// False if the PCM devices are not backed by the sound card, there are no
+// mixer controls then.
+bool pcmIsHardware();
 
 typedef struct mixer mixer_t;
 typedef struct mixer_ctl mixer_ctl_t;
@@ -14,9 +14,19 @@
  * limitations under the License.
  */
 
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
 #include <log/log.h>
 #include <cutils/bitops.h>
+#include <cutils/properties.h>
+#include <cutils/sched_policy.h>
 #include <system/audio.h>
+#include <utils/ThreadDefs.h>
+#include <algorithm>
 #include "util.h"
 
 namespace android {
@@ -46,8 +56,11 @@ const std::array<hidl_bitfield<AudioChannelMask>, 4> kSupportedOutChannelMask =
     AudioChannelMask::OUT_STEREO | 0,
 };
 
-const std::array<AudioFormat, 1> kSupportedAudioFormats = {
+const std::array<AudioFormat, 4> kSupportedAudioFormats = {
     AudioFormat::PCM_16_BIT,
+    AudioFormat::PCM_FLOAT,
+    AudioFormat::PCM_24_BIT_PACKED,
+    AudioFormat::PCM_32_BIT,
 };
 
 bool checkSampleRateHz(uint32_t value, uint32_t &suggest) {
@@ -66,8 +79,80 @@ size_t getBufferSizeFrames(size_t duration_ms, uint32_t sample_rate) {
     return sample_rate * duration_ms / 1000;
 }
 
+// "2", "2-3", "0,2-3" to a CPU set, false if malformed or empty.
+bool parseCpuList(const char *str, cpu_set_t &cpus) {
+    CPU_ZERO(&cpus);
+    while (*str) {
+        char *end;
+        const long first = strtol(str, &end, 10);
+        if (end == str) {
+            return false;
+        }
+
+        long last = first;
+        if (*end == '-') {
+            str = end + 1;
+            last = strtol(str, &end, 10);
+            if (end == str) {
+                return false;
+            }
+        }
+        if ((first < 0) || (last < first) || (last >= CPU_SETSIZE)) {
+            return false;
+        }
+        for (long cpu = first; cpu <= last; ++cpu) {
+            CPU_SET(cpu, &cpus);
+        }
+
+        if (*end == ',') {
+            ++end;
+        } else if (*end) {
+            return false;
+        }
+        str = end;
+    }
+
+    return CPU_COUNT(&cpus) > 0;
+}
+
+constexpr char kRtPriorityProperty[] = "vendor.audio.rt_priority";
+constexpr char kCpuAffinityProperty[] = "vendor.audio.cpu_affinity";
+constexpr int kDefaultRtPriority = 2;
+
 }  // namespace
 
+bool setIoThreadPriority(const char *name) {
+    set_sched_policy(0, SP_FOREGROUND);
+
+    char affinity[PROPERTY_VALUE_MAX];
+    if (property_get(kCpuAffinityProperty, affinity, nullptr) > 0) {
+        cpu_set_t cpus;
+        if (!parseCpuList(affinity, cpus)) {
+            ALOGE("%s:%d: %s: bad %s '%s'", __func__, __LINE__, name,
+                  kCpuAffinityProperty, affinity);
+        } else if (sched_setaffinity(0, sizeof(cpus), &cpus)) {
+            ALOGW("%s:%d: %s: could not pin to CPUs %s: %s", __func__, __LINE__,
+                  name, affinity, strerror(errno));
+        }
+    }
+
+    const int priority = property_get_int32(kRtPriorityProperty, kDefaultRtPriority);
+    if (priority > 0) {
+        struct sched_param param = {};
+        param.sched_priority = std::min(priority, sched_get_priority_max(SCHED_FIFO));
+        const int res = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (res == 0) {
+            return true;
+        }
+
+        ALOGW("%s:%d: %s: SCHED_FIFO %d denied (%s), using a nice value",
+              __func__, __LINE__, name, param.sched_priority, strerror(res));
+    }
+
+    setpriority(PRIO_PROCESS, 0, PRIORITY_URGENT_AUDIO);
+    return false;
+}
+
 MicrophoneInfo getMicrophoneInfo() {
     MicrophoneInfo mic;
 
@@ -100,6 +185,7 @@ bool checkAudioConfig(bool isOut,
                       size_t duration_ms,
                       const AudioConfig &cfg,
                       AudioConfig &suggested) {
+    // streams are resampled to and from talsa::kPcmSampleRateHz
     bool valid = checkSampleRateHz(cfg.sampleRateHz, suggested.sampleRateHz);
 
     if (isOut) {
@@ -161,6 +247,35 @@ void StreamPosition::reset() {
     *this = StreamPosition();
 }
 
+AdaptivePeriodCount::AdaptivePeriodCount(const unsigned initial,
+                                         const unsigned min,
+                                         const unsigned max,
+                                         const unsigned quietPeriods)
+        : mMin(min)
+        , mMax(max)
+        , mQuietPeriods(quietPeriods)
+        , mCount(initial) {}
+
+bool AdaptivePeriodCount::update(const size_t marginFrames, const size_t periodFrames) {
+    if (marginFrames < periodFrames / 2) {
+        mQuiet = 0;
+        if (mCount < mMax) {
+            ++mCount;
+            ALOGW("AdaptivePeriodCount::%s:%d: %s, %u periods", __func__, __LINE__,
+                  marginFrames ? "late wakeup" : "xrun", mCount.load());
+            return true;
+        }
+    } else if (++mQuiet >= mQuietPeriods) {
+        mQuiet = 0;
+        if (mCount > mMin) {
+            --mCount;
+            return true;
+        }
+    }
+
+    return false;
+}
+
 }  // namespace util
 }  // namespace implementation
 }  // namespace V6_0
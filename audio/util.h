@@ -16,6 +16,7 @@
 
 #pragma once
 #include <array>
+#include <atomic>
 #include <android/hardware/audio/common/6.0/types.h>
 #include <android/hardware/audio/6.0/types.h>
 #include <utils/Timers.h>
@@ -43,6 +44,13 @@ bool checkAudioConfig(bool isOut,
                       const AudioConfig &cfg,
                       AudioConfig &suggested);
 
+// Makes the calling thread an audio IO thread. It asks for SCHED_FIFO at
+// the vendor.audio.rt_priority property (default 2, 0 disables it) and
+// falls back to PRIORITY_URGENT_AUDIO if the kernel refuses. If the
+// vendor.audio.cpu_affinity property lists CPUs ("2", "2-3", "0,2") the
+// thread is pinned to them. Returns true if the thread runs SCHED_FIFO.
+bool setIoThreadPriority(const char *name);
+
 struct StreamPosition {
     StreamPosition();
     void addFrames(uint64_t n);
@@ -53,6 +61,27 @@ struct StreamPosition {
     nsecs_t mTimestamp;
 };
 
+// The number of periods an IO thread keeps in the device buffer. It grows
+// by one as soon as the thread comes within half a period of an xrun and
+// shrinks by one after quietPeriods periods without that happening.
+struct AdaptivePeriodCount {
+    AdaptivePeriodCount(unsigned initial, unsigned min, unsigned max,
+                        unsigned quietPeriods);
+
+    unsigned get() const { return mCount; }
+
+    // Called once per period with the frames left before the device would
+    // xrun (0 if it did). Returns true if the count has changed.
+    bool update(size_t marginFrames, size_t periodFrames);
+
+private:
+    const unsigned mMin;
+    const unsigned mMax;
+    const unsigned mQuietPeriods;
+    std::atomic<unsigned> mCount;
+    unsigned mQuiet = 0;
+};
+
 }  // namespace util
 }  // namespace implementation
 }  // namespace V6_0
@@ -20,6 +20,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/inotify.h>
 
 #include "EmulatedCameraHotplugThread.h"
@@ -28,6 +30,13 @@
 
 #define FAKE_HOTPLUG_FILE "/data/misc/media/emulator.camera.hotplug"
 
+/**
+ * A write to the hotplug file is only acted upon once the file has been
+ * quiet for this long; a plug/unplug storm collapses into a single read
+ * of the final value.
+ */
+#define HOTPLUG_DEBOUNCE_MS 50
+
 #define EVENT_SIZE (sizeof(struct inotify_event))
 #define EVENT_BUF_LEN (1024*(EVENT_SIZE+16))
 
@@ -41,7 +50,9 @@ EmulatedCameraHotplugThread::EmulatedCameraHotplugThread(
         mSubscribedCameraIds(std::move(subscribedCameraIds)) {
 
     mRunning = true;
-    mInotifyFd = 0;
+    mInotifyFd = -1;
+    mEpollFd = -1;
+    mExitEventFd = -1;
 }
 
 EmulatedCameraHotplugThread::~EmulatedCameraHotplugThread() {
@@ -59,29 +70,11 @@ void EmulatedCameraHotplugThread::requestExit() {
     ALOGV("%s: Requesting thread exit", __FUNCTION__);
     mRunning = false;
 
-    bool rmWatchFailed = false;
-    Vector<SubscriberInfo>::iterator it;
-    for (it = mSubscribers.begin(); it != mSubscribers.end(); ++it) {
-
-        if (inotify_rm_watch(mInotifyFd, it->WatchID) == -1) {
-
-            ALOGE("%s: Could not remove watch for camID '%d',"
-                  " error: '%s' (%d)",
-                 __FUNCTION__, it->CameraID, strerror(errno),
-                 errno);
-
-            rmWatchFailed = true ;
-        } else {
-            ALOGV("%s: Removed watch for camID '%d'",
-                __FUNCTION__, it->CameraID);
-        }
-    }
-
-    if (rmWatchFailed) { // unlikely
-        // Give the thread a fighting chance to error out on the next
-        // read
-        if (close(mInotifyFd) == -1) {
-            ALOGE("%s: close failure error: '%s' (%d)",
+    // Wake up epoll_wait in the thread loop
+    if (mExitEventFd != -1) {
+        const uint64_t one = 1;
+        if (TEMP_FAILURE_RETRY(write(mExitEventFd, &one, sizeof(one))) < 0) {
+            ALOGE("%s: eventfd write failure error: '%s' (%d)",
                  __FUNCTION__, strerror(errno), errno);
         }
     }
@@ -92,12 +85,10 @@ void EmulatedCameraHotplugThread::requestExit() {
 status_t EmulatedCameraHotplugThread::readyToRun() {
     Mutex::Autolock al(mMutex);
 
-    mInotifyFd = -1;
-
     do {
         ALOGV("%s: Initializing inotify", __FUNCTION__);
 
-        mInotifyFd = inotify_init();
+        mInotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
         if (mInotifyFd == -1) {
             ALOGE("%s: inotify_init failure error: '%s' (%d)",
                  __FUNCTION__, strerror(errno), errno);
@@ -105,6 +96,37 @@ status_t EmulatedCameraHotplugThread::readyToRun() {
             break;
         }
 
+        mExitEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (mExitEventFd == -1) {
+            ALOGE("%s: eventfd failure error: '%s' (%d)",
+                 __FUNCTION__, strerror(errno), errno);
+            mRunning = false;
+            break;
+        }
+
+        mEpollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (mEpollFd == -1) {
+            ALOGE("%s: epoll_create1 failure error: '%s' (%d)",
+                 __FUNCTION__, strerror(errno), errno);
+            mRunning = false;
+            break;
+        }
+
+        for (int fd : {mInotifyFd, mExitEventFd}) {
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.fd = fd;
+            if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+                ALOGE("%s: epoll_ctl failure error: '%s' (%d)",
+                     __FUNCTION__, strerror(errno), errno);
+                mRunning = false;
+                break;
+            }
+        }
+        if (!mRunning) {
+            break;
+        }
+
         /**
          * For each fake camera file, add a watch for when
          * the file is closed (if it was written to)
@@ -120,8 +142,11 @@ status_t EmulatedCameraHotplugThread::readyToRun() {
     if (!mRunning) {
         status_t err = -errno;
 
-        if (mInotifyFd != -1) {
-            close(mInotifyFd);
+        for (int* fd : {&mEpollFd, &mExitEventFd, &mInotifyFd}) {
+            if (*fd != -1) {
+                close(*fd);
+                *fd = -1;
+            }
         }
 
         return err;
@@ -134,16 +159,79 @@ bool EmulatedCameraHotplugThread::threadLoop() {
 
     // If requestExit was already called, mRunning will be false
     while (mRunning) {
-        char buffer[EVENT_BUF_LEN];
-        int length = QEMU_PIPE_RETRY(
+        const nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+        struct epoll_event events[2];
+        int n = epoll_wait(mEpollFd, events, 2, getPollTimeoutMs(now));
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ALOGE("%s: Error waiting on epoll FD, error: '%s' (%d)",
+                 __FUNCTION__, strerror(errno), errno);
+            mRunning = false;
+            break;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data.fd == mExitEventFd) {
+                ALOGV("%s: Shutting down thread", __FUNCTION__);
+                mRunning = false;
+            } else if (events[i].data.fd == mInotifyFd) {
+                if (!handleInotifyEvents()) {
+                    mRunning = false;
+                }
+            }
+        }
+
+        if (mRunning &&
+                !settlePendingEvents(systemTime(SYSTEM_TIME_MONOTONIC))) {
+            mRunning = false;
+        }
+    }
+
+    if (!mRunning) {
+        for (size_t i = 0; i < mSubscribers.size(); ++i) {
+            ALOGI("%s: camID '%d': %u hotplug events, %u notifications",
+                  __FUNCTION__, mSubscribers[i].CameraID,
+                  mSubscribers[i].EventsReceived,
+                  mSubscribers[i].NotificationsSent);
+        }
+
+        // requestExit may still write to mExitEventFd
+        Mutex::Autolock al(mMutex);
+        for (int* fd : {&mEpollFd, &mExitEventFd, &mInotifyFd}) {
+            if (*fd != -1) {
+                close(*fd);
+                *fd = -1;
+            }
+        }
+        return false;
+    }
+
+    return true;
+}
+
+bool EmulatedCameraHotplugThread::handleInotifyEvents() {
+    const nsecs_t deadline = systemTime(SYSTEM_TIME_MONOTONIC) +
+                             milliseconds_to_nanoseconds(HOTPLUG_DEBOUNCE_MS);
+
+    // Drain the (non-blocking) inotify FD, only marking cameras dirty;
+    // the files are read once the burst has settled.
+    while (true) {
+        char buffer[EVENT_BUF_LEN]
+            __attribute__((aligned(__alignof__(struct inotify_event))));
+        int length = TEMP_FAILURE_RETRY(
                         read(mInotifyFd, buffer, EVENT_BUF_LEN));
 
         if (length < 0) {
+            if (errno == EAGAIN) {
+                return true;
+            }
             ALOGE("%s: Error reading from inotify FD, error: '%s' (%d)",
                  __FUNCTION__, strerror(errno),
                  errno);
-            mRunning = false;
-            break;
+            return false;
         }
 
         ALOGV("%s: Read %d bytes from inotify FD", __FUNCTION__, length);
@@ -154,43 +242,26 @@ bool EmulatedCameraHotplugThread::threadLoop() {
 
             if (event->mask & IN_IGNORED) {
                 Mutex::Autolock al(mMutex);
-                if (!mRunning) {
-                    ALOGV("%s: Shutting down thread", __FUNCTION__);
-                    break;
-                } else {
+                if (mRunning) {
                     ALOGE("%s: File was deleted, aborting",
                           __FUNCTION__);
-                    mRunning = false;
-                    break;
                 }
+                return false;
             } else if (event->mask & IN_CLOSE_WRITE) {
+                SubscriberInfo* si = NULL;
                 int cameraId = getCameraId(event->wd);
+                if (cameraId >= 0) {
+                    si = getSubscriberInfo(cameraId);
+                }
 
-                if (cameraId < 0) {
+                if (!si) {
                     ALOGE("%s: Got bad camera ID from WD '%d",
                           __FUNCTION__, event->wd);
                 } else {
-                    // Check the file for the new hotplug event
-                    String8 filePath = getFilePath(cameraId);
-                    /**
-                     * NOTE: we carefully avoid getting an inotify
-                     * for the same exact file because it's opened for
-                     * read-only, but our inotify is for write-only
-                     */
-                    int newStatus = readFile(filePath);
-
-                    if (newStatus < 0) {
-                        mRunning = false;
-                        break;
-                    }
-
-                    int halStatus = newStatus ?
-                        CAMERA_DEVICE_STATUS_PRESENT :
-                        CAMERA_DEVICE_STATUS_NOT_PRESENT;
-                    gEmulatedCameraFactory.onStatusChanged(cameraId,
-                                                           halStatus);
+                    si->EventsReceived++;
+                    si->Pending = true;
+                    si->DeadlineNs = deadline;
                 }
-
             } else {
                 ALOGW("%s: Unknown mask 0x%x",
                       __FUNCTION__, event->mask);
@@ -199,15 +270,61 @@ bool EmulatedCameraHotplugThread::threadLoop() {
             i += EVENT_SIZE + event->len;
         }
     }
+}
 
-    if (!mRunning) {
-        close(mInotifyFd);
-        return false;
+bool EmulatedCameraHotplugThread::settlePendingEvents(nsecs_t now) {
+    for (size_t i = 0; i < mSubscribers.size(); ++i) {
+        SubscriberInfo& si = mSubscribers.editItemAt(i);
+        if (!si.Pending || si.DeadlineNs > now) {
+            continue;
+        }
+        si.Pending = false;
+
+        /**
+         * NOTE: we carefully avoid getting an inotify
+         * for the same exact file because it's opened for
+         * read-only, but our inotify is for write-only
+         */
+        int newStatus = readFile(getFilePath(si.CameraID));
+        if (newStatus < 0) {
+            return false;
+        }
+
+        int halStatus = newStatus ?
+            CAMERA_DEVICE_STATUS_PRESENT :
+            CAMERA_DEVICE_STATUS_NOT_PRESENT;
+        if (halStatus == si.LastStatus) {
+            ALOGV("%s: camID '%d' settled on unchanged status %d",
+                  __FUNCTION__, si.CameraID, halStatus);
+            continue;
+        }
+
+        si.LastStatus = halStatus;
+        si.NotificationsSent++;
+        gEmulatedCameraFactory.onStatusChanged(si.CameraID, halStatus);
     }
 
     return true;
 }
 
+int EmulatedCameraHotplugThread::getPollTimeoutMs(nsecs_t now) const {
+    nsecs_t earliest = -1;
+    for (size_t i = 0; i < mSubscribers.size(); ++i) {
+        const SubscriberInfo& si = mSubscribers[i];
+        if (si.Pending && (earliest < 0 || si.DeadlineNs < earliest)) {
+            earliest = si.DeadlineNs;
+        }
+    }
+
+    if (earliest < 0) {
+        return -1;  // nothing pending, sleep until the next event
+    } else if (earliest <= now) {
+        return 0;
+    } else {
+        return toMillisecondTimeoutDelay(now, earliest);
+    }
+}
+
 String8 EmulatedCameraHotplugThread::getFilePath(int cameraId) const {
     return String8::format(FAKE_HOTPLUG_FILE ".%d", cameraId);
 }
@@ -263,7 +380,11 @@ bool EmulatedCameraHotplugThread::addWatch(int cameraId) {
     ALOGV("%s: Watch added for camID='%d', wd='%d'",
           __FUNCTION__, cameraId, wd);
 
-    SubscriberInfo si = { cameraId, wd };
+    // Cameras are created plugged in, see EmulatedBaseCamera::getHotplugStatus
+    SubscriberInfo si = {};
+    si.CameraID = cameraId;
+    si.WatchID = wd;
+    si.LastStatus = CAMERA_DEVICE_STATUS_PRESENT;
     mSubscribers.push_back(si);
 
     return true;
@@ -23,6 +23,11 @@
  * status goes between PRESENT and NOT_PRESENT.
  *
  * Refer to FAKE_HOTPLUG_FILE in EmulatedCameraHotplugThread.cpp
+ *
+ * All watches share a single inotify fd which is polled together with an
+ * exit eventfd from one epoll loop. Bursts of writes to the same file are
+ * debounced (see HOTPLUG_DEBOUNCE_MS) and the camera status is only
+ * reported to the factory when the debounced value actually flips.
  */
 
 #include <vector>
@@ -48,6 +53,11 @@ class EmulatedCameraHotplugThread : public Thread {
     struct SubscriberInfo {
         int CameraID;
         int WatchID;
+        int LastStatus;         // last status delivered to the factory
+        bool Pending;           // an event is waiting for the debounce
+        nsecs_t DeadlineNs;     // when the pending event settles
+        uint32_t EventsReceived;
+        uint32_t NotificationsSent;
     };
 
     bool addWatch(int cameraId);
@@ -60,7 +70,13 @@ class EmulatedCameraHotplugThread : public Thread {
     String8 getFilePath(int cameraId) const;
     int readFile(const String8& filePath) const;
 
+    bool handleInotifyEvents();
+    bool settlePendingEvents(nsecs_t now);
+    int getPollTimeoutMs(nsecs_t now) const;
+
     int mInotifyFd;
+    int mEpollFd;
+    int mExitEventFd;
     std::vector<int> mSubscribedCameraIds;
     Vector<SubscriberInfo> mSubscribers;
 
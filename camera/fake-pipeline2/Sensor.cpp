@@ -30,6 +30,7 @@
 
 #include "../EmulatedFakeCamera2.h"
 #include "Sensor.h"
+#include <algorithm>
 #include <cmath>
 #include <cstdlib>
 #include "system/camera_metadata.h"
@@ -78,6 +79,15 @@ const float Sensor::kReadNoiseVarAfterGain =
 const int32_t Sensor::kSensitivityRange[2] = {100, 1600};
 const uint32_t Sensor::kDefaultSensitivity = 100;
 
+// Depth output characteristics. The lens and physical sensor size match the
+// static metadata in EmulatedFakeCamera3.
+static const uint32_t kDepthCloudGridWidth = 160;
+static const uint32_t kDepthCloudGridHeight = 120;
+static const float kDepthFocalLength = 5.0f; // mm
+static const float kDepthPhysicalSize[2] = {3.20f, 2.40f}; // mm
+static const float kDepthCloudConfidence = 0.8f;
+static const size_t kDepthCloudFloatsPerPoint = 4;
+
 
 /** A few utility functions for math, normal distributions */
 
@@ -316,6 +326,22 @@ bool Sensor::threadLoop() {
         mScene.setExposureDuration((float)exposureDuration/1e9);
         mScene.calculateScene(mNextCaptureTime);
 
+        // The depth map and point cloud share a single pass over the scene
+        const StreamBuffer *depthBuffer = NULL;
+        const StreamBuffer *cloudBuffer = NULL;
+        for (size_t i = 0; i < mNextCapturedBuffers->size(); i++) {
+            const StreamBuffer &b = (*mNextCapturedBuffers)[i];
+            if (b.format == HAL_PIXEL_FORMAT_Y16) {
+                depthBuffer = &b;
+            } else if (b.format == HAL_PIXEL_FORMAT_BLOB &&
+                    b.dataSpace == HAL_DATASPACE_DEPTH) {
+                cloudBuffer = &b;
+            }
+        }
+        if (depthBuffer != NULL || cloudBuffer != NULL) {
+            captureDepth(depthBuffer, cloudBuffer, gain);
+        }
+
         // Might be adding more buffers, so size isn't constant
         for (size_t i = 0; i < mNextCapturedBuffers->size(); i++) {
             const StreamBuffer &b = (*mNextCapturedBuffers)[i];
@@ -348,9 +374,8 @@ bool Sensor::threadLoop() {
                         // TODO: Reuse these
                         bAux.img = new uint8_t[b.width * b.height * 3];
                         mNextCapturedBuffers->push_back(bAux);
-                    } else {
-                        captureDepthCloud(b.img);
                     }
+                    // Depth point cloud was captured above
                     break;
                 case HAL_PIXEL_FORMAT_YCbCr_420_888:
                     captureYU12(b.img, gain, b.width, b.height);
@@ -360,7 +385,7 @@ bool Sensor::threadLoop() {
                     ALOGE("%s: Format %x is TODO", __FUNCTION__, b.format);
                     break;
                 case HAL_PIXEL_FORMAT_Y16:
-                    captureDepth(b.img, gain, b.width, b.height);
+                    // Captured above, together with the point cloud
                     break;
                 default:
                     ALOGE("%s: Unknown format %x, no output", __FUNCTION__,
@@ -565,17 +590,45 @@ void Sensor::captureYU12(uint8_t *img, uint32_t gain, uint32_t width, uint32_t h
     ALOGVV("YU21 sensor image captured");
 }
 
-void Sensor::captureDepth(uint8_t *img, uint32_t gain, uint32_t width, uint32_t height) {
+void Sensor::captureDepth(const StreamBuffer *depthBuffer,
+        const StreamBuffer *cloudBuffer, uint32_t gain) {
     ATRACE_CALL();
     float totalGain = gain/100.0 * kBaseGainFactor;
     // In fixed-point math, calculate scaling factor to 13bpp millimeters
     int scale64x = 64 * totalGain * 8191 / kMaxRawValue;
+    // Without a DEPTH16 output, the point cloud samples a depth map of the
+    // size advertised in ANDROID_DEPTH_AVAILABLE_DEPTH_STREAM_CONFIGURATIONS,
+    // reading out only the rows it needs.
+    const uint32_t width = depthBuffer ? depthBuffer->width : kDepthCloudGridWidth;
+    const uint32_t height = depthBuffer ? depthBuffer->height : kDepthCloudGridHeight;
     unsigned int DivH= (float)mSceneHeight/height * (0x1 << 10);
     unsigned int DivW = (float)mSceneWidth/width * (0x1 << 10);
 
+    const DepthProjection *proj = NULL;
+    android_depth_points *cloud = NULL;
+    float *points = NULL;
+    if (cloudBuffer != NULL) {
+        // The BLOB stream width is the maximum number of points it holds
+        proj = &getDepthProjection(width, height, cloudBuffer->width);
+        cloud = reinterpret_cast<android_depth_points*>(cloudBuffer->img);
+        points = cloud->xyzc_points;
+    }
+    if (depthBuffer == NULL && mDepthRow.size() < width) {
+        mDepthRow.resize(width);
+    }
+
+    size_t gridRow = 0;
     for (unsigned int outY = 0; outY < height; outY++) {
+        const bool cloudRow = proj != NULL && gridRow < proj->rows.size() &&
+                proj->rows[gridRow] == outY;
+        if (depthBuffer == NULL && !cloudRow) {
+            continue;
+        }
+
         unsigned int y = outY * DivH >> 10;
-        uint16_t *px = ((uint16_t*)img) + outY * width;
+        uint16_t *row = depthBuffer ?
+                ((uint16_t*)depthBuffer->img) + outY * width : mDepthRow.data();
+        uint16_t *px = row;
         mScene.setReadoutPixel(0, y);
         unsigned int lastX = 0;
         const uint32_t *pixel = mScene.getPixelElectrons();
@@ -591,41 +644,76 @@ void Sensor::captureDepth(uint8_t *img, uint32_t gain, uint32_t width, uint32_t
             depthCount = pixel[Scene::Gr] * scale64x;
             *px++ = depthCount < 8191*64 ? depthCount / 64 : 0;
         }
+
+        if (cloudRow) {
+            // Straight-line table lookups, no branches or allocation per point
+            const float rayY = proj->rayY[gridRow++];
+            const uint32_t *cols = proj->cols.data();
+            const float *rayX = proj->rayX.data();
+            const size_t numCols = proj->cols.size();
+            for (size_t j = 0; j < numCols; j++) {
+                const float z = row[cols[j]] * 0.001f;  // millimeters to meters
+                points[0] = rayX[j] * z;
+                points[1] = rayY * z;
+                points[2] = z;
+                points[3] = z > 0.f ? kDepthCloudConfidence : 0.f;
+                points += kDepthCloudFloatsPerPoint;
+            }
+        }
         // TODO: Handle this better
         //simulatedTime += mRowReadoutTime;
     }
-    ALOGVV("Depth sensor image captured");
-}
-
-void Sensor::captureDepthCloud(uint8_t *img) {
-    ATRACE_CALL();
-    android_depth_points *cloud = reinterpret_cast<android_depth_points*>(img);
-
-    cloud->num_points = 16;
-
-    // TODO: Create point cloud values that match RGB scene
-    const int FLOATS_PER_POINT = 4;
-    const float JITTER_STDDEV = 0.1f;
-    for (size_t y = 0, i = 0; y < 4; y++) {
-        for (size_t x = 0; x < 4; x++, i++) {
-            float randSampleX = std::rand() * (2.5f / (1.0f + RAND_MAX)) - 1.25f;
-            randSampleX *= JITTER_STDDEV;
-
-            float randSampleY = std::rand() * (2.5f / (1.0f + RAND_MAX)) - 1.25f;
-            randSampleY *= JITTER_STDDEV;
 
-            float randSampleZ = std::rand() * (2.5f / (1.0f + RAND_MAX)) - 1.25f;
-            randSampleZ *= JITTER_STDDEV;
+    if (cloud != NULL) {
+        cloud->num_points = proj->rows.size() * proj->cols.size();
+        ALOGVV("Depth point cloud captured");
+    }
+    if (depthBuffer != NULL) {
+        ALOGVV("Depth sensor image captured");
+    }
+}
 
-            cloud->xyzc_points[i * FLOATS_PER_POINT + 0] = x - 1.5f + randSampleX;
-            cloud->xyzc_points[i * FLOATS_PER_POINT + 1] = y - 1.5f + randSampleY;
-            cloud->xyzc_points[i * FLOATS_PER_POINT + 2] = 3.f + randSampleZ;
-            cloud->xyzc_points[i * FLOATS_PER_POINT + 3] = 0.8f;
-        }
+const Sensor::DepthProjection &Sensor::getDepthProjection(uint32_t width,
+        uint32_t height, uint32_t maxPoints) {
+    DepthProjection &proj = mDepthProjection;
+    if (proj.width == width && proj.height == height &&
+            proj.maxPoints == maxPoints) {
+        return proj;
     }
 
-    ALOGVV("Depth point cloud captured");
+    // Largest grid with the depth map aspect ratio that fits in maxPoints
+    uint32_t gridW = static_cast<uint32_t>(
+            std::sqrt((float)maxPoints * width / height));
+    gridW = std::max(1u, std::min(gridW, std::min(width, maxPoints)));
+    uint32_t gridH = std::max(1u, std::min(maxPoints / gridW, height));
+
+    // Ideal intrinsics, matching ANDROID_LENS_INTRINSIC_CALIBRATION in
+    // EmulatedFakeCamera3 scaled down to the depth map resolution.
+    const float f_x = kDepthFocalLength * width / kDepthPhysicalSize[0];
+    const float f_y = kDepthFocalLength * height / kDepthPhysicalSize[1];
+    const float c_x = width / 2.f;
+    const float c_y = height / 2.f;
+
+    proj.cols.resize(gridW);
+    proj.rayX.resize(gridW);
+    for (uint32_t j = 0; j < gridW; j++) {
+        // Sample at the center of each grid cell
+        proj.cols[j] = (2 * j + 1) * width / (2 * gridW);
+        proj.rayX[j] = (proj.cols[j] - c_x) / f_x;
+    }
+    proj.rows.resize(gridH);
+    proj.rayY.resize(gridH);
+    for (uint32_t i = 0; i < gridH; i++) {
+        proj.rows[i] = (2 * i + 1) * height / (2 * gridH);
+        proj.rayY[i] = (proj.rows[i] - c_y) / f_y;
+    }
 
+    proj.width = width;
+    proj.height = height;
+    proj.maxPoints = maxPoints;
+    ALOGV("%s: %u x %u point grid for %u x %u depth map", __FUNCTION__,
+            gridW, gridH, width, height);
+    return proj;
 }
 
 } // namespace android
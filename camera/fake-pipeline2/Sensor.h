@@ -79,6 +79,8 @@
 #include "utils/Mutex.h"
 #include "utils/Timers.h"
 
+#include <vector>
+
 #include "Scene.h"
 #include "Base.h"
 
@@ -239,8 +241,25 @@ class Sensor: private Thread, public virtual RefBase {
     void captureRGBA(uint8_t *img, uint32_t gain, uint32_t width, uint32_t height);
     void captureRGB(uint8_t *img, uint32_t gain, uint32_t width, uint32_t height);
     void captureYU12(uint8_t *img, uint32_t gain, uint32_t width, uint32_t height);
-    void captureDepth(uint8_t *img, uint32_t gain, uint32_t width, uint32_t height);
-    void captureDepthCloud(uint8_t *img);
+    // Produces the DEPTH16 map and/or the depth point cloud in one pass over
+    // the scene; either buffer may be NULL.
+    void captureDepth(const StreamBuffer *depthBuffer,
+            const StreamBuffer *cloudBuffer, uint32_t gain);
+
+    // Back-projection of the point cloud sample grid through the depth
+    // camera intrinsics, cached for the last depth map resolution.
+    struct DepthProjection {
+        uint32_t width = 0, height = 0, maxPoints = 0;
+        std::vector<uint32_t> rows;  // depth map row of each grid row
+        std::vector<uint32_t> cols;  // depth map column of each grid column
+        std::vector<float> rayY;     // (row - c_y) / f_y for each grid row
+        std::vector<float> rayX;     // (col - c_x) / f_x for each grid column
+    };
+    DepthProjection mDepthProjection;
+    std::vector<uint16_t> mDepthRow;
+
+    const DepthProjection &getDepthProjection(uint32_t width, uint32_t height,
+            uint32_t maxPoints);
 
 };
 
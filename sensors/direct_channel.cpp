@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cutils/ashmem.h>
+#include <hardware/gralloc.h>
+#include <log/log.h>
+#include <sys/mman.h>
+#include <ui/GraphicBufferMapper.h>
+#include <ui/Rect.h>
+#include <cstring>
+#include "direct_channel.h"
+
+namespace goldfish {
+using ahs::V1_0::SensorsEventFormatOffset;
+using ahs::V1_0::SharedMemFormat;
+
+namespace {
+constexpr size_t kRecordSize =
+    static_cast<size_t>(SensorsEventFormatOffset::TOTAL_LENGTH);
+
+constexpr size_t offsetOf(const SensorsEventFormatOffset offset) {
+    return static_cast<size_t>(offset);
+}
+
+class AshmemDirectChannel : public DirectChannel {
+public:
+    AshmemDirectChannel(void* base, size_t size)
+            : DirectChannel(SharedMemType::ASHMEM, base, size)
+            , m_mapping(base)
+            , m_mappingSize(size) {}
+
+    ~AshmemDirectChannel() {
+        ::munmap(m_mapping, m_mappingSize);
+    }
+
+private:
+    void* const  m_mapping;
+    const size_t m_mappingSize;
+};
+
+class GrallocDirectChannel : public DirectChannel {
+public:
+    GrallocDirectChannel(buffer_handle_t buffer, void* base, size_t size)
+            : DirectChannel(SharedMemType::GRALLOC, base, size)
+            , m_buffer(buffer) {}
+
+    ~GrallocDirectChannel() {
+        ::android::GraphicBufferMapper& mapper = ::android::GraphicBufferMapper::get();
+        mapper.unlock(m_buffer);
+        mapper.freeBuffer(m_buffer);
+    }
+
+private:
+    const buffer_handle_t m_buffer;
+};
+
+std::unique_ptr<DirectChannel> createAshmemDirectChannel(const int fd,
+                                                         const size_t size) {
+    if (!ashmem_valid(fd)) {
+        ALOGE("%s:%d: fd is not ashmem", __func__, __LINE__);
+        return nullptr;
+    }
+    if (ashmem_get_size_region(fd) < static_cast<int>(size)) {
+        ALOGE("%s:%d: the ashmem region is smaller than %zu bytes",
+              __func__, __LINE__, size);
+        return nullptr;
+    }
+
+    // the mapping outlives the fd, it is closed after registerDirectChannel
+    void* base = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        ALOGE("%s:%d: mmap failed with '%s'", __func__, __LINE__, strerror(errno));
+        return nullptr;
+    }
+
+    return std::make_unique<AshmemDirectChannel>(base, size);
+}
+
+std::unique_ptr<DirectChannel> createGrallocDirectChannel(const native_handle_t* handle,
+                                                          const size_t size) {
+    constexpr uint64_t kUsage = GRALLOC_USAGE_SW_WRITE_OFTEN |
+                                GRALLOC_USAGE_SENSOR_DIRECT_DATA;
+    ::android::GraphicBufferMapper& mapper = ::android::GraphicBufferMapper::get();
+
+    // imports a copy of the handle, the one passed in is closed on return
+    buffer_handle_t buffer;
+    if (mapper.importBuffer(handle, size, 1, 1, HAL_PIXEL_FORMAT_BLOB,
+                            kUsage, size, &buffer) != ::android::OK) {
+        ALOGE("%s:%d: importBuffer failed", __func__, __LINE__);
+        return nullptr;
+    }
+
+    void* base;
+    if (mapper.lock(buffer, kUsage, ::android::Rect(size, 1), &base) != ::android::OK) {
+        ALOGE("%s:%d: lock failed", __func__, __LINE__);
+        mapper.freeBuffer(buffer);
+        return nullptr;
+    }
+
+    return std::make_unique<GrallocDirectChannel>(buffer, base, size);
+}
+
+}  // namespace
+
+std::unique_ptr<DirectChannel> DirectChannel::create(const SharedMemInfo& mem) {
+    const native_handle_t* handle = mem.memoryHandle.getNativeHandle();
+    if ((handle == nullptr) || (handle->numFds < 1) ||
+            (mem.format != SharedMemFormat::SENSORS_EVENT) ||
+            (mem.size < kRecordSize)) {
+        return nullptr;
+    }
+
+    switch (mem.type) {
+    case SharedMemType::ASHMEM:
+        return createAshmemDirectChannel(handle->data[0], mem.size);
+
+    case SharedMemType::GRALLOC:
+        return createGrallocDirectChannel(handle, mem.size);
+
+    default:
+        return nullptr;
+    }
+}
+
+DirectChannel::DirectChannel(const SharedMemType type, void* base, const size_t size)
+        : m_type(type)
+        , m_base(static_cast<uint8_t*>(base))
+        , m_size(size - size % kRecordSize) {}
+
+void DirectChannel::write(const Event& event, const int32_t reportToken) {
+    static_assert(sizeof(event.u) == offsetOf(SensorsEventFormatOffset::RESERVED) -
+                                     offsetOf(SensorsEventFormatOffset::DATA));
+
+    uint8_t* record = m_base + m_writePos;
+    const int32_t size = kRecordSize;
+    const int32_t sensorType = static_cast<int32_t>(event.sensorType);
+
+    // EventPayload has the layout of the sensors_event_t data union
+    memcpy(record + offsetOf(SensorsEventFormatOffset::SIZE_FIELD), &size, sizeof(size));
+    memcpy(record + offsetOf(SensorsEventFormatOffset::REPORT_TOKEN),
+           &reportToken, sizeof(reportToken));
+    memcpy(record + offsetOf(SensorsEventFormatOffset::SENSOR_TYPE),
+           &sensorType, sizeof(sensorType));
+    memcpy(record + offsetOf(SensorsEventFormatOffset::TIMESTAMP),
+           &event.timestamp, sizeof(event.timestamp));
+    memcpy(record + offsetOf(SensorsEventFormatOffset::DATA), &event.u, sizeof(event.u));
+    memset(record + offsetOf(SensorsEventFormatOffset::RESERVED), 0,
+           kRecordSize - offsetOf(SensorsEventFormatOffset::RESERVED));
+
+    // the client reads the record once it sees the new counter
+    __atomic_store_n(reinterpret_cast<uint32_t*>(
+                         record + offsetOf(SensorsEventFormatOffset::ATOMIC_COUNTER)),
+                     m_counter, __ATOMIC_RELEASE);
+
+    if (++m_counter == 0) {
+        m_counter = 1;
+    }
+    m_writePos += kRecordSize;
+    if (m_writePos >= m_size) {
+        m_writePos = 0;
+    }
+    ++m_eventCount;
+}
+
+}  // namespace goldfish
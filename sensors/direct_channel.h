@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#include <android/hardware/sensors/2.1/types.h>
+#include <cstdint>
+#include <memory>
+
+namespace goldfish {
+namespace ahs = ::android::hardware::sensors;
+
+// The shared memory of a direct channel (registerDirectChannel): a ring of
+// sensors_event_t records the HAL writes in sequence, wrapping around at the
+// last whole record. The client polls the atomic counter of the next record,
+// it is stored last.
+class DirectChannel {
+public:
+    using Event = ahs::V2_1::Event;
+    using SharedMemInfo = ahs::V1_0::SharedMemInfo;
+    using SharedMemType = ahs::V1_0::SharedMemType;
+
+    // nullptr if the memory can't be mapped or is too small
+    static std::unique_ptr<DirectChannel> create(const SharedMemInfo& mem);
+    virtual ~DirectChannel() {}
+
+    SharedMemType getType() const { return m_type; }
+    size_t getSize() const { return m_size; }
+    uint64_t getEventCount() const { return m_eventCount; }
+
+    void write(const Event& event, int32_t reportToken);
+
+    DirectChannel(const DirectChannel&) = delete;
+    DirectChannel& operator=(const DirectChannel&) = delete;
+
+protected:
+    DirectChannel(SharedMemType type, void* base, size_t size);
+
+private:
+    const SharedMemType m_type;
+    uint8_t* const      m_base;
+    const size_t        m_size;         // a multiple of the record size
+    size_t              m_writePos = 0;
+    uint32_t            m_counter = 1;  // 0 is never written
+    uint64_t            m_eventCount = 0;
+};
+
+}  // namespace goldfish
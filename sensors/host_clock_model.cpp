@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include "host_clock_model.h"
+
+namespace goldfish {
+
+namespace {
+// a snapshot load or a host clock change, start over
+constexpr int64_t kMaxResidualNs = 1000000000;
+// the host and guest clocks run at the same nominal rate
+constexpr double kMaxDrift = 1e-3;
+}  // namespace
+
+void HostClockModel::addSample(const int64_t hostNs, const int64_t guestNs) {
+    if (m_bucketValid) {
+        const int64_t residualNs = guestNs - toGuestNs(hostNs);
+
+        if ((hostNs <= m_bucket.hostNs) || (std::abs(residualNs) > kMaxResidualNs)) {
+            reset();
+        } else {
+            const uint64_t jitterUs = std::max(int64_t(0), residualNs) / 1000;
+            m_jitterSumUs += jitterUs;
+            m_jitterSumSqUs += jitterUs * jitterUs;
+            if (jitterUs > m_jitterMaxUs) {
+                m_jitterMaxUs = jitterUs;
+            }
+            ++m_sampleCount;
+        }
+    }
+
+    if (!m_bucketValid || (hostNs - m_bucketStartNs >= kBucketNs)) {
+        if (m_bucketValid) {
+            m_samples[m_next] = m_bucket;
+            m_next = (m_next + 1) % kWindowSize;
+            m_size = std::min(m_size + 1, kWindowSize);
+        }
+        m_bucket = {hostNs, guestNs};
+        m_bucketStartNs = hostNs;
+        m_bucketValid = true;
+    } else if ((guestNs - hostNs) < (m_bucket.guestNs - m_bucket.hostNs)) {
+        m_bucket = {hostNs, guestNs};
+    }
+
+    fit();
+}
+
+int64_t HostClockModel::toGuestNs(const int64_t hostNs) const {
+    return m_originGuestNs +
+           std::llround(m_offsetNs + m_slope * double(hostNs - m_originHostNs));
+}
+
+void HostClockModel::reset() {
+    m_size = 0;
+    m_next = 0;
+    m_bucketValid = false;
+    ++m_resetCount;
+}
+
+// Least squares around the current bucket, then the lowest residual becomes
+// the offset.
+void HostClockModel::fit() {
+    m_originHostNs = m_bucket.hostNs;
+    m_originGuestNs = m_bucket.guestNs;
+
+    const int n = m_size + 1;
+    const auto dh = [this](const int i) {
+        return double(((i < m_size) ? m_samples[i] : m_bucket).hostNs - m_originHostNs);
+    };
+    const auto dg = [this](const int i) {
+        return double(((i < m_size) ? m_samples[i] : m_bucket).guestNs - m_originGuestNs);
+    };
+
+    double slope = 1;
+    if (n >= kMinSamplesForSlope) {
+        double sumH = 0;
+        double sumG = 0;
+        for (int i = 0; i < n; ++i) {
+            sumH += dh(i);
+            sumG += dg(i);
+        }
+        const double meanH = sumH / n;
+        const double meanG = sumG / n;
+
+        double covHG = 0;
+        double varH = 0;
+        for (int i = 0; i < n; ++i) {
+            const double h = dh(i) - meanH;
+            const double g = dg(i) - meanG;
+            covHG += h * g;
+            varH += h * h;
+        }
+
+        if (varH > 0) {
+            slope = std::clamp(covHG / varH, 1 - kMaxDrift, 1 + kMaxDrift);
+        }
+    }
+
+    double offsetNs = INFINITY;
+    for (int i = 0; i < n; ++i) {
+        offsetNs = std::min(offsetNs, dg(i) - slope * dh(i));
+    }
+
+    m_slope = slope;
+    m_offsetNs = offsetNs;
+    m_driftPpm = std::lround((slope - 1) * 1e6);
+}
+
+void HostClockModel::dump(const int fd) const {
+    const uint64_t n = m_sampleCount;
+    const double meanUs = n ? (double(m_jitterSumUs) / n) : 0;
+    const double varUs = n ? std::max(0.0, double(m_jitterSumSqUs) / n - meanUs * meanUs) : 0;
+
+    dprintf(fd, "host clock: %" PRIu64 " syncs, %u resets, drift %d ppm, "
+            "jitter avg %.0f us, stddev %.0f us, max %u us\n",
+            n, m_resetCount.load(), m_driftPpm.load(),
+            meanUs, std::sqrt(varUs), m_jitterMaxUs.load());
+}
+
+}  // namespace goldfish
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+namespace goldfish {
+
+// Maps the host sample time of the "sync:" messages to the guest clock.
+// Every kBucketNs of host time keeps its (host time, guest receive time)
+// pair that arrived the fastest. A line is fitted to the last kWindowSize
+// of them and moved down onto the lowest one, so the delivery jitter of the
+// pipe does not end up in the timestamps. The residuals above that line are
+// the jitter, they are kept as statistics.
+//
+// addSample and toGuestNs are called by the listener thread only, dump
+// from any thread.
+class HostClockModel {
+public:
+    static constexpr int kWindowSize = 64;
+    static constexpr int64_t kBucketNs = 100000000;
+    static constexpr int kMinSamplesForSlope = 8;
+
+    void addSample(int64_t hostNs, int64_t guestNs);
+    bool isValid() const { return m_bucketValid; }
+    int64_t toGuestNs(int64_t hostNs) const;
+
+    void dump(int fd) const;
+
+private:
+    void reset();
+    void fit();
+
+    struct Sample {
+        int64_t hostNs;
+        int64_t guestNs;
+    };
+
+    std::array<Sample, kWindowSize> m_samples;
+    int m_size = 0;
+    int m_next = 0;
+    Sample m_bucket;        // the fastest one since m_bucketStartNs
+    int64_t m_bucketStartNs = 0;
+    bool m_bucketValid = false;
+
+    // guestNs = m_originGuestNs + m_offsetNs + m_slope * (hostNs - m_originHostNs)
+    int64_t m_originHostNs = 0;
+    int64_t m_originGuestNs = 0;
+    double m_offsetNs = 0;
+    double m_slope = 1;
+
+    std::atomic<uint64_t> m_sampleCount = 0;
+    std::atomic<uint32_t> m_resetCount = 0;
+    std::atomic<int32_t> m_driftPpm = 0;
+    std::atomic<uint64_t> m_jitterSumUs = 0;
+    std::atomic<uint64_t> m_jitterSumSqUs = 0;
+    std::atomic<uint32_t> m_jitterMaxUs = 0;
+};
+
+}  // namespace goldfish
@@ -14,7 +14,10 @@
  * limitations under the License.
  */
 
+#include <algorithm>
 #include <cinttypes>
+#include <cstdio>
+#include <math.h>
 #include <log/log.h>
 #include <qemud.h>
 #include <utils/SystemClock.h>
@@ -25,8 +28,39 @@ namespace goldfish {
 using ahs21::SensorType;
 using ahs10::SensorFlagBits;
 using ahs10::MetaDataEventType;
+using ahs10::SensorFlagShift;
 
-MultihalSensors::MultihalSensors() : m_qemuSensorsFd(qemud_channel_open("sensors")) {
+namespace {
+bool approximatelyEqual(double a, double b, double eps) {
+    return fabs(a - b) <= std::max(fabs(a), fabs(b)) * eps;
+}
+
+// SensorFusion does not estimate it, about 6 degrees
+constexpr float kRotationVectorHeadingAccuracyRad = 0.1f;
+
+uint32_t getMaxDirectRateLevel(const SensorInfo& sensor) {
+    return (sensor.flags & static_cast<uint32_t>(SensorFlagBits::MASK_DIRECT_REPORT)) >>
+           static_cast<uint32_t>(SensorFlagShift::DIRECT_REPORT);
+}
+
+// the nominal rates of the levels, no faster than the sensor
+int64_t getDirectReportPeriodNs(const SensorInfo& sensor, const RateLevel rate) {
+    int64_t periodNs;
+    switch (rate) {
+    case RateLevel::NORMAL:     periodNs = 20000000; break;     // 50 Hz
+    case RateLevel::FAST:       periodNs = 5000000; break;      // 200 Hz
+    case RateLevel::VERY_FAST:  periodNs = 1250000; break;      // 800 Hz
+    default:                    periodNs = 0; break;
+    }
+    return std::max(periodNs, int64_t(sensor.minDelay) * 1000);
+}
+}  // namespace
+
+MultihalSensors::MultihalSensors()
+        : MultihalSensors(unique_fd(qemud_channel_open("sensors"))) {}
+
+MultihalSensors::MultihalSensors(unique_fd qemuSensorsFd)
+        : m_qemuSensorsFd(std::move(qemuSensorsFd)) {
     if (!m_qemuSensorsFd.ok()) {
         ALOGE("%s:%d: m_qemuSensorsFd is not opened", __func__, __LINE__);
         ::abort();
@@ -56,13 +90,28 @@ MultihalSensors::MultihalSensors() : m_qemuSensorsFd(qemud_channel_open("sensors
         ::abort();
     }
     buffer[len] = 0;
-    uint32_t availableSensorsMask = 0;
-    if (sscanf(buffer, "%u", &availableSensorsMask) != 1) {
+    unsigned long long availableSensorsMask = 0;
+    if (sscanf(buffer, "%llu", &availableSensorsMask) != 1) {
         ALOGE("%s:%d: Can't parse qemud response", __func__, __LINE__);
         ::abort();
     }
-    m_availableSensorsMask =
-        availableSensorsMask & ((1u << getSensorNumber()) - 1);
+    // a virtual sensor is there if all its inputs are
+    const SensorMask hostSensors(availableSensorsMask);
+    for (int i = 0; i < kSensorNumber; ++i) {
+        const SensorMask& inputs = getVirtualSensorInputs(i);
+        m_virtualSensors[i] = inputs.any();
+        m_availableSensors[i] = inputs.any() ? (inputs & ~hostSensors).none()
+                                             : hostSensors[i];
+    }
+
+    // full rate until batch() is called
+    for (int i = 0; i < kSensorNumber; ++i) {
+        const SensorInfo* sensor = getSensorInfoByHandle(i);
+        SensorState* state = &m_sensors[i];
+        state->samplingPeriodNs = int64_t(sensor->minDelay) * 1000;
+        state->fifo.reserve(sensor->fifoMaxEventCount);
+        state->isContinuous = isContinuousSensor(*sensor);
+    }
 
     if (!::android::base::Socketpair(AF_LOCAL, SOCK_STREAM, 0,
                                      &m_callersFd, &m_sensorThreadFd)) {
@@ -74,9 +123,19 @@ MultihalSensors::MultihalSensors() : m_qemuSensorsFd(qemud_channel_open("sensors
 }
 
 MultihalSensors::~MultihalSensors() {
+    // the listener thread writes to the direct channels and the FIFOs
+    // disableAllSensors frees
+    stop();
+
+    std::unique_lock<std::mutex> lock(m_apiMtx);
     disableAllSensors();
-    qemuSensorThreadSendCommand(kCMD_QUIT);
-    m_sensorThread.join();
+}
+
+void MultihalSensors::stop() {
+    if (m_sensorThread.joinable()) {
+        qemuSensorThreadSendCommand(kCMD_QUIT);
+        m_sensorThread.join();
+    }
 }
 
 const std::string MultihalSensors::getName() {
@@ -84,17 +143,39 @@ const std::string MultihalSensors::getName() {
 }
 
 Return<void> MultihalSensors::debug(const hidl_handle& fd, const hidl_vec<hidl_string>& args) {
-    (void)fd;
     (void)args;
+    if (fd.getNativeHandle() == nullptr || fd->numFds < 1) {
+        return {};
+    }
+
+    const int out = fd->data[0];
+    {
+        std::unique_lock<std::mutex> lock(m_postMtx);
+        dprintf(out, "postEvents calls: %" PRIu64 ", events: %" PRIu64 "\n",
+                m_postCount, m_postedEventCount);
+    }
+
+    m_hostClock.dump(out);
+
+    std::unique_lock<std::mutex> lock(m_apiMtx);
+    for (const auto& [channelHandle, state] : m_directChannels) {
+        dprintf(out, "direct channel %d: %s, %zu bytes, events: %" PRIu64 "\n",
+                channelHandle,
+                (state.channel->getType() == SharedMemType::ASHMEM) ? "ashmem" : "gralloc",
+                state.channel->getSize(), state.channel->getEventCount());
+        for (const DirectReport& report : state.reports) {
+            dprintf(out, "  sensor %d: token %d, period %" PRId64 " us\n",
+                    report.sensorHandle, report.reportToken, report.periodNs / 1000);
+        }
+    }
     return {};
 }
 
 Return<void> MultihalSensors::getSensorsList_2_1(getSensorsList_2_1_cb _hidl_cb) {
     std::vector<SensorInfo> sensors;
 
-    uint32_t mask = m_availableSensorsMask;
-    for (int i = 0; mask; ++i, mask >>= 1) {
-        if (mask & 1) {
+    for (int i = 0; i < kSensorNumber; ++i) {
+        if (m_availableSensors[i]) {
             sensors.push_back(*getSensorInfoByHandle(i));
         }
     }
@@ -106,7 +187,7 @@ Return<void> MultihalSensors::getSensorsList_2_1(getSensorsList_2_1_cb _hidl_cb)
 Return<Result> MultihalSensors::setOperationMode(const OperationMode mode) {
     std::unique_lock<std::mutex> lock(m_apiMtx);
 
-    if (m_activeSensorsMask) {
+    if (m_activeSensors.any() || m_directSensors.any()) {
         return Result::INVALID_OPERATION;
     } else {
         m_opMode = mode;
@@ -122,41 +203,60 @@ Return<Result> MultihalSensors::activate(const int32_t sensorHandle,
 
     std::unique_lock<std::mutex> lock(m_apiMtx);
 
-    uint32_t newActiveMask;
-    if (enabled) {
-        newActiveMask = m_activeSensorsMask | (1u << sensorHandle);
-    } else {
-        newActiveMask = m_activeSensorsMask & ~(1u << sensorHandle);
-    }
-    if (m_activeSensorsMask == newActiveMask) {
+    if (m_activeSensors[sensorHandle] == enabled) {
         return Result::OK;
     }
 
-    if (m_opMode == OperationMode::NORMAL) {
-        if (!activateQemuSensorImpl(m_qemuSensorsFd.get(), sensorHandle, enabled)) {
-            return Result::INVALID_OPERATION;
-        }
+    // the first virtual sensor starts the fusion over
+    const bool isFusing = (m_activeSensors & m_virtualSensors).any();
+
+    SensorMask activeSensors = m_activeSensors;
+    activeSensors[sensorHandle] = enabled;
+    if (!setEnabledSensorsLocked(activeSensors, m_directSensors)) {
+        return Result::INVALID_OPERATION;
     }
 
-    m_activeSensorsMask = newActiveMask;
+    if (enabled && m_virtualSensors[sensorHandle] && !isFusing) {
+        m_fusion.reset();
+    }
+
+    // an on change sensor reports its current value first
+    SensorState* state = &m_sensors[sensorHandle];
+    state->nextTimestampNs = 0;
+    state->fifo.clear();
+    state->lastValue = SensorState::kSensorNoValue;
     return Result::OK;
 }
 
 Return<Result> MultihalSensors::batch(const int32_t sensorHandle,
                                       const int64_t samplingPeriodNs,
                                       const int64_t maxReportLatencyNs) {
-    (void)maxReportLatencyNs;
-
     const SensorInfo* sensor = getSensorInfoByHandle(sensorHandle);
-    if (sensor) {
-        if (samplingPeriodNs >= sensor->minDelay) {
-            return Result::OK;
-        } else {
-            return Result::BAD_VALUE;
-        }
-    } else {
+    if (!sensor || (samplingPeriodNs < 0) || (maxReportLatencyNs < 0)) {
         return Result::BAD_VALUE;
     }
+
+    std::unique_lock<std::mutex> lock(m_apiMtx);
+
+    SensorState* state = &m_sensors[sensorHandle];
+
+    // the events already in the FIFO were batched with the old latency
+    flushFifoLocked(state);
+
+    state->samplingPeriodNs =
+        std::clamp(samplingPeriodNs,
+                   int64_t(sensor->minDelay) * 1000,
+                   std::max(int64_t(sensor->maxDelay), int64_t(sensor->minDelay)) * 1000);
+    state->maxReportLatencyNs = sensor->fifoMaxEventCount ? maxReportLatencyNs : 0;
+    state->nextTimestampNs = 0;
+
+    if (m_opMode == OperationMode::NORMAL) {
+        setHostDelayLocked();
+    }
+
+    lock.unlock();
+    postPendingEvents();
+    return Result::OK;
 }
 
 Return<Result> MultihalSensors::flush(const int32_t sensorHandle) {
@@ -166,16 +266,21 @@ Return<Result> MultihalSensors::flush(const int32_t sensorHandle) {
     }
 
     std::unique_lock<std::mutex> lock(m_apiMtx);
-    if (!(m_activeSensorsMask & (1u << sensorHandle))) {
+    if (!m_activeSensors[sensorHandle]) {
         return Result::BAD_VALUE;
     }
 
+    flushFifoLocked(&m_sensors[sensorHandle]);
+
     Event event;
     event.sensorHandle = sensorHandle;
     event.sensorType = SensorType::META_DATA;
     event.u.meta.what = MetaDataEventType::META_DATA_FLUSH_COMPLETE;
 
-    postSensorEventLocked(event);
+    queueSensorEventLocked(event);
+
+    lock.unlock();
+    postPendingEvents();
     return Result::OK;
 }
 
@@ -196,7 +301,10 @@ Return<Result> MultihalSensors::injectSensorData_2_1(const Event& event) {
         return Result::BAD_VALUE;
     }
 
-    postSensorEventLocked(event);
+    queueSensorEventLocked(event);
+
+    lock.unlock();
+    postPendingEvents();
     return Result::OK;
 }
 
@@ -209,45 +317,340 @@ Return<Result> MultihalSensors::initialize(const sp<IHalProxyCallback>& halProxy
 }
 
 void MultihalSensors::postSensorEvent(const Event& event) {
+    const int sensorHandle = event.sensorHandle;
+
     std::unique_lock<std::mutex> lock(m_apiMtx);
-    postSensorEventLocked(event);
+    if (m_directSensors[sensorHandle]) {
+        writeDirectReportsLocked(event);
+    }
+    if (m_activeSensors[sensorHandle]) {
+        batchSensorEventLocked(event);
+    }
+    if ((m_activeSensors & m_virtualSensors).any()) {
+        fuseSensorEventLocked(event);
+    }
 }
 
-void MultihalSensors::postSensorEventLocked(const Event& event) {
-    const bool isWakeupEvent =
-        getSensorInfoByHandle(event.sensorHandle)->flags &
-        static_cast<uint32_t>(SensorFlagBits::WAKE_UP);
+void MultihalSensors::queueSensorEventLocked(const Event& event) {
+    m_pendingWakeup = m_pendingWakeup ||
+        (getSensorInfoByHandle(event.sensorHandle)->flags &
+         static_cast<uint32_t>(SensorFlagBits::WAKE_UP));
+    m_pendingEvents.push_back(event);
+}
 
-    m_halProxyCallback->postEvents(
-        {event},
-        m_halProxyCallback->createScopedWakelock(isWakeupEvent));
+void MultihalSensors::queueSensorEventsLocked(const std::vector<Event>& events) {
+    for (const Event& event : events) {
+        queueSensorEventLocked(event);
+    }
+}
+
+// Posts everything queued so far in one call with one wakelock. m_apiMtx
+// is not held across the binder call, m_postMtx keeps the batches posted
+// from different threads in order.
+void MultihalSensors::postPendingEvents() {
+    std::unique_lock<std::mutex> postLock(m_postMtx);
+
+    bool isWakeupEvent;
+    sp<IHalProxyCallback> halProxyCallback;
+    {
+        std::unique_lock<std::mutex> lock(m_apiMtx);
+        if (m_pendingEvents.empty()) {
+            return;
+        }
+
+        m_postingEvents.swap(m_pendingEvents);
+        isWakeupEvent = m_pendingWakeup;
+        m_pendingWakeup = false;
+        halProxyCallback = m_halProxyCallback;
+    }
+
+    postEventsToHalProxy(halProxyCallback, m_postingEvents, isWakeupEvent);
+
+    ++m_postCount;
+    m_postedEventCount += m_postingEvents.size();
+    m_postingEvents.clear();
+}
+
+void MultihalSensors::postEventsToHalProxy(const sp<IHalProxyCallback>& halProxyCallback,
+                                           const std::vector<Event>& events,
+                                           const bool isWakeupEvent) {
+    halProxyCallback->postEvents(events,
+                                 halProxyCallback->createScopedWakelock(isWakeupEvent));
+}
+
+// Drops the events that come faster than the sampling period of a
+// continuous sensor or do not change the value of an on change one, and
+// queues the rest into the FIFO of the sensor if it batches.
+void MultihalSensors::batchSensorEventLocked(const Event& event) {
+    SensorState* state = &m_sensors[event.sensorHandle];
+
+    if (state->isContinuous) {
+        if (event.timestamp < state->nextTimestampNs) {
+            return;
+        }
+        // the host period jitters, allow events a little early
+        state->nextTimestampNs = event.timestamp + state->samplingPeriodNs
+                                 - state->samplingPeriodNs / 8;
+    } else {
+        if (approximatelyEqual(state->lastValue, event.u.scalar, 0.001)) {
+            return;
+        }
+        state->lastValue = event.u.scalar;
+    }
+
+    if (state->maxReportLatencyNs == 0) {
+        queueSensorEventLocked(event);
+        return;
+    }
+
+    if (state->fifo.empty()) {
+        state->flushDeadlineNs =
+            ::android::elapsedRealtimeNano() + state->maxReportLatencyNs;
+    }
+    state->fifo.push_back(event);
+    if (state->fifo.size() >= getSensorInfoByHandle(event.sensorHandle)->fifoMaxEventCount) {
+        flushFifoLocked(state);
+    }
+}
+
+void MultihalSensors::flushFifoLocked(SensorState* state) {
+    if (!state->fifo.empty()) {
+        queueSensorEventsLocked(state->fifo);
+        state->fifo.clear();
+    }
+}
+
+// Queues the FIFOs whose report latency has expired, returns the time until
+// the next one does in ms, -1 if no FIFO has events.
+int MultihalSensors::flushExpiredFifos() {
+    std::unique_lock<std::mutex> lock(m_apiMtx);
+
+    const int64_t nowNs = ::android::elapsedRealtimeNano();
+    int64_t nextDeadlineNs = INT64_MAX;
+    for (SensorState& state : m_sensors) {
+        if (state.fifo.empty()) {
+            continue;
+        } else if (state.flushDeadlineNs <= nowNs) {
+            flushFifoLocked(&state);
+        } else {
+            nextDeadlineNs = std::min(nextDeadlineNs, state.flushDeadlineNs);
+        }
+    }
+
+    if (nextDeadlineNs == INT64_MAX) {
+        return -1;
+    } else {
+        return (nextDeadlineNs - nowNs + 999999) / 1000000;
+    }
+}
+
+// Feeds the inputs of the virtual sensors into m_fusion, an accelerometer
+// event makes an event for each active virtual sensor. They are batched and
+// dropped as the physical ones.
+void MultihalSensors::fuseSensorEventLocked(const Event& event) {
+    const SensorFusion::Vec3 v = {event.u.vec3.x, event.u.vec3.y, event.u.vec3.z};
+    switch (event.sensorHandle) {
+    case kSensorHandleAccelerometer:
+        m_fusion.onAccelerometer(v);
+        break;
+    case kSensorHandleGyroscope:
+        m_fusion.onGyroscope(v, event.timestamp);
+        return;
+    case kSensorHandleMagneticField:
+        m_fusion.onMagneticField(v);
+        return;
+    default:
+        return;
+    }
+
+    Event fused;
+    fused.timestamp = event.timestamp;
+
+    if (m_activeSensors[kSensorHandleRotationVector] && m_fusion.hasRotation()) {
+        const SensorFusion::Quaternion q = m_fusion.getRotationVector();
+        fused.sensorHandle = kSensorHandleRotationVector;
+        fused.sensorType = SensorType::ROTATION_VECTOR;
+        fused.u.data[0] = q.x;
+        fused.u.data[1] = q.y;
+        fused.u.data[2] = q.z;
+        fused.u.data[3] = q.w;
+        fused.u.data[4] = kRotationVectorHeadingAccuracyRad;
+        batchSensorEventLocked(fused);
+    }
+
+    if (!m_fusion.hasGameRotation()) {
+        return;
+    }
+
+    if (m_activeSensors[kSensorHandleGameRotationVector]) {
+        const SensorFusion::Quaternion q = m_fusion.getGameRotationVector();
+        fused.sensorHandle = kSensorHandleGameRotationVector;
+        fused.sensorType = SensorType::GAME_ROTATION_VECTOR;
+        fused.u.vec4.x = q.x;
+        fused.u.vec4.y = q.y;
+        fused.u.vec4.z = q.z;
+        fused.u.vec4.w = q.w;
+        batchSensorEventLocked(fused);
+    }
+
+    if (m_activeSensors[kSensorHandleGravity]) {
+        const SensorFusion::Vec3 g = m_fusion.getGravity();
+        fused.sensorHandle = kSensorHandleGravity;
+        fused.sensorType = SensorType::GRAVITY;
+        fused.u.vec3.x = g.x;
+        fused.u.vec3.y = g.y;
+        fused.u.vec3.z = g.z;
+        fused.u.vec3.status = event.u.vec3.status;
+        batchSensorEventLocked(fused);
+    }
+
+    if (m_activeSensors[kSensorHandleLinearAcceleration]) {
+        const SensorFusion::Vec3 a = m_fusion.getLinearAcceleration();
+        fused.sensorHandle = kSensorHandleLinearAcceleration;
+        fused.sensorType = SensorType::LINEAR_ACCELERATION;
+        fused.u.vec3.x = a.x;
+        fused.u.vec3.y = a.y;
+        fused.u.vec3.z = a.z;
+        fused.u.vec3.status = event.u.vec3.status;
+        batchSensorEventLocked(fused);
+    }
+}
+
+void MultihalSensors::writeDirectReportsLocked(const Event& event) {
+    for (auto& [channelHandle, state] : m_directChannels) {
+        for (DirectReport& report : state.reports) {
+            if ((report.sensorHandle != event.sensorHandle) ||
+                    (event.timestamp < report.nextTimestampNs)) {
+                continue;
+            }
+
+            report.nextTimestampNs = event.timestamp + report.periodNs
+                                     - report.periodNs / 8;
+            state.channel->write(event, report.reportToken);
+        }
+    }
+}
+
+SensorMask MultihalSensors::getDirectSensorsLocked() const {
+    SensorMask sensors;
+    for (const auto& [channelHandle, state] : m_directChannels) {
+        for (const DirectReport& report : state.reports) {
+            sensors.set(report.sensorHandle);
+        }
+    }
+    return sensors;
 }
 
 bool MultihalSensors::qemuSensorThreadSendCommand(const char cmd) const {
     return TEMP_FAILURE_RETRY(write(m_callersFd.get(), &cmd, 1)) == 1;
 }
 
-/// not supported //////////////////////////////////////////////////////////////
+/// direct channels ////////////////////////////////////////////////////////////
 Return<void> MultihalSensors::registerDirectChannel(const SharedMemInfo& mem,
                                                     registerDirectChannel_cb _hidl_cb) {
-    (void)mem;
-    _hidl_cb(Result::INVALID_OPERATION, -1);
+    if ((mem.type != SharedMemType::ASHMEM) && (mem.type != SharedMemType::GRALLOC)) {
+        _hidl_cb(Result::INVALID_OPERATION, -1);
+        return {};
+    }
+
+    std::unique_ptr<DirectChannel> channel = DirectChannel::create(mem);
+    if (!channel) {
+        _hidl_cb(Result::BAD_VALUE, -1);
+        return {};
+    }
+
+    std::unique_lock<std::mutex> lock(m_apiMtx);
+    const int32_t channelHandle = m_nextDirectChannelHandle++;
+    m_directChannels[channelHandle].channel = std::move(channel);
+    lock.unlock();
+
+    _hidl_cb(Result::OK, channelHandle);
     return {};
 }
 
-Return<Result> MultihalSensors::unregisterDirectChannel(int32_t channelHandle) {
-    (void)channelHandle;
-    return Result::INVALID_OPERATION;
+Return<Result> MultihalSensors::unregisterDirectChannel(const int32_t channelHandle) {
+    std::unique_lock<std::mutex> lock(m_apiMtx);
+
+    const auto i = m_directChannels.find(channelHandle);
+    if (i == m_directChannels.end()) {
+        return Result::BAD_VALUE;
+    }
+
+    // the listener thread writes the channel under m_apiMtx, it is safe to
+    // unmap it here
+    m_directChannels.erase(i);
+    setEnabledSensorsLocked(m_activeSensors, getDirectSensorsLocked());
+    return Result::OK;
 }
 
-Return<void> MultihalSensors::configDirectReport(int32_t sensorHandle,
-                                                 int32_t channelHandle,
-                                                 RateLevel rate,
+Return<void> MultihalSensors::configDirectReport(const int32_t sensorHandle,
+                                                 const int32_t channelHandle,
+                                                 const RateLevel rate,
                                                  configDirectReport_cb _hidl_cb) {
-    (void)sensorHandle;
-    (void)channelHandle;
-    (void)rate;
-    _hidl_cb(Result::INVALID_OPERATION, 0 /* reportToken */);
+    std::unique_lock<std::mutex> lock(m_apiMtx);
+
+    const auto i = m_directChannels.find(channelHandle);
+    if (i == m_directChannels.end()) {
+        _hidl_cb(Result::BAD_VALUE, 0 /* reportToken */);
+        return {};
+    }
+    DirectChannelState* state = &i->second;
+    const std::vector<DirectReport> oldReports = state->reports;
+
+    // -1 stops all the sensors of the channel
+    if (sensorHandle == -1) {
+        if (rate != RateLevel::STOP) {
+            _hidl_cb(Result::BAD_VALUE, 0 /* reportToken */);
+            return {};
+        }
+        state->reports.clear();
+    } else {
+        const SensorInfo* sensor = getSensorInfoByHandle(sensorHandle);
+        const uint32_t channelFlag = static_cast<uint32_t>(
+            (state->channel->getType() == SharedMemType::ASHMEM)
+                ? SensorFlagBits::DIRECT_CHANNEL_ASHMEM
+                : SensorFlagBits::DIRECT_CHANNEL_GRALLOC);
+        if (!sensor || !(sensor->flags & channelFlag) ||
+                (static_cast<uint32_t>(rate) > getMaxDirectRateLevel(*sensor))) {
+            _hidl_cb(Result::BAD_VALUE, 0 /* reportToken */);
+            return {};
+        }
+
+        auto report = std::find_if(state->reports.begin(), state->reports.end(),
+                                   [sensorHandle](const DirectReport& r) {
+                                       return r.sensorHandle == sensorHandle;
+                                   });
+        if (rate == RateLevel::STOP) {
+            if (report != state->reports.end()) {
+                state->reports.erase(report);
+            }
+        } else {
+            if (report == state->reports.end()) {
+                report = state->reports.insert(state->reports.end(), DirectReport{
+                    .sensorHandle = sensorHandle,
+                    .reportToken = m_nextReportToken++,
+                });
+            }
+            report->periodNs = getDirectReportPeriodNs(*sensor, rate);
+            report->nextTimestampNs = 0;
+        }
+    }
+
+    if (!setEnabledSensorsLocked(m_activeSensors, getDirectSensorsLocked())) {
+        state->reports = oldReports;
+        _hidl_cb(Result::INVALID_OPERATION, 0 /* reportToken */);
+        return {};
+    }
+
+    int32_t reportToken = 0;
+    for (const DirectReport& report : state->reports) {
+        if (report.sensorHandle == sensorHandle) {
+            reportToken = report.reportToken;
+        }
+    }
+    lock.unlock();
+
+    _hidl_cb(Result::OK, reportToken);
     return {};
 }
 
@@ -17,8 +17,17 @@
 #pragma once
 #include <android-base/unique_fd.h>
 #include <V2_1/SubHal.h>
+#include <array>
+#include <bitset>
 #include <cstdint>
+#include <map>
+#include <memory>
 #include <thread>
+#include <vector>
+#include "direct_channel.h"
+#include "host_clock_model.h"
+#include "sensor_fusion.h"
+#include "sensor_list.h"
 
 namespace goldfish {
 namespace ahs = ::android::hardware::sensors;
@@ -31,6 +40,7 @@ using ahs10::OperationMode;
 using ahs10::RateLevel;
 using ahs10::Result;
 using ahs10::SharedMemInfo;
+using ahs10::SharedMemType;
 
 using ::android::base::unique_fd;
 using ::android::hardware::hidl_handle;
@@ -41,6 +51,8 @@ using ::android::sp;
 
 struct MultihalSensors : public ahs21::implementation::ISensorsSubHal {
     MultihalSensors();
+    // talks to the host through qemuSensorsFd instead of the qemud channel
+    explicit MultihalSensors(unique_fd qemuSensorsFd);
     ~MultihalSensors();
 
     Return<void> debug(const hidl_handle& fd, const hidl_vec<hidl_string>& args) override;
@@ -65,47 +77,130 @@ struct MultihalSensors : public ahs21::implementation::ISensorsSubHal {
     const std::string getName() override;
     Return<Result> initialize(const sp<IHalProxyCallback>& halProxyCallback) override;
 
+protected:
+    // Stops and joins the listener thread, no events are posted after it
+    // returns. A subclass overriding postEventsToHalProxy calls it in its
+    // destructor, the base destructor only stops a thread still running.
+    void stop();
+
+    // the listener thread posts a batch of events, sensors_trace overrides it
+    virtual void postEventsToHalProxy(const sp<IHalProxyCallback>& halProxyCallback,
+                                      const std::vector<Event>& events,
+                                      bool isWakeupEvent);
+
 private:
     struct QemuSensorsProtocolState {
         int64_t timeBiasNs = -500000000;
 
+        // Once the host is seen sending "sync:<host sample time>" after the
+        // values, the events wait for it to be stamped through m_hostClock.
+        // A sample has at most one value per sensor; if more pile up, or no
+        // sync comes within kSyncTimeoutNs, they are posted with the receive
+        // time and the events stop waiting until the next sync.
+        static constexpr int kMaxSyncPendingEvents = kSensorNumber;
+        static constexpr int64_t kSyncTimeoutNs = 200000000;
+        bool hostSendsSync = false;
+        int syncPendingEventCount = 0;
+        Event syncPendingEvents[kMaxSyncPendingEvents];
+        int64_t syncDeadlineNs = 0;     // if syncPendingEventCount > 0
+        int64_t lastTimestampNs = 0;    // the events do not go backwards
+    };
+
+    // The runtime state of a sensor, m_sensors has one per handle.
+    struct SensorState {
         static constexpr float kSensorNoValue = -1e+30;
 
-        // on change sensors (host does not support them)
-        float lastAmbientTemperatureValue = kSensorNoValue;
-        float lastProximityValue = kSensorNoValue;
-        float lastLightValue = kSensorNoValue;
-        float lastRelativeHumidityValue = kSensorNoValue;
-        float lastHingeAngle0Value = kSensorNoValue;
-        float lastHingeAngle1Value = kSensorNoValue;
-        float lastHingeAngle2Value = kSensorNoValue;
+        // batch(): a sensor reports no faster than samplingPeriodNs (the host
+        // streams at the fastest rate asked, the extra events are dropped
+        // here) and its events wait in the FIFO for up to maxReportLatencyNs.
+        int64_t samplingPeriodNs = 0;
+        int64_t maxReportLatencyNs = 0;
+        int64_t nextTimestampNs = 0;    // events before it are dropped
+        int64_t flushDeadlineNs = 0;    // if the FIFO is not empty
+        std::vector<Event> fifo;
+
+        // on change sensors (the host does not support them): the events
+        // that do not change lastValue are dropped
+        bool isContinuous = true;
+        float lastValue = kSensorNoValue;
+    };
+
+    // configDirectReport(): the listener thread writes the events of the
+    // sensor into the channel, no faster than periodNs.
+    struct DirectReport {
+        int32_t sensorHandle;
+        int32_t reportToken;
+        int64_t periodNs = 0;
+        int64_t nextTimestampNs = 0;
+    };
+
+    struct DirectChannelState {
+        std::unique_ptr<DirectChannel> channel;
+        std::vector<DirectReport> reports;
     };
 
     static bool activateQemuSensorImpl(int pipe, int sensorHandle, bool enabled);
     bool disableAllSensors();
+    bool setEnabledSensorsLocked(const SensorMask& activeSensors,
+                                 const SensorMask& directSensors);
+    SensorMask getDirectSensorsLocked() const;
+    bool setHostDelayLocked();
     void parseQemuSensorEvent(const int pipe, QemuSensorsProtocolState* state);
+    bool parseQemuSensorMessage(const char* msg, const char* end, int64_t nowNs,
+                                QemuSensorsProtocolState* state);
+    void onHostSync(int64_t hostNs, int64_t nowNs, QemuSensorsProtocolState* state);
+    void stopWaitingForHostSync(QemuSensorsProtocolState* state);
+    int expireSyncPendingEvents(QemuSensorsProtocolState* state);
+    void postQemuSensorEvent(Event event, QemuSensorsProtocolState* state);
     void postSensorEvent(const Event& event);
-    void postSensorEventLocked(const Event& event);
+    void queueSensorEventLocked(const Event& event);
+    void queueSensorEventsLocked(const std::vector<Event>& events);
+    void postPendingEvents();
+    void batchSensorEventLocked(const Event& event);
+    void fuseSensorEventLocked(const Event& event);
+    void writeDirectReportsLocked(const Event& event);
+    void flushFifoLocked(SensorState* sensor);
+    int flushExpiredFifos();
 
     void qemuSensorListenerThread();
     static void qemuSensorListenerThreadStart(MultihalSensors* that);
 
     static constexpr char kCMD_QUIT = 'q';
+    static constexpr int kMaxMessagesPerBurst = 64;
     bool qemuSensorThreadSendCommand(char cmd) const;
 
     // set in ctor, never change
     const unique_fd     m_qemuSensorsFd;
-    uint32_t            m_availableSensorsMask = 0;
+    SensorMask          m_availableSensors;
+    SensorMask          m_virtualSensors;
     // a pair of connected sockets to talk to the worker thread
     unique_fd           m_callersFd;        // a caller writes here
     unique_fd           m_sensorThreadFd;   // the worker thread listens from here
     std::thread         m_sensorThread;
 
+    // the listener thread updates it, debug() dumps it
+    HostClockModel      m_hostClock;
+
     // changed by API
-    uint32_t                m_activeSensorsMask = 0;
+    SensorMask              m_activeSensors;    // activate()
+    SensorMask              m_directSensors;    // configDirectReport()
+    std::array<SensorState, kSensorNumber> m_sensors;   // by sensor handle
+    SensorFusion            m_fusion;   // while a virtual sensor is active
+    std::map<int32_t, DirectChannelState> m_directChannels;   // by channel handle
+    int32_t                 m_nextDirectChannelHandle = 1;
+    int32_t                 m_nextReportToken = 1;
+    int                     m_hostDelayMs = -1;
     OperationMode           m_opMode = OperationMode::NORMAL;
     sp<IHalProxyCallback>   m_halProxyCallback;
+    std::vector<Event>      m_pendingEvents;    // the next postEvents call
+    bool                    m_pendingWakeup = false;
     mutable std::mutex      m_apiMtx;
+
+    // the batch being posted, see postPendingEvents
+    std::vector<Event>      m_postingEvents;
+    uint64_t                m_postCount = 0;
+    uint64_t                m_postedEventCount = 0;
+    mutable std::mutex      m_postMtx;
 };
 
 }  // namespace goldfish
@@ -15,7 +15,9 @@
  */
 
 #include <log/log.h>
+#include <poll.h>
 #include <sys/epoll.h>
+#include <algorithm>
 #include "multihal_sensors.h"
 
 namespace goldfish {
@@ -28,6 +30,11 @@ int epollCtlAdd(int epollFd, int fd) {
     return TEMP_FAILURE_RETRY(epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev));
 }
 
+bool isReadable(const int fd) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN, .revents = 0};
+    return (TEMP_FAILURE_RETRY(poll(&pfd, 1, 0)) == 1) && (pfd.revents & POLLIN);
+}
+
 int qemuSensortThreadRcvCommand(const int fd) {
     char buf;
     if (TEMP_FAILURE_RETRY(read(fd, &buf, 1)) == 1) {
@@ -57,9 +64,22 @@ void MultihalSensors::qemuSensorListenerThread() {
     while (true) {
         struct epoll_event events[2];
         const int kTimeoutMs = 60000;
+        const int syncTimeoutMs = expireSyncPendingEvents(&protocolState);
+        const int fifoTimeoutMs = flushExpiredFifos();
+
+        // everything parsed since the last post goes in one postEvents call
+        postPendingEvents();
+
+        int timeoutMs = kTimeoutMs;
+        if (syncTimeoutMs >= 0) {
+            timeoutMs = std::min(timeoutMs, syncTimeoutMs);
+        }
+        if (fifoTimeoutMs >= 0) {
+            timeoutMs = std::min(timeoutMs, fifoTimeoutMs);
+        }
+
         const int n = TEMP_FAILURE_RETRY(epoll_wait(epollFd.get(),
-                                                    events, 2,
-                                                    kTimeoutMs));
+                                                    events, 2, timeoutMs));
         if (n < 0) {
             ALOGE("%s:%d: epoll_wait failed with '%s'",
                   __func__, __LINE__, strerror(errno));
@@ -77,7 +97,12 @@ void MultihalSensors::qemuSensorListenerThread() {
                           __func__, __LINE__, ev_events);
                     ::abort();
                 } else if (ev_events & EPOLLIN) {
-                    parseQemuSensorEvent(m_qemuSensorsFd.get(), &protocolState);
+                    // the host sends the values of a sample as a burst of
+                    // messages, drain it before posting
+                    int burstLeft = kMaxMessagesPerBurst;
+                    do {
+                        parseQemuSensorEvent(m_qemuSensorsFd.get(), &protocolState);
+                    } while ((--burstLeft > 0) && isReadable(m_qemuSensorsFd.get()));
                 }
             } else if (fd == m_sensorThreadFd.get()) {
                 if (ev_events & (EPOLLERR | EPOLLHUP)) {
@@ -16,8 +16,9 @@
 
 #include <log/log.h>
 #include <utils/SystemClock.h>
-#include <math.h>
 #include <qemud.h>
+#include <stdlib.h>
+#include <string.h>
 #include "multihal_sensors.h"
 #include "sensor_list.h"
 
@@ -27,23 +28,193 @@ using ahs21::SensorType;
 using ahs10::SensorStatus;
 
 namespace {
-const char* testPrefix(const char* i, const char* end, const char* v, const char sep) {
-    while (i < end) {
-        if (*v == 0) {
-            return (*i == sep) ? (i + 1) : nullptr;
-        } else if (*v == *i) {
-            ++v;
+enum class QemuMessageKind { VEC3, UNCAL, SCALAR, GUEST_SYNC, SYNC };
+
+struct QemuMessageDescriptor {
+    const char* name;
+    QemuMessageKind kind;
+    int sensorHandle;
+    SensorType sensorType;
+    SensorStatus status;
+};
+
+enum QemuMessage {
+    kAcceleration, kGyroscope, kGyroscopeUncalibrated, kOrientation,
+    kMagnetic, kMagneticUncalibrated, kTemperature, kProximity, kLight,
+    kPressure, kHumidity, kHingeAngle0, kHingeAngle1, kHingeAngle2,
+    kGuestSync, kSync, kQemuMessageCount
+};
+
+// in the order of QemuMessage
+constexpr QemuMessageDescriptor kQemuMessages[] = {
+    {"acceleration", QemuMessageKind::VEC3, kSensorHandleAccelerometer,
+     SensorType::ACCELEROMETER, SensorStatus::ACCURACY_MEDIUM},
+    {"gyroscope", QemuMessageKind::VEC3, kSensorHandleGyroscope,
+     SensorType::GYROSCOPE, SensorStatus::ACCURACY_MEDIUM},
+    {"gyroscope-uncalibrated", QemuMessageKind::UNCAL, kSensorHandleGyroscopeFieldUncalibrated,
+     SensorType::GYROSCOPE_UNCALIBRATED, SensorStatus::ACCURACY_MEDIUM},
+    {"orientation", QemuMessageKind::VEC3, kSensorHandleOrientation,
+     SensorType::ORIENTATION, SensorStatus::ACCURACY_HIGH},
+    {"magnetic", QemuMessageKind::VEC3, kSensorHandleMagneticField,
+     SensorType::MAGNETIC_FIELD, SensorStatus::ACCURACY_HIGH},
+    {"magnetic-uncalibrated", QemuMessageKind::UNCAL, kSensorHandleMagneticFieldUncalibrated,
+     SensorType::MAGNETIC_FIELD_UNCALIBRATED, SensorStatus::ACCURACY_HIGH},
+    {"temperature", QemuMessageKind::SCALAR, kSensorHandleAmbientTemperature,
+     SensorType::AMBIENT_TEMPERATURE, SensorStatus::ACCURACY_HIGH},
+    {"proximity", QemuMessageKind::SCALAR, kSensorHandleProximity,
+     SensorType::PROXIMITY, SensorStatus::ACCURACY_HIGH},
+    {"light", QemuMessageKind::SCALAR, kSensorHandleLight,
+     SensorType::LIGHT, SensorStatus::ACCURACY_HIGH},
+    {"pressure", QemuMessageKind::SCALAR, kSensorHandlePressure,
+     SensorType::PRESSURE, SensorStatus::ACCURACY_HIGH},
+    {"humidity", QemuMessageKind::SCALAR, kSensorHandleRelativeHumidity,
+     SensorType::RELATIVE_HUMIDITY, SensorStatus::ACCURACY_HIGH},
+    {"hinge-angle0", QemuMessageKind::SCALAR, kSensorHandleHingeAngle0,
+     SensorType::HINGE_ANGLE, SensorStatus::ACCURACY_HIGH},
+    {"hinge-angle1", QemuMessageKind::SCALAR, kSensorHandleHingeAngle1,
+     SensorType::HINGE_ANGLE, SensorStatus::ACCURACY_HIGH},
+    {"hinge-angle2", QemuMessageKind::SCALAR, kSensorHandleHingeAngle2,
+     SensorType::HINGE_ANGLE, SensorStatus::ACCURACY_HIGH},
+    {"guest-sync", QemuMessageKind::GUEST_SYNC, -1,
+     SensorType::META_DATA, SensorStatus::UNRELIABLE},
+    {"sync", QemuMessageKind::SYNC, -1,
+     SensorType::META_DATA, SensorStatus::UNRELIABLE},
+};
+static_assert(sizeof(kQemuMessages) / sizeof(kQemuMessages[0]) == kQemuMessageCount);
+
+// The only candidate for a name is picked by its length and one character,
+// one memcmp confirms it.
+const QemuMessageDescriptor* findQemuMessage(const char* name, const size_t len) {
+    int candidate;
+    switch (len) {
+    case 4:  candidate = kSync; break;
+    case 5:  candidate = kLight; break;
+    case 8:
+        switch (name[0]) {
+        case 'm':   candidate = kMagnetic; break;
+        case 'p':   candidate = kPressure; break;
+        default:    candidate = kHumidity; break;
+        }
+        break;
+    case 9:  candidate = (name[0] == 'g') ? kGyroscope : kProximity; break;
+    case 10: candidate = kGuestSync; break;
+    case 11: candidate = (name[0] == 'o') ? kOrientation : kTemperature; break;
+    case 12:
+        switch (name[11]) {
+        case '0':   candidate = kHingeAngle0; break;
+        case '1':   candidate = kHingeAngle1; break;
+        case '2':   candidate = kHingeAngle2; break;
+        default:    candidate = kAcceleration; break;
+        }
+        break;
+    case 21: candidate = kMagneticUncalibrated; break;
+    case 22: candidate = kGyroscopeUncalibrated; break;
+    default: return nullptr;
+    }
+
+    const QemuMessageDescriptor* desc = &kQemuMessages[candidate];
+    return memcmp(desc->name, name, len) ? nullptr : desc;
+}
+
+// The host prints the values with %g: [-]digits[.digits][e[+-]digits].
+// Anything else (nan, inf, too many digits) goes to strtof.
+const char* parseFloat(const char* i, const char* end, float* value) {
+    static constexpr double kPow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+    };
+    constexpr int kMaxPow10 = sizeof(kPow10) / sizeof(kPow10[0]) - 1;
+    constexpr int kMaxDigits = 19;  // fit in uint64_t
+
+    const char* const begin = i;
+    const bool negative = (i < end) && (*i == '-');
+    if (negative) {
+        ++i;
+    }
+
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    for (; (i < end) && (*i >= '0') && (*i <= '9'); ++i, ++digits) {
+        mantissa = mantissa * 10 + (*i - '0');
+    }
+    if ((i < end) && (*i == '.')) {
+        for (++i; (i < end) && (*i >= '0') && (*i <= '9'); ++i, ++digits) {
+            mantissa = mantissa * 10 + (*i - '0');
+            --exponent;
+        }
+    }
+    if ((i < end) && ((*i == 'e') || (*i == 'E'))) {
+        ++i;
+        const bool negativeExp = (i < end) && (*i == '-');
+        if ((i < end) && ((*i == '-') || (*i == '+'))) {
+            ++i;
+        }
+        int e = 0;
+        for (; (i < end) && (*i >= '0') && (*i <= '9') && (e < 1000); ++i) {
+            e = e * 10 + (*i - '0');
+        }
+        exponent += negativeExp ? -e : e;
+    }
+
+    const bool delimited = (i == end) || (*i == ':');
+    if ((digits == 0) || (digits > kMaxDigits) || !delimited ||
+            (exponent < -kMaxPow10) || (exponent > kMaxPow10)) {
+        char tmp[64];
+        const size_t len = std::min(size_t(end - begin), sizeof(tmp) - 1);
+        memcpy(tmp, begin, len);
+        tmp[len] = 0;
+        char* tmpEnd;
+        *value = strtof(tmp, &tmpEnd);
+        return (tmpEnd == tmp) ? nullptr : (begin + (tmpEnd - tmp));
+    }
+
+    const double v = (exponent < 0) ? (mantissa / kPow10[-exponent])
+                                    : (mantissa * kPow10[exponent]);
+    *value = negative ? -v : v;
+    return i;
+}
+
+// Parses up to n values separated by ':', returns how many it did.
+int parseFloats(const char* i, const char* end, float* values, const int n) {
+    for (int k = 0; k < n; ++k) {
+        i = parseFloat(i, end, &values[k]);
+        if (!i) {
+            return k;
+        } else if ((i < end) && (*i == ':')) {
             ++i;
         } else {
-            return nullptr;
+            return k + 1;
         }
     }
+    return n;
+}
 
-    return nullptr;
+bool parseInt64(const char* i, const char* end, int64_t* value) {
+    int64_t v = 0;
+    const char* const begin = i;
+    for (; (i < end) && (*i >= '0') && (*i <= '9') && (v < INT64_MAX / 100); ++i) {
+        v = v * 10 + (*i - '0');
+    }
+    *value = v;
+    return i > begin;
 }
 
-bool approximatelyEqual(double a, double b, double eps) {
-    return fabs(a - b) <= std::max(fabs(a), fabs(b)) * eps;
+// The sensors to stream from the host: the enabled physical sensors and the
+// inputs of the enabled virtual ones.
+SensorMask getHostSensors(const SensorMask& enabledSensors) {
+    SensorMask hostSensors;
+    for (int i = 0; i < kSensorNumber; ++i) {
+        if (enabledSensors[i]) {
+            const SensorMask& inputs = getVirtualSensorInputs(i);
+            if (inputs.any()) {
+                hostSensors |= inputs;
+            } else {
+                hostSensors[i] = true;
+            }
+        }
+    }
+    return hostSensors;
 }
 
 int64_t weigthedAverage(const int64_t a, int64_t aw, int64_t b, int64_t bw) {
@@ -71,9 +242,9 @@ bool MultihalSensors::activateQemuSensorImpl(const int pipe,
 
 bool MultihalSensors::disableAllSensors() {
     if (m_opMode == OperationMode::NORMAL) {
-        uint32_t mask = m_activeSensorsMask;
-        for (int i = 0; mask; ++i, mask >>= 1) {
-            if (mask & 1) {
+        const SensorMask hostSensors = getHostSensors(m_activeSensors | m_directSensors);
+        for (int i = 0; i < kSensorNumber; ++i) {
+            if (hostSensors[i]) {
                 if (!activateQemuSensorImpl(m_qemuSensorsFd.get(), i, false)) {
                     return false;
                 }
@@ -81,200 +252,243 @@ bool MultihalSensors::disableAllSensors() {
         }
     }
 
-    m_activeSensorsMask = 0;
+    for (SensorState& state : m_sensors) {
+        state.fifo.clear();
+    }
+
+    m_activeSensors.reset();
+    m_directSensors.reset();
+    m_directChannels.clear();
+    return true;
+}
+
+// The host streams a sensor while it is active, reports to a direct
+// channel or is an input of an active virtual sensor.
+bool MultihalSensors::setEnabledSensorsLocked(const SensorMask& activeSensors,
+                                              const SensorMask& directSensors) {
+    if (m_opMode == OperationMode::NORMAL) {
+        const SensorMask hostSensors = getHostSensors(activeSensors | directSensors);
+        const SensorMask changedSensors =
+            hostSensors ^ getHostSensors(m_activeSensors | m_directSensors);
+        for (int i = 0; i < kSensorNumber; ++i) {
+            if (changedSensors[i]) {
+                if (!activateQemuSensorImpl(m_qemuSensorsFd.get(), i, hostSensors[i])) {
+                    return false;
+                }
+            }
+        }
+    }
+
+    m_activeSensors = activeSensors;
+    m_directSensors = directSensors;
+    if (m_opMode == OperationMode::NORMAL) {
+        setHostDelayLocked();
+    }
+    return true;
+}
+
+// The host streams all the sensors at one rate: the fastest sampling period
+// of the active continuous sensors and of the direct reports,
+// batchSensorEventLocked and writeDirectReportsLocked drop the extra events
+// of the slower ones.
+bool MultihalSensors::setHostDelayLocked() {
+    int64_t periodNs = INT64_MAX;
+    for (int i = 0; i < kSensorNumber; ++i) {
+        if (m_activeSensors[i] && m_sensors[i].isContinuous) {
+            periodNs = std::min(periodNs, m_sensors[i].samplingPeriodNs);
+        }
+    }
+    for (const auto& [channelHandle, state] : m_directChannels) {
+        for (const DirectReport& report : state.reports) {
+            periodNs = std::min(periodNs, report.periodNs);
+        }
+    }
+    if (periodNs == INT64_MAX) {
+        return true;
+    }
+
+    const int delayMs = std::max(int64_t(1), periodNs / 1000000);
+    if (delayMs == m_hostDelayMs) {
+        return true;
+    }
+
+    char buffer[64];
+    const int len = snprintf(buffer, sizeof(buffer), "set-delay:%d", delayMs);
+    if (qemud_channel_send(m_qemuSensorsFd.get(), buffer, len) < 0) {
+        ALOGE("%s:%d: qemud_channel_send failed", __func__, __LINE__);
+        return false;
+    }
+
+    m_hostDelayMs = delayMs;
     return true;
 }
 
+// A read may return several messages separated by '\n'.
 void MultihalSensors::parseQemuSensorEvent(const int pipe,
                                            QemuSensorsProtocolState* state) {
     char buf[256];
     const int len = qemud_channel_recv(pipe, buf, sizeof(buf) - 1);
     if (len < 0) {
         ALOGE("%s:%d: qemud_channel_recv failed", __func__, __LINE__);
+        return;
     }
     const int64_t nowNs = ::android::elapsedRealtimeNano();
-    buf[len] = 0;
-    const char* end = buf + len;
+    const char* const end = buf + len;
 
-    bool parsed = false;
-    Event event;
-    EventPayload* payload = &event.u;
-    ahs10::Vec3* vec3 = &payload->vec3;
-    ahs10::Uncal* uncal = &payload->uncal;
-
-    if (const char* values = testPrefix(buf, end, "acceleration", ':')) {
-        if (sscanf(values, "%f:%f:%f",
-                   &vec3->x, &vec3->y, &vec3->z) == 3) {
-            vec3->status = SensorStatus::ACCURACY_MEDIUM;
-            event.timestamp = nowNs + state->timeBiasNs;
-            event.sensorHandle = kSensorHandleAccelerometer;
-            event.sensorType = SensorType::ACCELEROMETER;
-            postSensorEvent(event);
-            parsed = true;
-        }
-    } else if (const char* values = testPrefix(buf, end, "gyroscope", ':')) {
-        if (sscanf(values, "%f:%f:%f",
-                   &vec3->x, &vec3->y, &vec3->z) == 3) {
-            vec3->status = SensorStatus::ACCURACY_MEDIUM;
-            event.timestamp = nowNs + state->timeBiasNs;
-            event.sensorHandle = kSensorHandleGyroscope;
-            event.sensorType = SensorType::GYROSCOPE;
-            postSensorEvent(event);
-            parsed = true;
-        }
-    } else if (const char* values = testPrefix(buf, end, "gyroscope-uncalibrated", ':')) {
-        if (sscanf(values, "%f:%f:%f",
-                   &uncal->x, &uncal->y, &uncal->z) == 3) {
-            uncal->x_bias = 0.0;
-            uncal->y_bias = 0.0;
-            uncal->z_bias = 0.0;
-            event.timestamp = nowNs + state->timeBiasNs;
-            event.sensorHandle = kSensorHandleGyroscopeFieldUncalibrated;
-            event.sensorType = SensorType::GYROSCOPE_UNCALIBRATED;
-            postSensorEvent(event);
-            parsed = true;
-        }
-    } else if (const char* values = testPrefix(buf, end, "orientation", ':')) {
-        if (sscanf(values, "%f:%f:%f",
-                   &vec3->x, &vec3->y, &vec3->z) == 3) {
-            vec3->status = SensorStatus::ACCURACY_HIGH;
-            event.timestamp = nowNs + state->timeBiasNs;
-            event.sensorHandle = kSensorHandleOrientation;
-            event.sensorType = SensorType::ORIENTATION;
-            postSensorEvent(event);
-            parsed = true;
-        }
-    } else if (const char* values = testPrefix(buf, end, "magnetic", ':')) {
-        if (sscanf(values, "%f:%f:%f",
-                   &vec3->x, &vec3->y, &vec3->z) == 3) {
-            vec3->status = SensorStatus::ACCURACY_HIGH;
-            event.timestamp = nowNs + state->timeBiasNs;
-            event.sensorHandle = kSensorHandleMagneticField;
-            event.sensorType = SensorType::MAGNETIC_FIELD;
-            postSensorEvent(event);
-            parsed = true;
-        }
-    } else if (const char* values = testPrefix(buf, end, "magnetic-uncalibrated", ':')) {
-        if (sscanf(values, "%f:%f:%f",
-                   &uncal->x, &uncal->y, &uncal->z) == 3) {
-            uncal->x_bias = 0.0;
-            uncal->y_bias = 0.0;
-            uncal->z_bias = 0.0;
-            event.timestamp = nowNs + state->timeBiasNs;
-            event.sensorHandle = kSensorHandleMagneticFieldUncalibrated;
-            event.sensorType = SensorType::MAGNETIC_FIELD_UNCALIBRATED;
-            postSensorEvent(event);
-            parsed = true;
+    for (const char* msg = buf; msg < end; ) {
+        const char* msgEnd = static_cast<const char*>(memchr(msg, '\n', end - msg));
+        if (!msgEnd) {
+            msgEnd = end;
         }
-    } else if (const char* values = testPrefix(buf, end, "temperature", ':')) {
-        if (sscanf(values, "%f", &payload->scalar) == 1) {
-            if (!approximatelyEqual(state->lastAmbientTemperatureValue,
-                                    payload->scalar, 0.001)) {
-                event.timestamp = nowNs + state->timeBiasNs;
-                event.sensorHandle = kSensorHandleAmbientTemperature;
-                event.sensorType = SensorType::AMBIENT_TEMPERATURE;
-                postSensorEvent(event);
-                state->lastAmbientTemperatureValue = payload->scalar;
-            }
-            parsed = true;
-        }
-    } else if (const char* values = testPrefix(buf, end, "proximity", ':')) {
-        if (sscanf(values, "%f", &payload->scalar) == 1) {
-            if (!approximatelyEqual(state->lastProximityValue,
-                                    payload->scalar, 0.001)) {
-                event.timestamp = nowNs + state->timeBiasNs;
-                event.sensorHandle = kSensorHandleProximity;
-                event.sensorType = SensorType::PROXIMITY;
-                postSensorEvent(event);
-                state->lastProximityValue = payload->scalar;
-            }
-            parsed = true;
-        }
-    } else if (const char* values = testPrefix(buf, end, "light", ':')) {
-        if (sscanf(values, "%f", &payload->scalar) == 1) {
-            if (!approximatelyEqual(state->lastLightValue,
-                                    payload->scalar, 0.001)) {
-                event.timestamp = nowNs + state->timeBiasNs;
-                event.sensorHandle = kSensorHandleLight;
-                event.sensorType = SensorType::LIGHT;
-                postSensorEvent(event);
-                state->lastLightValue = payload->scalar;
-            }
-            parsed = true;
-        }
-    } else if (const char* values = testPrefix(buf, end, "pressure", ':')) {
-        if (sscanf(values, "%f", &payload->scalar) == 1) {
-            event.timestamp = nowNs + state->timeBiasNs;
-            event.sensorHandle = kSensorHandlePressure;
-            event.sensorType = SensorType::PRESSURE;
-            postSensorEvent(event);
-            parsed = true;
+
+        if ((msgEnd > msg) && !parseQemuSensorMessage(msg, msgEnd, nowNs, state)) {
+            ALOGW("%s:%d: don't know how to parse '%.*s'",
+                  __func__, __LINE__, int(msgEnd - msg), msg);
         }
-    } else if (const char* values = testPrefix(buf, end, "humidity", ':')) {
-        if (sscanf(values, "%f", &payload->scalar) == 1) {
-            if (!approximatelyEqual(state->lastRelativeHumidityValue,
-                                    payload->scalar, 0.001)) {
-                event.timestamp = nowNs + state->timeBiasNs;
-                event.sensorHandle = kSensorHandleRelativeHumidity;
-                event.sensorType = SensorType::RELATIVE_HUMIDITY;
-                postSensorEvent(event);
-                state->lastRelativeHumidityValue = payload->scalar;
-            }
-            parsed = true;
+        msg = msgEnd + 1;
+    }
+}
+
+bool MultihalSensors::parseQemuSensorMessage(const char* msg, const char* end,
+                                             const int64_t nowNs,
+                                             QemuSensorsProtocolState* state) {
+    const char* values = static_cast<const char*>(memchr(msg, ':', end - msg));
+    if (!values) {
+        return false;
+    }
+    const QemuMessageDescriptor* desc = findQemuMessage(msg, values - msg);
+    if (!desc) {
+        return false;
+    }
+    ++values;
+
+    Event event;
+    EventPayload* payload = &event.u;
+
+    switch (desc->kind) {
+    case QemuMessageKind::VEC3:
+        if (parseFloats(values, end, payload->data, 3) != 3) {
+            return false;
         }
-    } else if (const char* values = testPrefix(buf, end, "hinge-angle0", ':')) {
-        if (sscanf(values, "%f", &payload->scalar) == 1) {
-            if (!approximatelyEqual(state->lastHingeAngle0Value,
-                                    payload->scalar, 0.001)) {
-                event.timestamp = nowNs + state->timeBiasNs;
-                event.sensorHandle = kSensorHandleHingeAngle0;
-                event.sensorType = SensorType::HINGE_ANGLE;
-                postSensorEvent(event);
-                state->lastHingeAngle0Value = payload->scalar;
-            }
-            parsed = true;
+        payload->vec3.status = desc->status;
+        break;
+
+    case QemuMessageKind::UNCAL:
+        if (parseFloats(values, end, payload->data, 3) != 3) {
+            return false;
         }
-    } else if (const char* values = testPrefix(buf, end, "hinge-angle1", ':')) {
-        if (sscanf(values, "%f", &payload->scalar) == 1) {
-            if (!approximatelyEqual(state->lastHingeAngle1Value,
-                                    payload->scalar, 0.001)) {
-                event.timestamp = nowNs + state->timeBiasNs;
-                event.sensorHandle = kSensorHandleHingeAngle1;
-                event.sensorType = SensorType::HINGE_ANGLE;
-                postSensorEvent(event);
-                state->lastHingeAngle1Value = payload->scalar;
-            }
-            parsed = true;
+        payload->uncal.x_bias = 0.0;
+        payload->uncal.y_bias = 0.0;
+        payload->uncal.z_bias = 0.0;
+        break;
+
+    case QemuMessageKind::SCALAR:
+        if (parseFloats(values, end, &payload->scalar, 1) != 1) {
+            return false;
         }
-    } else if (const char* values = testPrefix(buf, end, "hinge-angle2", ':')) {
-        if (sscanf(values, "%f", &payload->scalar) == 1) {
-            if (!approximatelyEqual(state->lastHingeAngle2Value,
-                                    payload->scalar, 0.001)) {
-                event.timestamp = nowNs + state->timeBiasNs;
-                event.sensorHandle = kSensorHandleHingeAngle2;
-                event.sensorType = SensorType::HINGE_ANGLE;
-                postSensorEvent(event);
-                state->lastHingeAngle2Value = payload->scalar;
+        break;
+
+    case QemuMessageKind::GUEST_SYNC: {
+            int64_t guestTimeUs;
+            if (!parseInt64(values, end, &guestTimeUs)) {
+                return false;
             }
-            parsed = true;
-        }
-     } else if (const char* values = testPrefix(buf, end, "guest-sync", ':')) {
-        long long value;
-        if ((sscanf(values, "%lld", &value) == 1) && (value >= 0)) {
-            const int64_t guestTimeNs = static_cast<int64_t>(value * 1000ll);
+            const int64_t guestTimeNs = guestTimeUs * 1000;
             const int64_t timeBiasNs = guestTimeNs - nowNs;
             state->timeBiasNs =
                 std::min(int64_t(0),
                          weigthedAverage(state->timeBiasNs, 3, timeBiasNs, 1));
-            parsed = true;
         }
-    } else if (const char* values = testPrefix(buf, end, "sync", ':')) {
-        parsed = true;
+        return true;
+
+    case QemuMessageKind::SYNC: {
+            int64_t hostTimeUs;
+            if (!parseInt64(values, end, &hostTimeUs)) {
+                return false;
+            }
+            onHostSync(hostTimeUs * 1000, nowNs, state);
+        }
+        return true;
+    }
+
+    // the receive time until the host sample time is known
+    event.timestamp = nowNs + state->timeBiasNs;
+    event.sensorHandle = desc->sensorHandle;
+    event.sensorType = desc->sensorType;
+
+    if (state->hostSendsSync &&
+            (state->syncPendingEventCount == QemuSensorsProtocolState::kMaxSyncPendingEvents)) {
+        ALOGW("%s:%d: %d values without a sync, posting them with the receive time",
+              __func__, __LINE__, state->syncPendingEventCount);
+        stopWaitingForHostSync(state);
+    }
+
+    if (state->hostSendsSync) {
+        if (state->syncPendingEventCount == 0) {
+            state->syncDeadlineNs = nowNs + QemuSensorsProtocolState::kSyncTimeoutNs;
+        }
+        state->syncPendingEvents[state->syncPendingEventCount++] = event;
+    } else {
+        postQemuSensorEvent(event, state);
+    }
+    return true;
+}
+
+// The values before a "sync:" were sampled at its host time, they are
+// stamped with it mapped to the guest clock. The timestamps do not go
+// backwards and are not in the future.
+void MultihalSensors::onHostSync(const int64_t hostNs, const int64_t nowNs,
+                                 QemuSensorsProtocolState* state) {
+    m_hostClock.addSample(hostNs, nowNs);
+    state->hostSendsSync = true;
+
+    const int64_t timestampNs =
+        std::clamp(m_hostClock.toGuestNs(hostNs),
+                   std::min(state->lastTimestampNs + 1, nowNs),
+                   nowNs);
+    state->lastTimestampNs = timestampNs;
+
+    for (int i = 0; i < state->syncPendingEventCount; ++i) {
+        Event* event = &state->syncPendingEvents[i];
+        event->timestamp = timestampNs;
+        postSensorEvent(*event);
     }
+    state->syncPendingEventCount = 0;
+}
 
-    if (!parsed) {
-        ALOGW("%s:%d: don't know how to parse '%s'", __func__, __LINE__, buf);
+// The host stopped sending "sync:", the pending events are posted with
+// their receive time and the next ones do not wait until a sync comes again.
+void MultihalSensors::stopWaitingForHostSync(QemuSensorsProtocolState* state) {
+    state->hostSendsSync = false;
+    for (int i = 0; i < state->syncPendingEventCount; ++i) {
+        postQemuSensorEvent(state->syncPendingEvents[i], state);
     }
+    state->syncPendingEventCount = 0;
+}
+
+// Returns the milliseconds until the pending events time out, or -1.
+int MultihalSensors::expireSyncPendingEvents(QemuSensorsProtocolState* state) {
+    if (state->syncPendingEventCount == 0) {
+        return -1;
+    }
+
+    const int64_t nowNs = ::android::elapsedRealtimeNano();
+    if (state->syncDeadlineNs <= nowNs) {
+        ALOGW("%s:%d: no sync for %d values, posting them with the receive time",
+              __func__, __LINE__, state->syncPendingEventCount);
+        stopWaitingForHostSync(state);
+        return -1;
+    } else {
+        return (state->syncDeadlineNs - nowNs + 999999) / 1000000;
+    }
+}
+
+// The receive time can be behind the host sample time of the events posted
+// before it, it does not go backwards from them.
+void MultihalSensors::postQemuSensorEvent(Event event, QemuSensorsProtocolState* state) {
+    event.timestamp = std::max(event.timestamp, state->lastTimestampNs);
+    state->lastTimestampNs = event.timestamp;
+    postSensorEvent(event);
 }
 
 }  // namespace
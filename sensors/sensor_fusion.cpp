@@ -0,0 +1,203 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cmath>
+#include "sensor_fusion.h"
+
+namespace goldfish {
+
+namespace {
+using Vec3 = SensorFusion::Vec3;
+using Quaternion = SensorFusion::Quaternion;
+
+constexpr float kGravity = 9.80665f;
+// rad/s per unit of error, the tilt and the heading settle in about a second
+constexpr float kKp = 1.0f;
+// the accelerometer is trusted for the tilt while it reads about 1 g
+constexpr float kMinTiltAccel = 0.8f * kGravity;
+constexpr float kMaxTiltAccel = 1.2f * kGravity;
+// a longer gap (the sensors were off) starts over
+constexpr int64_t kMaxGyroPeriodNs = 200000000;
+
+Vec3 add(const Vec3& a, const Vec3& b) {
+    return {a.x + b.x, a.y + b.y, a.z + b.z};
+}
+
+Vec3 scale(const Vec3& a, const float k) {
+    return {a.x * k, a.y * k, a.z * k};
+}
+
+Vec3 cross(const Vec3& a, const Vec3& b) {
+    return {a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x};
+}
+
+float length(const Vec3& a) {
+    return std::sqrt(a.x * a.x + a.y * a.y + a.z * a.z);
+}
+
+bool normalize(Vec3* a) {
+    const float n = length(*a);
+    if (n < 1e-6f) {
+        return false;
+    }
+    *a = scale(*a, 1 / n);
+    return true;
+}
+
+// from the device frame to the world frame
+Vec3 rotate(const Quaternion& q, const Vec3& v) {
+    const Vec3 u = {q.x, q.y, q.z};
+    const Vec3 t = scale(cross(u, v), 2);
+    return add(add(v, scale(t, q.w)), cross(u, t));
+}
+
+// from the world frame to the device frame
+Vec3 rotateInverse(const Quaternion& q, const Vec3& v) {
+    return rotate({q.w, -q.x, -q.y, -q.z}, v);
+}
+
+// The world axes in the device frame are the rows of the rotation matrix.
+Quaternion fromWorldAxes(const Vec3& east, const Vec3& north, const Vec3& up) {
+    const float trace = east.x + north.y + up.z;
+    float s;
+    if (trace > 0) {
+        s = 2 * std::sqrt(1 + trace);
+        return {s / 4, (up.y - north.z) / s, (east.z - up.x) / s, (north.x - east.y) / s};
+    } else if ((east.x > north.y) && (east.x > up.z)) {
+        s = 2 * std::sqrt(1 + east.x - north.y - up.z);
+        return {(up.y - north.z) / s, s / 4, (east.y + north.x) / s, (east.z + up.x) / s};
+    } else if (north.y > up.z) {
+        s = 2 * std::sqrt(1 + north.y - east.x - up.z);
+        return {(east.z - up.x) / s, (east.y + north.x) / s, s / 4, (north.z + up.y) / s};
+    } else {
+        s = 2 * std::sqrt(1 + up.z - east.x - north.y);
+        return {(north.x - east.y) / s, (east.z + up.x) / s, (north.z + up.y) / s, s / 4};
+    }
+}
+
+// the sensor reports the rotation with w >= 0
+Quaternion canonical(const Quaternion& q) {
+    return (q.w < 0) ? Quaternion{-q.w, -q.x, -q.y, -q.z} : q;
+}
+}  // namespace
+
+void SensorFusion::reset() {
+    *this = SensorFusion();
+}
+
+void SensorFusion::onAccelerometer(const Vec3& accel) {
+    m_accel = accel;
+    m_hasAccel = true;
+}
+
+void SensorFusion::onMagneticField(const Vec3& mag) {
+    m_mag = mag;
+    m_hasMag = true;
+}
+
+void SensorFusion::onGyroscope(const Vec3& gyro, const int64_t timestampNs) {
+    const int64_t dtNs = timestampNs - m_gyroTimestampNs;
+    m_gyroTimestampNs = timestampNs;
+    if ((dtNs <= 0) || (dtNs > kMaxGyroPeriodNs)) {
+        m_rotation.isValid = false;
+        m_gameRotation.isValid = false;
+    }
+
+    const float dt = dtNs * 1e-9f;
+    if (m_rotation.isValid) {
+        update(&m_rotation, gyro, dt, true);
+    } else {
+        initialize(&m_rotation, true);
+    }
+    if (m_gameRotation.isValid) {
+        update(&m_gameRotation, gyro, dt, false);
+    } else {
+        initialize(&m_gameRotation, false);
+    }
+}
+
+SensorFusion::Quaternion SensorFusion::getRotationVector() const {
+    return canonical(m_rotation.q);
+}
+
+SensorFusion::Quaternion SensorFusion::getGameRotationVector() const {
+    return canonical(m_gameRotation.q);
+}
+
+SensorFusion::Vec3 SensorFusion::getGravity() const {
+    return scale(rotateInverse(m_gameRotation.q, {0, 0, 1}), kGravity);
+}
+
+SensorFusion::Vec3 SensorFusion::getLinearAcceleration() const {
+    return add(m_accel, scale(getGravity(), -1));
+}
+
+// Starts from the accelerometer and the magnetometer alone, the way
+// SensorManager.getRotationMatrix does. Without the magnetometer the
+// device y axis is taken as north.
+void SensorFusion::initialize(Filter* filter, const bool useMag) const {
+    Vec3 up = m_accel;
+    if (!m_hasAccel || (useMag && !m_hasMag) || !normalize(&up)) {
+        return;
+    }
+
+    Vec3 east = cross(useMag ? m_mag : Vec3{0, 1, 0}, up);
+    if (!normalize(&east)) {
+        if (useMag) {
+            return;
+        }
+        east = cross(Vec3{0, 0, 1}, up);
+        normalize(&east);
+    }
+    const Vec3 north = cross(up, east);
+
+    filter->q = fromWorldAxes(east, north, up);
+    filter->isValid = true;
+}
+
+// One Mahony step: the errors between the measured and the estimated
+// directions of up and of magnetic north bend the rotation rate, which is
+// then integrated.
+void SensorFusion::update(Filter* filter, Vec3 gyro, const float dt,
+                          const bool useMag) const {
+    Quaternion& q = filter->q;
+
+    const float g = length(m_accel);
+    if ((g > kMinTiltAccel) && (g < kMaxTiltAccel)) {
+        const Vec3 up = rotateInverse(q, {0, 0, 1});
+        gyro = add(gyro, scale(cross(scale(m_accel, 1 / g), up), kKp));
+    }
+
+    Vec3 mag = m_mag;
+    if (useMag && normalize(&mag)) {
+        // the field in the world frame, turned to point north
+        const Vec3 h = rotate(q, mag);
+        const Vec3 north = rotateInverse(q, {0, std::hypot(h.x, h.y), h.z});
+        gyro = add(gyro, scale(cross(mag, north), kKp));
+    }
+
+    // q += q * (0, gyro) * dt / 2
+    const Vec3 h = scale(gyro, dt / 2);
+    q = {q.w - q.x * h.x - q.y * h.y - q.z * h.z,
+         q.x + q.w * h.x + q.y * h.z - q.z * h.y,
+         q.y + q.w * h.y - q.x * h.z + q.z * h.x,
+         q.z + q.w * h.z + q.x * h.y - q.y * h.x};
+
+    const float n = std::sqrt(q.w * q.w + q.x * q.x + q.y * q.y + q.z * q.z);
+    q = {q.w / n, q.x / n, q.y / n, q.z / n};
+}
+
+}  // namespace goldfish
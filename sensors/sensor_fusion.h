@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#include <cstdint>
+
+namespace goldfish {
+
+// The attitude of the device for the virtual sensors: the gyroscope is
+// integrated and pulled towards the accelerometer (tilt) and, for the
+// rotation vector, the magnetometer (heading) by a complementary filter
+// (Mahony), a fixed number of operations per event. The game rotation
+// vector ignores the magnetometer, its heading is wherever it started.
+//
+// The quaternions rotate the device frame into the world frame (x east,
+// y north, z up). Called by the listener thread only.
+class SensorFusion {
+public:
+    struct Vec3 {
+        float x, y, z;
+    };
+
+    struct Quaternion {
+        float w, x, y, z;
+    };
+
+    void reset();
+
+    void onAccelerometer(const Vec3& accel);
+    void onMagneticField(const Vec3& mag);
+    void onGyroscope(const Vec3& gyro, int64_t timestampNs);
+
+    bool hasRotation() const { return m_rotation.isValid; }
+    bool hasGameRotation() const { return m_gameRotation.isValid; }
+
+    Quaternion getRotationVector() const;       // needs hasRotation()
+    Quaternion getGameRotationVector() const;   // needs hasGameRotation()
+    Vec3 getGravity() const;                    // needs hasGameRotation()
+    Vec3 getLinearAcceleration() const;         // needs hasGameRotation()
+
+private:
+    struct Filter {
+        Quaternion q;
+        bool isValid = false;
+    };
+
+    void initialize(Filter* filter, bool useMag) const;
+    void update(Filter* filter, Vec3 gyro, float dt, bool useMag) const;
+
+    Filter  m_rotation;
+    Filter  m_gameRotation;
+    Vec3    m_accel;
+    Vec3    m_mag;
+    bool    m_hasAccel = false;
+    bool    m_hasMag = false;
+    int64_t m_gyroTimestampNs = 0;
+};
+
+}  // namespace goldfish
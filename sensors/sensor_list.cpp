@@ -14,14 +14,28 @@
  * limitations under the License.
  */
 
+#include <initializer_list>
 #include "sensor_list.h"
 
 namespace goldfish {
 using ahs::V2_1::SensorType;
+using ahs::V1_0::RateLevel;
 using ahs::V1_0::SensorFlagBits;
+using ahs::V1_0::SensorFlagShift;
 
 constexpr char kAospVendor[] = "The Android Open Source Project";
 
+// Continuous sensors buffer this many events per sensor while batching,
+// see MultihalSensors::batch.
+constexpr uint32_t kFifoMaxEventCount = 300;
+
+// The host streams at up to 100 Hz (minDelay), the NORMAL rate level.
+constexpr uint32_t kDirectReportFlags =
+    (static_cast<uint32_t>(RateLevel::NORMAL) <<
+     static_cast<uint32_t>(SensorFlagShift::DIRECT_REPORT)) |
+    SensorFlagBits::DIRECT_CHANNEL_ASHMEM |
+    SensorFlagBits::DIRECT_CHANNEL_GRALLOC;
+
 const char* const kQemuSensorName[] = {
     "acceleration",
     "gyroscope",
@@ -37,6 +51,34 @@ const char* const kQemuSensorName[] = {
     "hinge-angle0",
     "hinge-angle1",
     "hinge-angle2",
+    nullptr,    // rotation vector
+    nullptr,    // game rotation vector
+    nullptr,    // gravity
+    nullptr,    // linear acceleration
+};
+
+namespace {
+SensorMask makeSensorMask(std::initializer_list<int> handles) {
+    SensorMask mask;
+    for (const int h : handles) {
+        mask[h] = true;
+    }
+    return mask;
+}
+}  // namespace
+
+const SensorMask kAccelGyro =
+    makeSensorMask({kSensorHandleAccelerometer, kSensorHandleGyroscope});
+const SensorMask kAccelGyroMag =
+    makeSensorMask({kSensorHandleAccelerometer, kSensorHandleGyroscope,
+                    kSensorHandleMagneticField});
+
+const SensorMask kVirtualSensorInputs[] = {
+    {}, {}, {}, {}, {}, {}, {}, {}, {}, {}, {}, {}, {}, {},
+    kAccelGyroMag,  // rotation vector
+    kAccelGyro,     // game rotation vector
+    kAccelGyro,     // gravity
+    kAccelGyro,     // linear acceleration
 };
 
 const SensorInfo kAllSensors[] = {
@@ -52,11 +94,12 @@ const SensorInfo kAllSensors[] = {
         .power = 3.0,
         .minDelay = 10000,
         .fifoReservedEventCount = 0,
-        .fifoMaxEventCount = 0,
+        .fifoMaxEventCount = kFifoMaxEventCount,
         .requiredPermission = "",
         .maxDelay = 500000,
         .flags = SensorFlagBits::DATA_INJECTION |
-                 SensorFlagBits::CONTINUOUS_MODE
+                 SensorFlagBits::CONTINUOUS_MODE |
+                 kDirectReportFlags
     },
     {
         .sensorHandle = kSensorHandleGyroscope,
@@ -70,11 +113,12 @@ const SensorInfo kAllSensors[] = {
         .power = 3.0,
         .minDelay = 10000,
         .fifoReservedEventCount = 0,
-        .fifoMaxEventCount = 0,
+        .fifoMaxEventCount = kFifoMaxEventCount,
         .requiredPermission = "",
         .maxDelay = 500000,
         .flags = SensorFlagBits::DATA_INJECTION |
-                 SensorFlagBits::CONTINUOUS_MODE
+                 SensorFlagBits::CONTINUOUS_MODE |
+                 kDirectReportFlags
     },
     {
         .sensorHandle = kSensorHandleMagneticField,
@@ -88,11 +132,12 @@ const SensorInfo kAllSensors[] = {
         .power = 6.7,
         .minDelay = 10000,
         .fifoReservedEventCount = 0,
-        .fifoMaxEventCount = 0,
+        .fifoMaxEventCount = kFifoMaxEventCount,
         .requiredPermission = "",
         .maxDelay = 500000,
         .flags = SensorFlagBits::DATA_INJECTION |
-                 SensorFlagBits::CONTINUOUS_MODE
+                 SensorFlagBits::CONTINUOUS_MODE |
+                 kDirectReportFlags
     },
     {
         .sensorHandle = kSensorHandleOrientation,
@@ -106,7 +151,7 @@ const SensorInfo kAllSensors[] = {
         .power = 9.7,
         .minDelay = 10000,
         .fifoReservedEventCount = 0,
-        .fifoMaxEventCount = 0,
+        .fifoMaxEventCount = kFifoMaxEventCount,
         .requiredPermission = "",
         .maxDelay = 500000,
         .flags = SensorFlagBits::DATA_INJECTION |
@@ -179,7 +224,7 @@ const SensorInfo kAllSensors[] = {
         .power = 20.0,
         .minDelay = 10000,
         .fifoReservedEventCount = 0,
-        .fifoMaxEventCount = 0,
+        .fifoMaxEventCount = kFifoMaxEventCount,
         .requiredPermission = "",
         .maxDelay = 500000,
         .flags = SensorFlagBits::DATA_INJECTION |
@@ -215,10 +260,11 @@ const SensorInfo kAllSensors[] = {
         .power = 6.7,
         .minDelay = 10000,
         .fifoReservedEventCount = 0,
-        .fifoMaxEventCount = 0,
+        .fifoMaxEventCount = kFifoMaxEventCount,
         .requiredPermission = "",
         .maxDelay = 500000,
-        .flags = SensorFlagBits::DATA_INJECTION | 0
+        .flags = SensorFlagBits::DATA_INJECTION |
+                 kDirectReportFlags
     },
     {
         .sensorHandle = kSensorHandleGyroscopeFieldUncalibrated,
@@ -232,11 +278,12 @@ const SensorInfo kAllSensors[] = {
         .power = 3.0,
         .minDelay = 10000,
         .fifoReservedEventCount = 0,
-        .fifoMaxEventCount = 0,
+        .fifoMaxEventCount = kFifoMaxEventCount,
         .requiredPermission = "",
         .maxDelay = 500000,
         .flags = SensorFlagBits::DATA_INJECTION |
-                 SensorFlagBits::CONTINUOUS_MODE
+                 SensorFlagBits::CONTINUOUS_MODE |
+                 kDirectReportFlags
     },
     {
         .sensorHandle = kSensorHandleHingeAngle0,
@@ -294,13 +341,85 @@ const SensorInfo kAllSensors[] = {
         .flags = SensorFlagBits::DATA_INJECTION |
                  SensorFlagBits::ON_CHANGE_MODE |
                  SensorFlagBits::WAKE_UP
+    },
+    {
+        .sensorHandle = kSensorHandleRotationVector,
+        .name = "Goldfish Rotation Vector sensor",
+        .vendor = kAospVendor,
+        .version = 1,
+        .type = SensorType::ROTATION_VECTOR,
+        .typeAsString = "android.sensor.rotation_vector",
+        .maxRange = 1.0,
+        .resolution = 1.0 / (1 << 24),
+        .power = 12.7,
+        .minDelay = 10000,
+        .fifoReservedEventCount = 0,
+        .fifoMaxEventCount = kFifoMaxEventCount,
+        .requiredPermission = "",
+        .maxDelay = 500000,
+        .flags = static_cast<uint32_t>(SensorFlagBits::CONTINUOUS_MODE)
+    },
+    {
+        .sensorHandle = kSensorHandleGameRotationVector,
+        .name = "Goldfish Game Rotation Vector sensor",
+        .vendor = kAospVendor,
+        .version = 1,
+        .type = SensorType::GAME_ROTATION_VECTOR,
+        .typeAsString = "android.sensor.game_rotation_vector",
+        .maxRange = 1.0,
+        .resolution = 1.0 / (1 << 24),
+        .power = 6.0,
+        .minDelay = 10000,
+        .fifoReservedEventCount = 0,
+        .fifoMaxEventCount = kFifoMaxEventCount,
+        .requiredPermission = "",
+        .maxDelay = 500000,
+        .flags = static_cast<uint32_t>(SensorFlagBits::CONTINUOUS_MODE)
+    },
+    {
+        .sensorHandle = kSensorHandleGravity,
+        .name = "Goldfish Gravity sensor",
+        .vendor = kAospVendor,
+        .version = 1,
+        .type = SensorType::GRAVITY,
+        .typeAsString = "android.sensor.gravity",
+        .maxRange = 39.3,
+        .resolution = 1.0 / 4032.0,
+        .power = 6.0,
+        .minDelay = 10000,
+        .fifoReservedEventCount = 0,
+        .fifoMaxEventCount = kFifoMaxEventCount,
+        .requiredPermission = "",
+        .maxDelay = 500000,
+        .flags = static_cast<uint32_t>(SensorFlagBits::CONTINUOUS_MODE)
+    },
+    {
+        .sensorHandle = kSensorHandleLinearAcceleration,
+        .name = "Goldfish Linear Acceleration sensor",
+        .vendor = kAospVendor,
+        .version = 1,
+        .type = SensorType::LINEAR_ACCELERATION,
+        .typeAsString = "android.sensor.linear_acceleration",
+        .maxRange = 39.3,
+        .resolution = 1.0 / 4032.0,
+        .power = 6.0,
+        .minDelay = 10000,
+        .fifoReservedEventCount = 0,
+        .fifoMaxEventCount = kFifoMaxEventCount,
+        .requiredPermission = "",
+        .maxDelay = 500000,
+        .flags = static_cast<uint32_t>(SensorFlagBits::CONTINUOUS_MODE)
     }};
 
-constexpr int kSensorNumber = sizeof(kAllSensors) / sizeof(kAllSensors[0]);
+static_assert(kSensorNumber == sizeof(kAllSensors) / sizeof(kAllSensors[0]),
+              "kSensorNumber must match the size of kAllSensors");
 
 static_assert(kSensorNumber == sizeof(kQemuSensorName) / sizeof(kQemuSensorName[0]),
               "sizes of kAllSensors and kQemuSensorName arrays must match");
 
+static_assert(kSensorNumber == sizeof(kVirtualSensorInputs) / sizeof(kVirtualSensorInputs[0]),
+              "sizes of kAllSensors and kVirtualSensorInputs arrays must match");
+
 int getSensorNumber() { return kSensorNumber; }
 
 bool isSensorHandleValid(const int h) {
@@ -315,4 +434,13 @@ const char* getQemuSensorNameByHandle(const int h) {
     return kQemuSensorName[h];
 }
 
+const SensorMask& getVirtualSensorInputs(const int h) {
+    return kVirtualSensorInputs[h];
+}
+
+bool isContinuousSensor(const SensorInfo& sensor) {
+    return (sensor.flags & static_cast<uint32_t>(SensorFlagBits::MASK_REPORTING_MODE)) ==
+           static_cast<uint32_t>(SensorFlagBits::CONTINUOUS_MODE);
+}
+
 }  // namespace goldfish
@@ -16,6 +16,7 @@
 
 #pragma once
 #include <android/hardware/sensors/2.1/types.h>
+#include <bitset>
 
 namespace goldfish {
 
@@ -36,10 +37,23 @@ constexpr int kSensorHandleGyroscopeFieldUncalibrated = 10;
 constexpr int kSensorHandleHingeAngle0 = 11;
 constexpr int kSensorHandleHingeAngle1 = 12;
 constexpr int kSensorHandleHingeAngle2 = 13;
+// virtual sensors, computed from the ones above by SensorFusion
+constexpr int kSensorHandleRotationVector = 14;
+constexpr int kSensorHandleGameRotationVector = 15;
+constexpr int kSensorHandleGravity = 16;
+constexpr int kSensorHandleLinearAcceleration = 17;
+
+// the size of kAllSensors, the handles are 0..kSensorNumber-1
+constexpr int kSensorNumber = 18;
+
+// a bit per sensor handle
+using SensorMask = std::bitset<kSensorNumber>;
 
 int getSensorNumber();
 bool isSensorHandleValid(int h);
 const SensorInfo* getSensorInfoByHandle(int h);
-const char* getQemuSensorNameByHandle(int h);
+const char* getQemuSensorNameByHandle(int h);   // nullptr for virtual sensors
+const SensorMask& getVirtualSensorInputs(int h); // none if not virtual
+bool isContinuousSensor(const SensorInfo& sensor);
 
 }  // namespace goldfish
@@ -0,0 +1,547 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Records the qemud "sensors" channel into a trace and replays a trace into
+// the HAL, with a socketpair standing in for the pipe:
+//
+//   sensors_trace record [-d seconds] [-p periodMs] <trace>
+//   sensors_trace replay [-m] <trace>
+//
+// A trace is kTraceMagic, the available sensors mask (a varint) and then a
+// record per qemud message: the microseconds since the previous record, the
+// size and the bytes of the message (varints but the bytes).
+//
+// The replay runs at the recorded pace or, with -m, as fast as the HAL
+// reads (the event timestamps get squeezed, expect most of the events to be
+// dropped as too fast for the sampling period). It matches the posted events
+// to the messages by their first value and reports the parse throughput, the
+// latency from the write of a message to the postEvents of its event and the
+// messages with no event (dropped by the HAL: too fast for the sampling
+// period or an unchanged on change value).
+
+#include <android-base/unique_fd.h>
+#include <cutils/native_handle.h>
+#include <linux/sockios.h>
+#include <poll.h>
+#include <qemud.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <utils/SystemClock.h>
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <cmath>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "multihal_sensors.h"
+#include "sensor_list.h"
+
+namespace {
+using ::android::base::unique_fd;
+using ::android::hardware::hidl_handle;
+using ::android::hardware::hidl_string;
+using ::android::hardware::hidl_vec;
+using ::android::hardware::sensors::V2_1::Event;
+using ::android::hardware::sensors::V2_1::SensorInfo;
+using ::android::hardware::sensors::V2_1::SensorType;
+using ::android::hardware::sensors::V2_1::implementation::IHalProxyCallback;
+using ::android::sp;
+using goldfish::SensorMask;
+
+constexpr char kTraceMagic[8] = {'s', 'e', 'n', 's', 't', 'r', 'c', '1'};
+constexpr int kMaxMessageSize = 4096;
+
+std::atomic<bool> g_interrupted = false;
+
+void usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s record [-d seconds] [-p periodMs] <trace>\n"
+            "       %s replay [-m] <trace>\n",
+            program, program);
+}
+
+void writeVarint(uint64_t value, FILE* f) {
+    while (value >= 0x80) {
+        fputc(int(value & 0x7F) | 0x80, f);
+        value >>= 7;
+    }
+    fputc(int(value), f);
+}
+
+bool readVarint(FILE* f, uint64_t* value) {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        const int c = fgetc(f);
+        if (c == EOF) {
+            return false;
+        }
+        v |= uint64_t(c & 0x7F) << shift;
+        if (!(c & 0x80)) {
+            *value = v;
+            return true;
+        }
+    }
+    return false;
+}
+
+struct TraceRecord {
+    int64_t timeUs;     // since the first record
+    std::string message;
+};
+
+bool loadTrace(const char* path, uint64_t* availableSensorsMask,
+               std::vector<TraceRecord>* records) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "ERROR: Could not open '%s': %s\n", path, strerror(errno));
+        return false;
+    }
+
+    char magic[sizeof(kTraceMagic)];
+    bool ok = (fread(magic, sizeof(magic), 1, f) == 1) &&
+              !memcmp(magic, kTraceMagic, sizeof(magic)) &&
+              readVarint(f, availableSensorsMask);
+
+    int64_t timeUs = 0;
+    uint64_t deltaUs;
+    while (ok && readVarint(f, &deltaUs)) {
+        uint64_t size;
+        if (!readVarint(f, &size) || (size > kMaxMessageSize)) {
+            ok = false;
+            break;
+        }
+        timeUs += deltaUs;
+        std::string message(size, '\0');
+        if (size && (fread(&message[0], size, 1, f) != 1)) {
+            ok = false;
+            break;
+        }
+        records->push_back({timeUs, std::move(message)});
+    }
+    fclose(f);
+
+    if (!ok) {
+        fprintf(stderr, "ERROR: '%s' is not a sensors trace or is truncated\n", path);
+    }
+    return ok;
+}
+
+bool sendCommand(const int fd, const char* cmd) {
+    if (qemud_channel_send(fd, cmd, -1) < 0) {
+        fprintf(stderr, "ERROR: Could not send '%s'\n", cmd);
+        return false;
+    }
+    return true;
+}
+
+int runRecord(const char* path, const int durationS, const int periodMs) {
+    unique_fd fd(qemud_channel_open("sensors"));
+    if (!fd.ok()) {
+        fprintf(stderr, "ERROR: Could not open the qemud 'sensors' channel\n");
+        return 1;
+    }
+
+    char buffer[kMaxMessageSize];
+    snprintf(buffer, sizeof(buffer), "time:%" PRId64, ::android::elapsedRealtimeNano());
+    if (!sendCommand(fd.get(), buffer) || !sendCommand(fd.get(), "list-sensors")) {
+        return 1;
+    }
+    int len = qemud_channel_recv(fd.get(), buffer, sizeof(buffer) - 1);
+    if (len < 0) {
+        fprintf(stderr, "ERROR: Could not receive the sensors list\n");
+        return 1;
+    }
+    buffer[len] = 0;
+    unsigned long long availableSensorsMask = 0;
+    if (sscanf(buffer, "%llu", &availableSensorsMask) != 1) {
+        fprintf(stderr, "ERROR: Could not parse the sensors list '%s'\n", buffer);
+        return 1;
+    }
+
+    // the virtual sensors are computed by the HAL, not recorded
+    SensorMask availableSensors(availableSensorsMask);
+    for (int h = 0; h < goldfish::kSensorNumber; ++h) {
+        availableSensors[h] = availableSensors[h] && goldfish::getQemuSensorNameByHandle(h);
+    }
+    for (int h = 0; h < goldfish::kSensorNumber; ++h) {
+        if (availableSensors[h]) {
+            snprintf(buffer, sizeof(buffer), "set:%s:1", goldfish::getQemuSensorNameByHandle(h));
+            if (!sendCommand(fd.get(), buffer)) {
+                return 1;
+            }
+        }
+    }
+    snprintf(buffer, sizeof(buffer), "set-delay:%d", periodMs);
+    if (!sendCommand(fd.get(), buffer)) {
+        return 1;
+    }
+
+    FILE* f = fopen(path, "wb");
+    if (!f) {
+        fprintf(stderr, "ERROR: Could not create '%s': %s\n", path, strerror(errno));
+        return 1;
+    }
+    fwrite(kTraceMagic, sizeof(kTraceMagic), 1, f);
+    writeVarint(availableSensorsMask, f);
+
+    const int64_t startNs = ::android::elapsedRealtimeNano();
+    const int64_t stopNs = startNs + int64_t(durationS) * 1000000000;
+    int64_t prevUs = 0;
+    uint64_t count = 0;
+    uint64_t bytes = 0;
+    while (!g_interrupted) {
+        const int64_t nowNs = ::android::elapsedRealtimeNano();
+        if (nowNs >= stopNs) {
+            break;
+        }
+
+        struct pollfd pfd = {fd.get(), POLLIN, 0};
+        const int ret = poll(&pfd, 1, std::min(int64_t(100), (stopNs - nowNs) / 1000000 + 1));
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "ERROR: poll failed: %s\n", strerror(errno));
+            break;
+        } else if (ret == 0) {
+            continue;
+        }
+
+        len = qemud_channel_recv(fd.get(), buffer, sizeof(buffer));
+        if (len < 0) {
+            fprintf(stderr, "ERROR: qemud_channel_recv failed\n");
+            break;
+        }
+        const int64_t timeUs = (::android::elapsedRealtimeNano() - startNs) / 1000;
+        writeVarint(timeUs - prevUs, f);
+        writeVarint(len, f);
+        fwrite(buffer, len, 1, f);
+        prevUs = timeUs;
+        ++count;
+        bytes += len;
+    }
+
+    const bool ok = !ferror(f);
+    fclose(f);
+    for (int h = 0; h < goldfish::kSensorNumber; ++h) {
+        if (availableSensors[h]) {
+            snprintf(buffer, sizeof(buffer), "set:%s:0", goldfish::getQemuSensorNameByHandle(h));
+            sendCommand(fd.get(), buffer);
+        }
+    }
+
+    if (!ok) {
+        fprintf(stderr, "ERROR: Could not write '%s'\n", path);
+        return 1;
+    }
+    printf("recorded %" PRIu64 " messages, %" PRIu64 " bytes in %.1f s\n",
+           count, bytes, prevUs / 1e6);
+    return 0;
+}
+
+// Pairs the posted events with the replayed messages, in order: an event
+// is for the oldest message with its value, the messages before it were
+// dropped.
+class EventMatcher {
+public:
+    void onMessageSent(const float value, const int64_t nowNs) {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_sent.push_back({nowNs, value});
+        ++m_sentCount;
+    }
+
+    void onEventsPosted(const std::vector<Event>& events) {
+        const int64_t nowNs = ::android::elapsedRealtimeNano();
+
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_postCount += 1;
+        m_lastEventNs = nowNs;
+        for (const Event& event : events) {
+            if (event.sensorType == SensorType::META_DATA) {
+                continue;
+            }
+            ++m_eventCount;
+            if (goldfish::getVirtualSensorInputs(event.sensorHandle).any()) {
+                ++m_virtualEventCount;  // no message of its own
+                continue;
+            }
+
+            const float value = event.u.data[0];
+            const auto i = std::find_if(m_sent.begin(), m_sent.end(),
+                                        [value](const SentMessage& m) {
+                                            return isSameValue(m.value, value);
+                                        });
+            if (i == m_sent.end()) {
+                ++m_unmatchedCount;
+                continue;
+            }
+
+            m_droppedCount += i - m_sent.begin();
+            m_latenciesNs.push_back(nowNs - i->sentNs);
+            m_sent.erase(m_sent.begin(), i + 1);
+        }
+    }
+
+    uint64_t getEventCount() const {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        return m_eventCount;
+    }
+
+    int64_t getLastEventNs() const {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        return m_lastEventNs;
+    }
+
+    void report(const int64_t startNs, const int64_t readNs, const int messageCount) {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        const double seconds = std::max(int64_t(1), readNs - startNs) / 1e9;
+
+        printf("replayed %d messages (%" PRIu64 " sensor values) in %.3f s, %.0f messages/s\n",
+               messageCount, m_sentCount, seconds, messageCount / seconds);
+        printf("posted %" PRIu64 " events (%" PRIu64 " virtual) in %" PRIu64
+               " postEvents calls\n",
+               m_eventCount, m_virtualEventCount, m_postCount);
+        printf("dropped %" PRIu64 " values, %" PRIu64 " events matched no value\n",
+               m_droppedCount + m_sent.size(), m_unmatchedCount);
+
+        if (!m_latenciesNs.empty()) {
+            std::sort(m_latenciesNs.begin(), m_latenciesNs.end());
+            const auto percentileUs = [this](const double p) {
+                const size_t i = std::min(m_latenciesNs.size() - 1,
+                                          size_t(p * m_latenciesNs.size()));
+                return m_latenciesNs[i] / 1000;
+            };
+            printf("latency: p50 %" PRId64 " us, p90 %" PRId64 " us, p99 %" PRId64
+                   " us, max %" PRId64 " us\n",
+                   percentileUs(0.5), percentileUs(0.9), percentileUs(0.99),
+                   m_latenciesNs.back() / 1000);
+        }
+    }
+
+private:
+    struct SentMessage {
+        int64_t sentNs;
+        float value;
+    };
+
+    // the HAL parses the values on its own, allow the last bit to differ
+    static bool isSameValue(const float a, const float b) {
+        return std::fabs(a - b) <= std::max(std::fabs(a), std::fabs(b)) * 1e-6f;
+    }
+
+    std::deque<SentMessage> m_sent;
+    std::vector<int64_t>    m_latenciesNs;
+    uint64_t                m_sentCount = 0;
+    uint64_t                m_postCount = 0;
+    uint64_t                m_eventCount = 0;
+    uint64_t                m_virtualEventCount = 0;
+    uint64_t                m_droppedCount = 0;
+    uint64_t                m_unmatchedCount = 0;
+    int64_t                 m_lastEventNs = 0;
+    mutable std::mutex      m_mtx;
+};
+
+class ReplaySensors : public goldfish::MultihalSensors {
+public:
+    ReplaySensors(unique_fd qemuSensorsFd, EventMatcher* matcher)
+            : MultihalSensors(std::move(qemuSensorsFd))
+            , m_matcher(matcher) {}
+
+    // the listener thread must not call the override once this object is gone
+    ~ReplaySensors() { stop(); }
+
+protected:
+    void postEventsToHalProxy(const sp<IHalProxyCallback>&,
+                              const std::vector<Event>& events,
+                              bool) override {
+        m_matcher->onEventsPosted(events);
+    }
+
+private:
+    EventMatcher* const m_matcher;
+};
+
+// The host end of the socketpair: answers "list-sensors", ignores the rest.
+void hostCommandThread(const int fd, const uint64_t availableSensorsMask) {
+    char buffer[kMaxMessageSize];
+    for (;;) {
+        const int len = qemud_channel_recv(fd, buffer, sizeof(buffer));
+        if (len < 0) {
+            break;
+        }
+        if ((len == 12) && !memcmp(buffer, "list-sensors", 12)) {
+            const int n = snprintf(buffer, sizeof(buffer), "%" PRIu64, availableSensorsMask);
+            qemud_channel_send(fd, buffer, n);
+        }
+    }
+}
+
+// Every line of a message but "sync:" and "guest-sync:" is a sensor value,
+// the first value after the name identifies the event.
+void onMessageSent(const std::string& message, const int64_t nowNs, EventMatcher* matcher) {
+    const char* const end = message.data() + message.size();
+    for (const char* line = message.data(); line < end; ) {
+        const char* lineEnd = static_cast<const char*>(memchr(line, '\n', end - line));
+        if (!lineEnd) {
+            lineEnd = end;
+        }
+
+        const char* colon = static_cast<const char*>(memchr(line, ':', lineEnd - line));
+        if (colon && strncmp(line, "sync:", 5) && strncmp(line, "guest-sync:", 11)) {
+            matcher->onMessageSent(strtof(colon + 1, nullptr), nowNs);
+        }
+        line = lineEnd + 1;
+    }
+}
+
+void dumpHal(goldfish::MultihalSensors* hal) {
+    fflush(stdout);
+    native_handle_t* nh = native_handle_create(1, 0);
+    nh->data[0] = STDOUT_FILENO;
+    hal->debug(hidl_handle(nh), hidl_vec<hidl_string>());
+    native_handle_delete(nh);
+}
+
+int runReplay(const char* path, const bool maxRate) {
+    uint64_t availableSensorsMask;
+    std::vector<TraceRecord> records;
+    if (!loadTrace(path, &availableSensorsMask, &records)) {
+        return 1;
+    }
+
+    unique_fd halFd;
+    unique_fd hostFd;
+    if (!::android::base::Socketpair(AF_LOCAL, SOCK_STREAM, 0, &halFd, &hostFd)) {
+        fprintf(stderr, "ERROR: Socketpair failed: %s\n", strerror(errno));
+        return 1;
+    }
+    std::thread hostThread(hostCommandThread, hostFd.get(), availableSensorsMask);
+
+    EventMatcher matcher;
+    {
+        ReplaySensors hal(std::move(halFd), &matcher);
+
+        // every sensor of the trace and the virtual sensors computed from
+        // them at their full rate, no batching
+        std::vector<int> sensorHandles;
+        hal.getSensorsList_2_1([&sensorHandles](const hidl_vec<SensorInfo>& sensors) {
+            for (const SensorInfo& sensor : sensors) {
+                sensorHandles.push_back(sensor.sensorHandle);
+            }
+        });
+        for (const int h : sensorHandles) {
+            hal.batch(h, int64_t(goldfish::getSensorInfoByHandle(h)->minDelay) * 1000, 0);
+            hal.activate(h, true);
+        }
+
+        const int64_t startNs = ::android::elapsedRealtimeNano();
+        for (const TraceRecord& record : records) {
+            if (g_interrupted) {
+                break;
+            }
+            if (!maxRate) {
+                const int64_t waitNs = startNs + record.timeUs * 1000 -
+                                       ::android::elapsedRealtimeNano();
+                if (waitNs > 0) {
+                    std::this_thread::sleep_for(std::chrono::nanoseconds(waitNs));
+                }
+            }
+
+            onMessageSent(record.message, ::android::elapsedRealtimeNano(), &matcher);
+            if (qemud_channel_send(hostFd.get(), record.message.data(),
+                                   record.message.size()) < 0) {
+                fprintf(stderr, "ERROR: Could not write to the HAL\n");
+                break;
+            }
+        }
+
+        // the HAL has read the trace once nothing is queued in the socket
+        for (int queued; !ioctl(hostFd.get(), SIOCOUTQ, &queued) && (queued > 0); ) {
+            std::this_thread::yield();
+        }
+        const int64_t readNs = ::android::elapsedRealtimeNano();
+
+        // and it is done once it has posted nothing for a while
+        constexpr int64_t kIdleNs = 200000000;
+        while (::android::elapsedRealtimeNano() -
+               std::max(matcher.getLastEventNs(), startNs) < kIdleNs) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+
+        matcher.report(startNs, readNs, records.size());
+        dumpHal(&hal);
+
+        for (const int h : sensorHandles) {
+            hal.activate(h, false);
+        }
+    }
+
+    ::shutdown(hostFd.get(), SHUT_RDWR);
+    hostThread.join();
+    return 0;
+}
+
+void onInterrupt(int) {
+    g_interrupted = true;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    const std::string mode = argv[1];
+
+    int durationS = 10;
+    int periodMs = 10;
+    bool maxRate = false;
+    optind = 2;
+    for (int opt; (opt = getopt(argc, argv, "d:p:m")) != -1; ) {
+        switch (opt) {
+        case 'd': durationS = atoi(optarg); break;
+        case 'p': periodMs = atoi(optarg); break;
+        case 'm': maxRate = true; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if ((optind != argc - 1) || (durationS <= 0) || (periodMs <= 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    signal(SIGINT, onInterrupt);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (mode == "record") {
+        return runRecord(argv[optind], durationS, periodMs);
+    } else if (mode == "replay") {
+        return runReplay(argv[optind], maxRate);
+    } else {
+        usage(argv[0]);
+        return 1;
+    }
+}
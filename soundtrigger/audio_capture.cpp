@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dlfcn.h>
+#include <log/log.h>
+#include "audio_capture.h"
+
+namespace android {
+namespace hardware {
+namespace soundtrigger {
+namespace V2_2 {
+namespace implementation {
+
+namespace {
+#ifdef __LP64__
+constexpr char kAudioHalLibrary[] = "/vendor/lib64/hw/android.hardware.audio@6.0-impl.ranchu.so";
+#else
+constexpr char kAudioHalLibrary[] = "/vendor/lib/hw/android.hardware.audio@6.0-impl.ranchu.so";
+#endif
+
+// audio/entry.cpp
+typedef void *(*OpenFunc)(uint32_t sampleRateHz);
+typedef int (*ReadFunc)(void *capture, int16_t *data, size_t frames);
+typedef void (*CloseFunc)(void *capture);
+
+struct AudioHal {
+    AudioHal() {
+        // already loaded by the audio HAL service, this is the same instance
+        void *dl = dlopen(kAudioHalLibrary, RTLD_NOW);
+        if (!dl) {
+            ALOGE("AudioCapture::%s:%d: %s", __func__, __LINE__, dlerror());
+            return;
+        }
+
+        open = reinterpret_cast<OpenFunc>(dlsym(dl, "goldfish_ring_capture_open"));
+        read = reinterpret_cast<ReadFunc>(dlsym(dl, "goldfish_ring_capture_read"));
+        close = reinterpret_cast<CloseFunc>(dlsym(dl, "goldfish_ring_capture_close"));
+        if (!open || !read || !close) {
+            ALOGE("AudioCapture::%s:%d: %s has no capture ring entry points",
+                  __func__, __LINE__, kAudioHalLibrary);
+            open = nullptr;
+        }
+    }
+
+    OpenFunc open = nullptr;
+    ReadFunc read = nullptr;
+    CloseFunc close = nullptr;
+};
+
+const AudioHal &getAudioHal() {
+    static const AudioHal audioHal;
+    return audioHal;
+}
+}  // namespace
+
+AudioCapture::AudioCapture() {}
+
+AudioCapture::~AudioCapture() {
+    close();
+}
+
+bool AudioCapture::isOpen() const {
+    return mCapture != nullptr;
+}
+
+bool AudioCapture::open() {
+    if (mCapture) {
+        return true;
+    }
+
+    const AudioHal &audioHal = getAudioHal();
+    if (!audioHal.open) {
+        return false;
+    }
+
+    mCapture = audioHal.open(kSampleRateHz);
+    if (!mCapture) {
+        ALOGE("AudioCapture::%s:%d: no capture ring, vendor.audio.capture_ring_ms is not set",
+              __func__, __LINE__);
+        return false;
+    }
+    return true;
+}
+
+void AudioCapture::close() {
+    if (mCapture) {
+        getAudioHal().close(mCapture);
+        mCapture = nullptr;
+    }
+}
+
+bool AudioCapture::read(int16_t *data, const size_t frames) {
+    if (!mCapture) {
+        return false;
+    }
+
+    const int res = getAudioHal().read(mCapture, data, frames);
+    if (res < 0) {
+        ALOGE("AudioCapture::%s:%d: the read failed with %d", __func__, __LINE__, res);
+        return false;
+    }
+    return true;
+}
+
+}  // namespace implementation
+}  // namespace V2_2
+}  // namespace soundtrigger
+}  // namespace hardware
+}  // namespace android
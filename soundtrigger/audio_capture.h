@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+namespace android {
+namespace hardware {
+namespace soundtrigger {
+namespace V2_2 {
+namespace implementation {
+
+// Reads the microphone (16 kHz mono) from the capture ring of the audio HAL
+// (vendor.audio.capture_ring_ms), which shares the device between the
+// sound trigger and the other capture clients. This HAL runs in the audio
+// HAL process, the ring is reached through the entry points of its library
+// rather than by opening a device and an input stream of its own; there is
+// no capture without the ring.
+struct AudioCapture {
+    static constexpr uint32_t kSampleRateHz = 16000;
+
+    AudioCapture();
+    ~AudioCapture();
+
+    bool open();
+    void close();
+    bool isOpen() const;
+
+    // Blocks until all the frames are read, false on errors.
+    bool read(int16_t *data, size_t frames);
+
+    AudioCapture(const AudioCapture &) = delete;
+    AudioCapture &operator=(const AudioCapture &) = delete;
+
+private:
+    void *mCapture = nullptr;
+};
+
+}  // namespace implementation
+}  // namespace V2_2
+}  // namespace soundtrigger
+}  // namespace hardware
+}  // namespace android
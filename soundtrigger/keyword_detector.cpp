@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <math.h>
+#include <algorithm>
+#include "keyword_detector.h"
+
+namespace android {
+namespace hardware {
+namespace soundtrigger {
+namespace V2_2 {
+namespace implementation {
+
+namespace {
+
+float frameLevelDbfs(const int16_t *frame, const size_t n) {
+    double sum = 0;
+    for (size_t i = 0; i < n; ++i) {
+        sum += double(frame[i]) * frame[i];
+    }
+    return 10 * log10(sum / n / (32768.0 * 32768.0) + 1e-10);
+}
+
+std::vector<float> getEnvelope(const std::vector<int16_t> &keyword) {
+    std::vector<float> envelope;
+    for (size_t i = 0; i + KeywordDetector::kFrameSize <= keyword.size();
+            i += KeywordDetector::kFrameSize) {
+        envelope.push_back(frameLevelDbfs(&keyword[i], KeywordDetector::kFrameSize));
+    }
+
+    float mean = 0;
+    for (const float x : envelope) {
+        mean += x;
+    }
+    mean /= std::max<size_t>(envelope.size(), 1);
+
+    float norm = 0;
+    for (float &x : envelope) {
+        x -= mean;
+        norm += x * x;
+    }
+    norm = sqrtf(norm);
+
+    if (norm > 0) {
+        for (float &x : envelope) {
+            x /= norm;
+        }
+    } else {
+        envelope.clear();  // flat, nothing to match
+    }
+    return envelope;
+}
+
+}  // namespace
+
+KeywordDetector::KeywordDetector(const std::vector<int16_t> &keyword)
+        : mTemplate(getEnvelope(keyword))
+        , mWindowFrames(mTemplate.empty() ? kEnergyWindowFrames : mTemplate.size())
+        , mLevels(mWindowFrames) {}
+
+void KeywordDetector::reset() {
+    mPos = 0;
+    mCount = 0;
+}
+
+bool KeywordDetector::process(const int16_t *frame, unsigned &confidence) {
+    mLevels[mPos] = frameLevelDbfs(frame, kFrameSize);
+    mPos = (mPos + 1) % mWindowFrames;
+    mCount = std::min(mCount + 1, mWindowFrames);
+    if (mCount < mWindowFrames) {
+        return false;
+    }
+
+    confidence = mTemplate.empty() ? matchEnergy() : matchTemplate();
+    if (confidence < mThreshold) {
+        return false;
+    }
+
+    reset();
+    return true;
+}
+
+float KeywordDetector::getLevel(const size_t i) const {
+    return mLevels[(mPos + mWindowFrames - 1 - i) % mWindowFrames];
+}
+
+// The share of the window above the gate.
+unsigned KeywordDetector::matchEnergy() const {
+    size_t loud = 0;
+    for (const float level : mLevels) {
+        loud += (level > kGateDbfs);
+    }
+    return loud * 100 / mWindowFrames;
+}
+
+unsigned KeywordDetector::matchTemplate() const {
+    const size_t n = mWindowFrames;
+
+    float mean = 0;
+    for (size_t i = 0; i < n; ++i) {
+        mean += getLevel(i);
+    }
+    mean /= n;
+    if (mean < kGateDbfs) {
+        return 0;  // silence has an envelope too
+    }
+
+    float dot = 0;
+    float norm = 0;
+    for (size_t i = 0; i < n; ++i) {
+        const float x = getLevel(n - 1 - i) - mean;  // oldest first
+        dot += x * mTemplate[i];
+        norm += x * x;
+    }
+    if (norm <= 0) {
+        return 0;
+    }
+
+    return std::max(0.0f, dot / sqrtf(norm)) * 100;
+}
+
+}  // namespace implementation
+}  // namespace V2_2
+}  // namespace soundtrigger
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <vector>
+
+namespace android {
+namespace hardware {
+namespace soundtrigger {
+namespace V2_2 {
+namespace implementation {
+
+// A lightweight keyword detector working on the level of 10 ms frames of
+// 16 kHz mono audio. The sound model data is either empty, then any sound
+// louder than kGateDbfs lasting most of a kEnergyWindowFrames window is a
+// detection, or the keyword recorded as 16 kHz mono 16 bit PCM: the level
+// envelope of the last frames is then matched against the envelope of the
+// recording (normalized cross-correlation). The confidence is 0..100.
+struct KeywordDetector {
+    static constexpr uint32_t kSampleRateHz = 16000;
+    static constexpr size_t kFrameSize = kSampleRateHz / 100;
+    static constexpr float kGateDbfs = -45;
+    static constexpr size_t kEnergyWindowFrames = 50;
+
+    explicit KeywordDetector(const std::vector<int16_t> &keyword);
+
+    // Feeds one frame of kFrameSize samples. Returns true if the keyword
+    // ends with it, the detector then starts over.
+    bool process(const int16_t *frame, unsigned &confidence);
+
+    void setThreshold(unsigned confidence) { mThreshold = confidence; }
+    size_t getWindowFrames() const { return mWindowFrames; }
+    void reset();
+
+private:
+    unsigned matchEnergy() const;
+    unsigned matchTemplate() const;
+    float getLevel(size_t i) const;  // i frames ago
+
+    std::vector<float> mTemplate;  // zero mean, unit norm
+    const size_t mWindowFrames;
+    std::vector<float> mLevels;    // dBFS, circular
+    size_t mPos = 0;
+    size_t mCount = 0;             // valid levels
+    unsigned mThreshold = 60;
+};
+
+}  // namespace implementation
+}  // namespace V2_2
+}  // namespace soundtrigger
+}  // namespace hardware
+}  // namespace android
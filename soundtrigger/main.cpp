@@ -15,6 +15,26 @@
  */
 
 #include <android/hardware/soundtrigger/2.2/ISoundTriggerHw.h>
+#include <android/hidl/memory/1.0/IMemory.h>
+#include <hidlmemory/mapping.h>
+#include <cutils/properties.h>
+#include <log/log.h>
+#include <system/sound_trigger.h>
+#include <utils/Timers.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "audio_capture.h"
+#include "keyword_detector.h"
 
 namespace android {
 namespace hardware {
@@ -23,18 +43,85 @@ namespace V2_2 {
 namespace implementation {
 
 using ::android::hardware::soundtrigger::V2_0::SoundModelHandle;
+using ::android::hardware::soundtrigger::V2_0::SoundModelType;
 using ::android::hardware::soundtrigger::V2_0::ISoundTriggerHwCallback;
+using ::android::hardware::soundtrigger::V2_0::PhraseRecognitionExtra;
 using ::android::hardware::soundtrigger::V2_0::RecognitionMode;
+using ::android::hardware::audio::common::V2_0::AudioChannelMask;
+using ::android::hardware::audio::common::V2_0::AudioFormat;
 using ::android::hardware::audio::common::V2_0::Uuid;
+using ::android::hidl::memory::V1_0::IMemory;
+
+namespace {
+
+constexpr size_t kFrameSize = KeywordDetector::kFrameSize;
+constexpr size_t kFrameDurationMs = 10;
+// the audio sent with an event: the keyword and what was before it
+constexpr size_t kPreambleMs = 500;
+constexpr size_t kHistoryMs = 3000;
+// the capture stays open that long after the last recognition stopped, the
+// framework restarts the recognition after every event
+constexpr auto kCaptureLinger = std::chrono::seconds(2);
+constexpr unsigned kDefaultConfidence = 60;
+constexpr char kCaptureRingMsProperty[] = "vendor.audio.capture_ring_ms";
+
+typedef ISoundTriggerHwCallback::RecognitionEvent RecognitionEvent;
+typedef ISoundTriggerHwCallback::PhraseRecognitionEvent PhraseRecognitionEvent;
+typedef ISoundTriggerHwCallback::RecognitionStatus RecognitionStatus;
+
+nsecs_t threadCpuTimeNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return s2ns(ts.tv_sec) + ts.tv_nsec;
+}
+
+std::vector<int16_t> toSamples(const uint8_t *data, const size_t size) {
+    std::vector<int16_t> samples(size / sizeof(int16_t));
+    memcpy(samples.data(), data, samples.size() * sizeof(int16_t));
+    return samples;
+}
+
+std::vector<int16_t> toSamples(const hidl_memory &memory) {
+    if (memory.size() == 0) {
+        return {};
+    }
+
+    sp<IMemory> mem = mapMemory(memory);
+    if (!mem) {
+        ALOGE("%s:%d: could not map the sound model", __func__, __LINE__);
+        return {};
+    }
+
+    mem->read();
+    std::vector<int16_t> samples =
+        toSamples(static_cast<const uint8_t *>(static_cast<void *>(mem->getPointer())),
+                  mem->getSize());
+    mem->commit();
+    return samples;
+}
+
+}  // namespace
 
 struct SoundTriggerHw : public ISoundTriggerHw {
+    ~SoundTriggerHw() {
+        if (mThread.joinable()) {
+            {
+                std::lock_guard<std::mutex> guard(mMutex);
+                mExit = true;
+            }
+            mCond.notify_all();
+            mThread.join();
+        }
+    }
+
     // Methods from V2_0::ISoundTriggerHw follow.
     Return<void> getProperties(getProperties_cb _hidl_cb) override {
         V2_0::ISoundTriggerHw::Properties props;
 
         props.implementor = "The Android Open Source Project";
-        props.description = "The Andtoid Studio Emulator Soundtrigger no-op implementation";
-        props.version = 0;
+        props.description = "The Android Studio Emulator Soundtrigger energy and "
+                            "template matching keyword detector";
+        props.version = 1;
         props.uuid = (Uuid){
             .timeLow = 0x04030201,
             .timeMid = 0x0605,
@@ -42,14 +129,14 @@ struct SoundTriggerHw : public ISoundTriggerHw {
             .variantAndClockSeqHigh = 0x0A09,
             .node = hidl_array<uint8_t, 6>({ 'r', 'a', 'n', 'c', 'h', 'u' }),
         };
-        props.maxSoundModels = 42;
+        props.maxSoundModels = mCaptureAvailable ? 42 : 0;
         props.maxKeyPhrases = 4242;
         props.maxUsers = 7;
         props.recognitionModes = RecognitionMode::VOICE_TRIGGER
                                  | RecognitionMode::GENERIC_TRIGGER;
         props.captureTransition = false;
-        props.maxBufferMs = 0;
-        props.concurrentCapture = false;
+        props.maxBufferMs = kHistoryMs;
+        props.concurrentCapture = true;
         props.triggerInEvent = true;
         props.powerConsumptionMw = 42;
 
@@ -61,10 +148,10 @@ struct SoundTriggerHw : public ISoundTriggerHw {
                                 const sp<V2_0::ISoundTriggerHwCallback>& callback,
                                 int32_t cookie,
                                 loadSoundModel_cb _hidl_cb) override {
-        (void)soundModel;
         (void)callback;
         (void)cookie;
-        _hidl_cb(0, genHandle());
+        _hidl_cb(0, addModel(soundModel.type, 0,
+                             toSamples(soundModel.data.data(), soundModel.data.size())));
         return Void();
     }
 
@@ -72,35 +159,42 @@ struct SoundTriggerHw : public ISoundTriggerHw {
                                       const sp<V2_0::ISoundTriggerHwCallback>& callback,
                                       int32_t cookie,
                                       loadPhraseSoundModel_cb _hidl_cb) override {
-        (void)soundModel;
         (void)callback;
         (void)cookie;
-        _hidl_cb(0, genHandle());
+        const V2_0::ISoundTriggerHw::SoundModel &common = soundModel.common;
+        _hidl_cb(0, addModel(common.type, getPhraseId(soundModel.phrases),
+                             toSamples(common.data.data(), common.data.size())));
         return Void();
     }
 
     Return<int32_t> unloadSoundModel(int32_t modelHandle) override {
-        (void)modelHandle;
-        return 0;
+        std::lock_guard<std::mutex> guard(mMutex);
+        return mModels.erase(modelHandle) ? 0 : -EINVAL;
     }
 
     Return<int32_t> startRecognition(int32_t modelHandle,
                                      const V2_0::ISoundTriggerHw::RecognitionConfig& config,
                                      const sp<V2_0::ISoundTriggerHwCallback>& callback,
                                      int32_t cookie) override {
-        (void)modelHandle;
-        (void)config;
-        (void)callback;
-        (void)cookie;
-        return 0;
+        return startRecognitionImpl(modelHandle, config, callback, cookie);
     }
 
     Return<int32_t> stopRecognition(int32_t modelHandle) override {
-        (void)modelHandle;
+        std::lock_guard<std::mutex> guard(mMutex);
+        const auto i = mModels.find(modelHandle);
+        if (i == mModels.end()) {
+            return -EINVAL;
+        }
+
+        i->second->recognizing = false;
         return 0;
     }
 
     Return<int32_t> stopAllRecognitions() override {
+        std::lock_guard<std::mutex> guard(mMutex);
+        for (auto &kv : mModels) {
+            kv.second->recognizing = false;
+        }
         return 0;
     }
 
@@ -109,10 +203,9 @@ struct SoundTriggerHw : public ISoundTriggerHw {
                                     const sp<V2_1::ISoundTriggerHwCallback>& callback,
                                     int32_t cookie,
                                     loadSoundModel_2_1_cb _hidl_cb) override {
-        (void)soundModel;
         (void)callback;
         (void)cookie;
-        _hidl_cb(0, genHandle());
+        _hidl_cb(0, addModel(soundModel.header.type, 0, toSamples(soundModel.data)));
         return Void();
     }
 
@@ -120,10 +213,10 @@ struct SoundTriggerHw : public ISoundTriggerHw {
                                           const sp<V2_1::ISoundTriggerHwCallback>& callback,
                                           int32_t cookie,
                                           loadPhraseSoundModel_2_1_cb _hidl_cb) override {
-        (void)soundModel;
         (void)callback;
         (void)cookie;
-        _hidl_cb(0, genHandle());
+        _hidl_cb(0, addModel(soundModel.common.header.type, getPhraseId(soundModel.phrases),
+                             toSamples(soundModel.common.data)));
         return Void();
     }
 
@@ -131,25 +224,318 @@ struct SoundTriggerHw : public ISoundTriggerHw {
                                          const V2_1::ISoundTriggerHw::RecognitionConfig& config,
                                          const sp<V2_1::ISoundTriggerHwCallback>& callback,
                                          int32_t cookie) override {
-        (void)modelHandle;
-        (void)config;
-        (void)callback;
-        (void)cookie;
-        return 0;
+        // the 2.1 callbacks extend the 2.0 ones, the events are sent as 2.0
+        return startRecognitionImpl(modelHandle, config.header, callback, cookie);
     }
 
     // Methods from V2_2::ISoundTriggerHw follow.
     Return<int32_t> getModelState(int32_t modelHandle) override {
-        (void)modelHandle;
+        std::unique_lock<std::mutex> lock(mMutex);
+        const auto i = mModels.find(modelHandle);
+        if (i == mModels.end() || !i->second->recognizing) {
+            return -EINVAL;
+        }
+
+        Model &model = *i->second;
+        const sp<ISoundTriggerHwCallback> callback = model.recognitionCallback;
+        const int32_t cookie = model.recognitionCookie;
+        const SoundModelType type = model.type;
+        PhraseRecognitionEvent event = makeEvent(
+            modelHandle, model,
+            static_cast<RecognitionStatus>(RECOGNITION_STATUS_GET_STATE_RESPONSE), 0);
+        lock.unlock();
+
+        deliverEvent(callback, type, event, cookie);
+        return 0;
+    }
+
+    Return<void> debug(const hidl_handle& fd, const hidl_vec<hidl_string>& options) override {
+        (void)options;
+        if (fd.getNativeHandle() == nullptr || fd->numFds < 1) {
+            return Void();
+        }
+
+        const int fd0 = fd->data[0];
+        std::lock_guard<std::mutex> guard(mMutex);
+        dprintf(fd0, "Ranchu sound trigger: %zu models, %zu ms of history\n",
+                mModels.size(), mHistory.size() * 1000 / KeywordDetector::kSampleRateHz);
+        for (const auto &kv : mModels) {
+            const Model &m = *kv.second;
+            dprintf(fd0, "  Model %d: %s, %s, %u detections, "
+                         "detector cpu %" PRId64 " us/s (max %" PRId64 " us per frame), "
+                         "detection latency %" PRId64 " ms (max %" PRId64 " ms)\n",
+                    kv.first,
+                    m.isTemplate ? "template" : "energy",
+                    m.recognizing ? "recognizing" : "stopped",
+                    m.detections,
+                    m.frames ? (ns2us(m.cpuNs) * 100 / int64_t(m.frames)) : 0,
+                    ns2us(m.maxFrameCpuNs),
+                    m.detections ? ns2ms(m.latencyNs / m.detections) : 0,
+                    ns2ms(m.maxLatencyNs));
+        }
+        return Void();
+    }
+
+private:
+    struct Model {
+        Model(const SoundModelType type, const uint32_t phraseId,
+              const std::vector<int16_t> &keyword)
+                : type(type)
+                , phraseId(phraseId)
+                , isTemplate(!keyword.empty())
+                , detector(keyword) {}
+
+        const SoundModelType type;
+        const uint32_t phraseId;  // KEYPHRASE models
+        const bool isTemplate;
+        KeywordDetector detector;
+
+        bool recognizing = false;
+        sp<ISoundTriggerHwCallback> recognitionCallback;
+        int32_t recognitionCookie = 0;
+        int32_t captureHandle = 0;
+        bool captureRequested = false;
+
+        // for debug()
+        uint32_t detections = 0;
+        uint64_t frames = 0;
+        nsecs_t cpuNs = 0;
+        nsecs_t maxFrameCpuNs = 0;
+        nsecs_t latencyNs = 0;
+        nsecs_t maxLatencyNs = 0;
+    };
+
+    struct Detection {
+        sp<ISoundTriggerHwCallback> callback;
+        SoundModelType type;
+        SoundModelHandle handle;
+        PhraseRecognitionEvent event;
+        int32_t cookie;
+    };
+
+    static uint32_t getPhraseId(const hidl_vec<V2_0::ISoundTriggerHw::Phrase> &phrases) {
+        return phrases.size() ? phrases[0].id : 0;
+    }
+
+    SoundModelHandle addModel(const SoundModelType type, const uint32_t phraseId,
+                              const std::vector<int16_t> &keyword) {
+        std::lock_guard<std::mutex> guard(mMutex);
+        const SoundModelHandle handle = genHandle();
+        mModels[handle] = std::make_unique<Model>(type, phraseId, keyword);
+        return handle;
+    }
+
+    int32_t startRecognitionImpl(const int32_t modelHandle,
+                                 const V2_0::ISoundTriggerHw::RecognitionConfig& config,
+                                 const sp<ISoundTriggerHwCallback>& callback,
+                                 const int32_t cookie) {
+        if (!mCaptureAvailable) {
+            return -ENODEV;
+        }
+
+        std::lock_guard<std::mutex> guard(mMutex);
+        const auto i = mModels.find(modelHandle);
+        if (i == mModels.end() || !callback) {
+            return -EINVAL;
+        }
+
+        Model &model = *i->second;
+        model.detector.reset();
+        model.detector.setThreshold(config.phrases.size()
+                                    ? config.phrases[0].confidenceLevel
+                                    : kDefaultConfidence);
+        model.recognitionCallback = callback;
+        model.recognitionCookie = cookie;
+        model.captureHandle = config.captureHandle;
+        model.captureRequested = config.captureRequested;
+        model.recognizing = true;
+
+        if (!mThread.joinable()) {
+            mThread = std::thread(&SoundTriggerHw::threadLoop, this);
+        }
+        mCond.notify_all();
         return 0;
     }
 
+    bool isRecognizingLocked() const {
+        for (const auto &kv : mModels) {
+            if (kv.second->recognizing) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // The audio before the detection: the keyword window and the preamble.
+    PhraseRecognitionEvent makeEvent(const SoundModelHandle handle, const Model &model,
+                                     const RecognitionStatus status,
+                                     const unsigned confidence) const {
+        PhraseRecognitionEvent event = {};
+        RecognitionEvent &e = event.common;
+        e.status = status;
+        e.type = model.type;
+        e.model = handle;
+        e.captureAvailable = model.captureRequested;
+        e.captureSession = model.captureHandle;
+        e.captureDelayMs = 0;
+        e.triggerInData = true;
+        e.audioConfig.sampleRateHz = KeywordDetector::kSampleRateHz;
+        e.audioConfig.channelMask = AudioChannelMask::IN_MONO;
+        e.audioConfig.format = AudioFormat::PCM_16_BIT;
+
+        const size_t windowMs = model.detector.getWindowFrames() * kFrameDurationMs;
+        const size_t samples = std::min(
+            mHistory.size(), (windowMs + kPreambleMs) * KeywordDetector::kSampleRateHz / 1000);
+        const size_t durationMs = samples * 1000 / KeywordDetector::kSampleRateHz;
+        e.capturePreambleMs = (durationMs > windowMs) ? (durationMs - windowMs) : 0;
+        e.data.resize(samples * sizeof(int16_t));
+        int16_t *dst = reinterpret_cast<int16_t *>(e.data.data());
+        std::copy(mHistory.end() - samples, mHistory.end(), dst);
+
+        if (model.type == SoundModelType::KEYPHRASE) {
+            PhraseRecognitionExtra extra = {};
+            extra.id = model.phraseId;
+            extra.recognitionModes = RecognitionMode::VOICE_TRIGGER | 0;
+            extra.confidenceLevel = confidence;
+            event.phraseExtras = {extra};
+        }
+        return event;
+    }
+
+    static void deliverEvent(const sp<ISoundTriggerHwCallback> &callback,
+                             const SoundModelType type,
+                             const PhraseRecognitionEvent &event,
+                             const int32_t cookie) {
+        if (type == SoundModelType::KEYPHRASE) {
+            callback->phraseRecognitionCallback(event, cookie);
+        } else {
+            callback->recognitionCallback(event.common, cookie);
+        }
+    }
+
+    // Aborts every recognition, the microphone cannot be read.
+    void abortAll() {
+        std::vector<Detection> aborted;
+        {
+            std::lock_guard<std::mutex> guard(mMutex);
+            for (auto &kv : mModels) {
+                Model &model = *kv.second;
+                if (model.recognizing) {
+                    model.recognizing = false;
+                    aborted.push_back({model.recognitionCallback, model.type, kv.first,
+                                       makeEvent(kv.first, model, RecognitionStatus::ABORT, 0),
+                                       model.recognitionCookie});
+                }
+            }
+        }
+
+        for (const Detection &d : aborted) {
+            deliverEvent(d.callback, d.type, d.event, d.cookie);
+        }
+    }
+
+    void threadLoop() {
+        std::vector<int16_t> frame(kFrameSize);
+
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                if (!mExit && !isRecognizingLocked()) {
+                    if (!mCond.wait_for(lock, kCaptureLinger, [this](){
+                            return mExit || isRecognizingLocked();
+                        })) {
+                        mCapture.close();
+                        mHistory.clear();
+                        mCond.wait(lock, [this](){
+                            return mExit || isRecognizingLocked();
+                        });
+                    }
+                }
+                if (mExit) {
+                    break;
+                }
+            }
+
+            // only this thread opens, closes and reads the capture
+            if (!mCapture.open() || !mCapture.read(frame.data(), kFrameSize)) {
+                mCapture.close();
+                abortAll();
+                continue;
+            }
+            const nsecs_t frameNs = systemTime(SYSTEM_TIME_MONOTONIC);
+
+            std::vector<Detection> detections;
+            {
+                std::lock_guard<std::mutex> guard(mMutex);
+                mHistory.insert(mHistory.end(), frame.begin(), frame.end());
+                const size_t maxHistory = kHistoryMs * KeywordDetector::kSampleRateHz / 1000;
+                if (mHistory.size() > maxHistory) {
+                    mHistory.erase(mHistory.begin(),
+                                   mHistory.begin() + (mHistory.size() - maxHistory));
+                }
+
+                for (auto &kv : mModels) {
+                    Model &model = *kv.second;
+                    if (!model.recognizing) {
+                        continue;
+                    }
+
+                    const nsecs_t cpu0 = threadCpuTimeNs();
+                    unsigned confidence = 0;
+                    const bool detected = model.detector.process(frame.data(), confidence);
+                    const nsecs_t cpuNs = threadCpuTimeNs() - cpu0;
+                    model.cpuNs += cpuNs;
+                    model.maxFrameCpuNs = std::max(model.maxFrameCpuNs, cpuNs);
+                    ++model.frames;
+
+                    if (detected) {
+                        // one event per startRecognition
+                        model.recognizing = false;
+                        detections.push_back({model.recognitionCallback, model.type, kv.first,
+                                              makeEvent(kv.first, model,
+                                                        RecognitionStatus::SUCCESS,
+                                                        confidence),
+                                              model.recognitionCookie});
+                    }
+                }
+            }
+
+            for (const Detection &d : detections) {
+                const nsecs_t latencyNs = systemTime(SYSTEM_TIME_MONOTONIC) - frameNs;
+                {
+                    std::lock_guard<std::mutex> guard(mMutex);
+                    const auto i = mModels.find(d.handle);
+                    if (i != mModels.end()) {
+                        ++i->second->detections;
+                        i->second->latencyNs += latencyNs;
+                        i->second->maxLatencyNs = std::max(i->second->maxLatencyNs, latencyNs);
+                    }
+                }
+                ALOGI("SoundTriggerHw::%s:%d: model %d detected, latency %" PRId64 " us",
+                      __func__, __LINE__, d.handle, ns2us(latencyNs));
+                deliverEvent(d.callback, d.type, d.event, d.cookie);
+            }
+        }
+
+        mCapture.close();
+    }
+
     SoundModelHandle genHandle() {
         mHandle = std::max(0, mHandle + 1);
         return mHandle;
     }
 
+    std::mutex mMutex;
+    std::condition_variable mCond;  // a recognition has started
+    std::map<SoundModelHandle, std::unique_ptr<Model>> mModels;
+    std::deque<int16_t> mHistory;   // the last kHistoryMs of audio
+    AudioCapture mCapture;
+    // the microphone is read from the audio HAL capture ring, the sound
+    // trigger has no capture without it
+    const bool mCaptureAvailable = property_get_int32(kCaptureRingMsProperty, 0) > 0;
     SoundModelHandle mHandle = 0;
+    bool mExit = false;
+    std::thread mThread;
 };
 
 extern "C" ISoundTriggerHw* HIDL_FETCH_ISoundTriggerHw(const char* /* name */) {
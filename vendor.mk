@@ -153,10 +153,16 @@ endif
 
 ifneq ($(EMULATOR_VENDOR_NO_SOUND_TRIGGER),true)
 PRODUCT_PACKAGES += android.hardware.soundtrigger@2.2-impl.ranchu
+# the sound trigger reads the microphone from the audio HAL capture ring
+PRODUCT_PROPERTY_OVERRIDES += vendor.audio.capture_ring_ms=1000
 endif
 
 ifneq ($(EMULATOR_VENDOR_NO_SOUND),true)
 PRODUCT_PACKAGES += android.hardware.audio@6.0-impl.ranchu
+PRODUCT_PROPERTY_OVERRIDES += \
+    aaudio.mmap_policy=2 \
+    aaudio.mmap_exclusive_policy=2 \
+    aaudio.hw_burst_min_usec=2000
 PRODUCT_COPY_FILES += \
     device/generic/goldfish/audio/policy/audio_policy_configuration.xml:$(TARGET_COPY_OUT_VENDOR)/etc/audio_policy_configuration.xml \
     device/generic/goldfish/audio/policy/primary_audio_policy_configuration.xml:$(TARGET_COPY_OUT_VENDOR)/etc/primary_audio_policy_configuration.xml